@@ -1,11 +1,16 @@
 #include <cstring>
 #include <cstdlib>
+#include <fstream>
 #include <iostream>
 #include <sstream>
 
+#include <pthread.h>
+
 #include <forth/runtime.hpp>
 #include <forth/parser.hpp>
 #include <forth/tester.hpp>
+#include <forth/fusion_recorder.hpp>
+#include <forth/profiler.hpp>
 
 /// Display help text
 static void
@@ -22,15 +27,59 @@ ErrorHelp(
     "  --help -- Display help." << std::endl <<
     "  --test <testfile> -- Run all the tests in the given file" <<
     std::endl <<
+    "  -j <jobs> -- Run that many tests in parallel, default 1" <<
+    std::endl <<
+    "  --max-steps <steps> -- Fail a test that takes more steps, 0 for no" <<
+    std::endl <<
+    "      limit, default 1000000000" << std::endl <<
+    "  --record-fusion <tablefile> -- Run all given source files and write" <<
+    std::endl <<
+    "      a fusion table for the decoder based on their execution" <<
+    std::endl <<
+    "  --compile <imagefile> -- Write the program as a precompiled image" <<
+    std::endl <<
+    "      (.42c) instead of running it" << std::endl <<
+    "  --emit-cpp <cppfile> -- Write the program as C++ source for a" <<
+    std::endl <<
+    "      native build instead of running it" << std::endl <<
+    "  --profile <stackfile> -- Run the program step by step, print a" <<
+    std::endl <<
+    "      profile to stderr and write folded stacks for flame graphs" <<
+    std::endl <<
+    "  --memo <entries> -- Answer calls of pure lines from a cache of that" <<
+    std::endl <<
+    "      many results, default 0 (off)" << std::endl <<
+    "  --jit <threshold> -- Compile a line to native code once it has" <<
+    std::endl <<
+    "      been entered <threshold> times, default 0 (off)" << std::endl <<
+    "  --lint -- Report where the program underflows the data stack for" <<
+    std::endl <<
+    "      certain instead of running it" << std::endl <<
     std::endl <<
     "Parameters:" << std::endl <<
     std::endl <<
-    "  <filename> -- File name of forthytwo source file" << std::endl <<
+    "  <filename> -- File name of forthytwo source file or precompiled" <<
+    std::endl <<
+    "      image. In record mode, several source files can be given." <<
+    std::endl <<
     std::endl;
 
   exit( EXIT_FAILURE);
 }
 
+/// Load a program from a source file or a precompiled image
+static void
+LoadProgram(
+  const char * a_input_file_name,
+  forth::Runtime &a_forth)
+{
+  if ( forth::ImageFile::IsImage( a_input_file_name))
+    a_forth.LoadImage( a_input_file_name);
+  else
+    forth::Parser::ParseFromFile( a_input_file_name, a_forth);
+  a_forth.SetFileName( a_input_file_name);
+}
+
 /// Exception to be thrown if something went wrong in test mode
 class TestException : public std::runtime_error
 {
@@ -44,98 +93,367 @@ class TestException : public std::runtime_error
 
 };
 
-/// Run all the test cases
+/// Outcome of a single test case
+struct TestOutcome
+{
+  TestOutcome()
+    : m_done( false)
+    , m_ok( false)
+  {
+  }
+
+  /// Flag if the test case has been run
+  bool m_done;
+
+  /// Flag if the test case passed
+  bool m_ok;
+
+  /// Text to print for the test case
+  std::string m_report;
+
+  /// Message of the exception that stopped the test case, if any
+  std::string m_error;
+};
+
+/** Run a single test case on a_forth, which holds the program. Call
+ * leaves the runtime ready for the next test case unless it fails.
+ */
+static void
+RunTestCase(
+  const forth::Tester &a_tester,
+  size_t a_test_case_ind,
+  forth::Runtime &a_forth,
+  uint64_t a_max_steps,
+  TestOutcome &a_outcome)
+{
+  const forth::Tester::TestCase &test_case =
+    a_tester.GetTestCase(
+      a_test_case_ind);
+
+  std::ostringstream report;
+  report << "  " << (a_test_case_ind + 1) << "/" << a_tester.CountTestCases()
+         << ": " << test_case.Name() << " --> ";
+
+  // Collect what the program prints to show it with the result
+  std::string printed;
+  a_forth.SetOutputCapture( &printed);
+
+  std::vector<forth::Runtime::Cell> dataStack;
+  try
+  {
+    // Call the test function with the input stack
+    size_t start_line = test_case.GetStartLine();
+    if (start_line >= a_forth.CountProgramLines())
+    {
+      std::ostringstream str;
+      str << "Test case '" << test_case.Name() << "': Illegal start line";
+      throw TestException( str.str().c_str());
+    }
+    dataStack = a_forth.Call( start_line, test_case.GetInput(), a_max_steps);
+  }
+  catch (const std::exception &ex)
+  {
+    a_forth.SetOutputCapture( NULL);
+    a_outcome.m_report = report.str() + printed;
+    a_outcome.m_error = ex.what();
+    return;
+  }
+  a_forth.SetOutputCapture( NULL);
+  report << printed;
+
+  const std::vector<forth::Runtime::Cell> &output = test_case.GetOutput();
+
+  // Compare the data stack with the output stack of the test case. A test
+  // that exits fails.
+  bool result_identical = (dataStack == output) && !a_forth.HasExited();
+  report << "    " << (result_identical ? "pass" : "FAILED") << std::endl;
+
+  if ( a_forth.HasExited())
+  {
+    report << "    Exited with code " << a_forth.GetExitCode() << std::endl;
+  }
+
+  if ( !result_identical)
+  {
+    report << "    Stack should be: [";
+    for ( size_t i = 0; i < output.size(); ++i)
+      report << output[i] << " ";
+    report << "]" << std::endl;
+
+    report << "    Stack is       : [";
+    for ( size_t i = 0; i < dataStack.size(); ++i)
+      report << dataStack[i] << " ";
+    report << "]" << std::endl;
+  }
+
+  a_outcome.m_ok = result_identical;
+  a_outcome.m_report = report.str();
+}
+
+/// Test cases shared by the worker threads
+struct TestPool
+{
+  /// Test cases to run
+  const forth::Tester * m_tester;
+
+  /// Program to test
+  const forth::Runtime * m_program;
+
+  /// File name of the program for error messages
+  const char * m_input_file_name;
+
+  /// Maximal number of steps of a test case
+  uint64_t m_max_steps;
+
+  /// Outcome of each test case
+  std::vector<TestOutcome> m_outcomes;
+
+  /// Index of the next test case to run
+  size_t m_next;
+
+  /// Protects m_outcomes and m_next
+  pthread_mutex_t m_mutex;
+
+  /// Signalled whenever a test case is done
+  pthread_cond_t m_done;
+};
+
+/** Worker thread, runs test cases until there are no more. They share one
+ * runtime, so the stacks are allocated once per worker.
+ */
+static void *
+RunTestWorker(
+  void * a_pool)
+{
+  TestPool &pool = *static_cast<TestPool *>( a_pool);
+  forth::Runtime forth;
+  forth.ShareProgram( *pool.m_program);
+  forth.SetFileName( pool.m_input_file_name);
+
+  for (;; )
+  {
+    pthread_mutex_lock( &pool.m_mutex);
+    size_t test_case_ind = pool.m_next;
+    if ( test_case_ind < pool.m_outcomes.size())
+      ++pool.m_next;
+    pthread_mutex_unlock( &pool.m_mutex);
+
+    if ( test_case_ind >= pool.m_outcomes.size())
+      break;
+
+    TestOutcome outcome;
+    RunTestCase( *pool.m_tester, test_case_ind, forth, pool.m_max_steps,
+      outcome);
+    outcome.m_done = true;
+
+    // A failed test case stops the run and leaves the runtime as it failed
+    bool failed = !outcome.m_error.empty();
+    pthread_mutex_lock( &pool.m_mutex);
+    pool.m_outcomes[test_case_ind] = outcome;
+    if ( failed)
+      pool.m_next = pool.m_outcomes.size();
+    pthread_cond_broadcast( &pool.m_done);
+    pthread_mutex_unlock( &pool.m_mutex);
+    if ( failed)
+      break;
+  }
+  return NULL;
+}
+
+/** Run all the test cases on a_jobs threads. The program is loaded once,
+ * each worker calls the lines of its test cases on a runtime of its own.
+ * The results are printed in the order of the test cases. A test case that
+ * takes more than a_max_steps steps fails, unless a_max_steps is 0.
+ */
 static bool
 RunTestCases(
   const char * a_test_file_name,
-  const char * a_input_file_name)
+  const char * a_input_file_name,
+  size_t a_jobs,
+  uint64_t a_max_steps)
 {
   forth::Tester tester;
   tester.ParseFromFile( a_test_file_name);
 
+  forth::Runtime program;
+  LoadProgram( a_input_file_name, program);
+
   std::cout << "Running tests ..." << std::endl;
 
+  TestPool pool;
+  pool.m_tester = &tester;
+  pool.m_program = &program;
+  pool.m_input_file_name = a_input_file_name;
+  pool.m_max_steps = a_max_steps;
+  pool.m_outcomes.resize( tester.CountTestCases());
+  pool.m_next = 0;
+  pthread_mutex_init( &pool.m_mutex, NULL);
+  pthread_cond_init( &pool.m_done, NULL);
+
+  std::vector<pthread_t> workers;
+  for (size_t i = 0; i < a_jobs && i < tester.CountTestCases(); ++i)
+  {
+    pthread_t worker;
+    if ( pthread_create( &worker, NULL, RunTestWorker, &pool) != 0)
+      break;
+    workers.push_back( worker);
+  }
+
+  // Without any worker, run the test cases on this thread
+  if ( workers.empty())
+    RunTestWorker( &pool);
+
   bool all_tests_ok = true;
+  std::string error;
 
   for ( size_t test_case_ind = 0;
         test_case_ind < tester.CountTestCases();
         ++test_case_ind)
   {
-    const forth::Tester::TestCase &test_case =
-      tester.GetTestCase(
-        test_case_ind);
+    pthread_mutex_lock( &pool.m_mutex);
+    while ( !pool.m_outcomes[test_case_ind].m_done)
+      pthread_cond_wait( &pool.m_done, &pool.m_mutex);
+    TestOutcome outcome = pool.m_outcomes[test_case_ind];
+    pthread_mutex_unlock( &pool.m_mutex);
 
-    std::cout << "  " << (test_case_ind + 1) << "/" << tester.CountTestCases()
-              << ": " << test_case.Name() << " --> ";
+    std::cout << outcome.m_report;
     std::cout.flush();
 
-    forth::Runtime forth;
-    forth::Parser::ParseFromFile( a_input_file_name, forth);
-    forth.SetFileName( a_input_file_name);
-
-    // Compile an additional line with the input stack and a call to the test function
-    size_t line_count = forth.CountProgramLines();
-    size_t start_line = test_case.GetStartLine();
-    if (start_line >= line_count)
+    // A test case that failed with an exception stops the run
+    if ( !outcome.m_error.empty())
     {
-      std::ostringstream str;
-      str << "Test case '" << test_case.Name() << "': Illegal start line";
-      throw TestException( str.str().c_str());
+      error = outcome.m_error;
+      pthread_mutex_lock( &pool.m_mutex);
+      pool.m_next = pool.m_outcomes.size();
+      pthread_mutex_unlock( &pool.m_mutex);
+      break;
     }
-    const std::vector<forth::Runtime::Cell> &input = test_case.GetInput();
 
-    for (size_t index = 0; index < input.size(); ++index)
-      forth.Compile( line_count, input[index]);
-    forth.Compile( line_count, start_line);
-    forth.Compile( line_count, forth::Runtime::kOpCodeCall);
+    all_tests_ok &= outcome.m_ok;
+  }
+
+  for (size_t i = 0; i < workers.size(); ++i)
+    pthread_join( workers[i], NULL);
+  pthread_cond_destroy( &pool.m_done);
+  pthread_mutex_destroy( &pool.m_mutex);
 
-    // Run the program until we reach the last entry of the additional line
-    size_t ip_col = forth.CountInstructionsInLine( start_line);
-    forth.ResetIp( line_count);
-    while ( !forth.IsIpAt( start_line, ip_col) )
-    {
-      forth.ComputeStep();
-    }
+  if ( !error.empty())
+    throw TestException( error.c_str());
 
-    const std::vector<forth::Runtime::Cell> &output = test_case.GetOutput();
-    const std::vector<forth::Runtime::Cell> &dataStack = forth.GetDataStack();
+  return all_tests_ok;
+}
 
-    // Compare the data stack with the output stack of the test case
-    bool result_identical = (dataStack == output);
-    std::cout << "    " << (result_identical ? "pass" : "FAILED") <<
-      std::endl;
+/// Record the executed instruction sequences and write a fusion table
+static void
+RecordFusion(
+  const char * a_table_file_name,
+  char * * a_input_file_names,
+  int a_count)
+{
+  forth::FusionRecorder recorder;
 
-    if ( !result_identical)
-    {
-      std::cout << "    Stack should be: [";
-      for ( size_t i = 0; i < output.size(); ++i)
-        std::cout << output[i] << " ";
-      std::cout << "]" << std::endl;
-
-      std::cout << "    Stack is       : [";
-      for ( size_t i = 0; i < dataStack.size(); ++i)
-        std::cout << dataStack[i] << " ";
-      std::cout << "]" << std::endl;
-    }
+  for (int i = 0; i < a_count; ++i)
+    recorder.Record( a_input_file_names[i]);
 
-    all_tests_ok &= result_identical;
+  std::ofstream table( a_table_file_name);
+  if ( !table.is_open())
+  {
+    std::ostringstream str;
+    str << "Cannot open '" << a_table_file_name << "'";
+    throw std::runtime_error( str.str().c_str());
   }
-  return all_tests_ok;
+  recorder.WriteTable( table);
 }
 
-/// Run the interpreter normally
+/// Parse a source file and write it as an image
 static void
-RunSource(
+CompileImage(
+  const char * a_image_file_name,
   const char * a_input_file_name)
 {
   forth::Runtime forth;
 
   forth::Parser::ParseFromFile( a_input_file_name, forth);
-  forth.SetFileName( a_input_file_name);
-  for (;; )
+  forth.WriteImage( a_image_file_name);
+}
+
+/// Translate a program to C++ source
+static void
+EmitCpp(
+  const char * a_cpp_file_name,
+  const char * a_input_file_name)
+{
+  forth::Runtime forth;
+
+  LoadProgram( a_input_file_name, forth);
+  forth.WriteCpp( a_cpp_file_name);
+}
+
+/// Check a program without running it, return false if it has findings
+static bool
+LintSource(
+  const char * a_input_file_name)
+{
+  forth::Runtime forth;
+
+  LoadProgram( a_input_file_name, forth);
+  std::vector<std::string> messages = forth.Lint();
+  for (size_t i = 0; i < messages.size(); ++i)
+    std::cerr << messages[i] << std::endl;
+  return messages.empty();
+}
+
+/// Run the interpreter normally, return the exit code of the program
+static int
+RunSource(
+  const char * a_input_file_name,
+  size_t a_memo_entries,
+  uint32_t a_jit_threshold)
+{
+  forth::Runtime forth;
+
+  LoadProgram( a_input_file_name, forth);
+  forth.SetMemoization( a_memo_entries);
+  forth.SetJit( a_jit_threshold);
+  return forth.Run().m_code;
+}
+
+/** Run the interpreter step by step and profile the program. Print the
+ * summary to stderr and write the folded stacks.
+ */
+static int
+ProfileSource(
+  const char * a_stack_file_name,
+  const char * a_input_file_name)
+{
+  forth::ProfilingRuntime forth;
+  forth::Profiler profiler;
+
+  LoadProgram( a_input_file_name, forth);
+  std::ofstream stacks( a_stack_file_name);
+  if ( !stacks.is_open())
+  {
+    std::ostringstream str;
+    str << "Cannot open '" << a_stack_file_name << "'";
+    throw std::runtime_error( str.str().c_str());
+  }
+
+  // A program that fails has a profile, too
+  int code = 0;
+  try
   {
-    forth.ComputeStep();
+    code = forth.Profile( profiler);
   }
+  catch (...)
+  {
+    forth.FlushOutput();
+    profiler.WriteSummary( std::cerr);
+    profiler.WriteFoldedStacks( stacks);
+    throw;
+  }
+  profiler.WriteSummary( std::cerr);
+  profiler.WriteFoldedStacks( stacks);
+  return code;
 }
 
 int
@@ -144,6 +462,15 @@ main(
   char * * argv)
 {
   const char *  test_file_name = NULL;
+  const char *  fusion_file_name = NULL;
+  const char *  image_file_name = NULL;
+  const char *  profile_file_name = NULL;
+  const char *  cpp_file_name = NULL;
+  size_t        jobs = 1;
+  uint64_t      max_steps = 1000000000;
+  size_t        memo_entries = 0;
+  uint32_t      jit_threshold = 0;
+  bool          lint = false;
 
   // Parse the command line
   int opti = 1;
@@ -162,6 +489,94 @@ main(
       test_file_name = argv[opti];
       opti++;
     }
+    else
+    if ( !strcmp( argv[opti], "--record-fusion"))
+    {
+      ++opti;
+      if ( opti >= argc)
+        ErrorHelp( "Missing argument after --record-fusion");
+
+      fusion_file_name = argv[opti];
+      opti++;
+    }
+    else
+    if ( !strcmp( argv[opti], "-j"))
+    {
+      ++opti;
+      if ( opti >= argc)
+        ErrorHelp( "Missing argument after -j");
+
+      jobs = strtoul( argv[opti], NULL, 10);
+      if ( jobs == 0)
+        ErrorHelp( "Need at least one job");
+      opti++;
+    }
+    else
+    if ( !strcmp( argv[opti], "--max-steps"))
+    {
+      ++opti;
+      if ( opti >= argc)
+        ErrorHelp( "Missing argument after --max-steps");
+
+      max_steps = strtoull( argv[opti], NULL, 10);
+      opti++;
+    }
+    else
+    if ( !strcmp( argv[opti], "--compile"))
+    {
+      ++opti;
+      if ( opti >= argc)
+        ErrorHelp( "Missing argument after --compile");
+
+      image_file_name = argv[opti];
+      opti++;
+    }
+    else
+    if ( !strcmp( argv[opti], "--emit-cpp"))
+    {
+      ++opti;
+      if ( opti >= argc)
+        ErrorHelp( "Missing argument after --emit-cpp");
+
+      cpp_file_name = argv[opti];
+      opti++;
+    }
+    else
+    if ( !strcmp( argv[opti], "--profile"))
+    {
+      ++opti;
+      if ( opti >= argc)
+        ErrorHelp( "Missing argument after --profile");
+
+      profile_file_name = argv[opti];
+      opti++;
+    }
+    else
+    if ( !strcmp( argv[opti], "--memo"))
+    {
+      ++opti;
+      if ( opti >= argc)
+        ErrorHelp( "Missing argument after --memo");
+
+      memo_entries = strtoul( argv[opti], NULL, 10);
+      opti++;
+    }
+    else
+    if ( !strcmp( argv[opti], "--jit"))
+    {
+      ++opti;
+      if ( opti >= argc)
+        ErrorHelp( "Missing argument after --jit");
+
+      jit_threshold = strtoul( argv[opti], NULL, 10);
+      opti++;
+    }
+    else
+    if ( !strcmp( argv[opti], "--lint"))
+    {
+      lint = true;
+      opti++;
+    }
     else
       break;
   }
@@ -180,16 +595,34 @@ main(
 
   try
   {
+    if (fusion_file_name != NULL)
+      RecordFusion( fusion_file_name, argv + opti, argc - opti);
+    else
+    if (image_file_name != NULL)
+      CompileImage( image_file_name, inputFileName);
+    else
+    if (cpp_file_name != NULL)
+      EmitCpp( cpp_file_name, inputFileName);
+    else
+    if (lint)
+    {
+      if ( !LintSource( inputFileName))
+        return EXIT_FAILURE;
+    }
+    else
+    if (profile_file_name != NULL)
+      return ProfileSource( profile_file_name, inputFileName);
+    else
     if (test_file_name != NULL)
     {
-      if ( !RunTestCases( test_file_name, inputFileName))
+      if ( !RunTestCases( test_file_name, inputFileName, jobs, max_steps))
       {
         std::cerr << "AT LEAST ONE TEST FAILED!" << std::endl;
         return EXIT_FAILURE;
       }
     }
     else
-      RunSource( inputFileName);
+      return RunSource( inputFileName, memo_entries, jit_threshold);
   }
   catch (const std::exception &ex)
   {
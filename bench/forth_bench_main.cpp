@@ -0,0 +1,504 @@
+#include <cstring>
+#include <cstdlib>
+#include <cstdio>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <forth/runtime.hpp>
+#include <forth/parser.hpp>
+
+#ifndef FORTH_EXAMPLES_DIR
+#define FORTH_EXAMPLES_DIR "examples"
+#endif
+
+/// Display help text
+static void
+ErrorHelp(
+  const char * msg)
+{
+  std::cerr << "forth_bench: " << msg << std::endl <<
+    "forth_bench: Benchmarks of the interpreter core" << std::endl <<
+    "USAGE: forth_bench [OPTIONS] [<benchmark> ...]" << std::endl <<
+    std::endl <<
+    "Options:" << std::endl <<
+    std::endl <<
+    "  -h" << std::endl <<
+    "  --help -- Display help." << std::endl <<
+    "  -s <scale> -- Scale the number of iterations, default 1" <<
+    std::endl <<
+    "  -t <seconds> -- Minimal time to run each benchmark, default 0.5" <<
+    std::endl <<
+    "  -e <directory> -- Directory of the example programs" << std::endl <<
+    "  -j <entries> -- Compile lines to native code after this many entries"
+    << std::endl <<
+    std::endl <<
+    "Parameters:" << std::endl <<
+    std::endl <<
+    "  <benchmark> -- Name of a benchmark to run. Without, all of them run." <<
+    std::endl <<
+    std::endl;
+
+  exit( EXIT_FAILURE);
+}
+
+/// Runtime that counts the steps of a program and times its runs
+class BenchRuntime : public forth::Runtime
+{
+  public:
+
+    /// Measurements of a program
+    struct Measurement
+    {
+      /// Steps of one run, as ComputeStep counts them
+      uint64_t m_steps;
+
+      /// Maximal number of items on the data stack
+      size_t m_dataDepth;
+
+      /// Maximal number of frames on the return stack
+      size_t m_returnDepth;
+
+      /// Number of timed runs
+      size_t m_runs;
+
+      /// Time of all timed runs in seconds
+      double m_seconds;
+    };
+
+    /** Step through the program once to count the steps and the stack
+     * depths, then run it at full speed until a_minSeconds have passed.
+     *
+     * ComputeStep performs no tail calls, so the depth of the return stack
+     * may be larger than the one Run needs.
+     */
+    Measurement
+    Measure(
+      double a_minSeconds)
+    {
+      Measurement result = { 0, 0, 0, 0, 0.0 };
+
+      Seal();
+      Restart();
+      while ( !HasExited())
+      {
+        ComputeStep();
+        ++result.m_steps;
+        if ( m_dataStack.Size() > result.m_dataDepth)
+          result.m_dataDepth = m_dataStack.Size();
+        if ( m_returnStack.Size() > result.m_returnDepth)
+          result.m_returnDepth = m_returnStack.Size();
+      }
+
+      do
+      {
+        Restart();
+        double start = Now();
+        Run();
+        result.m_seconds += Now() - start;
+        ++result.m_runs;
+      }
+      while ( result.m_seconds < a_minSeconds);
+
+      return result;
+    }
+
+  protected:
+
+    /// Start the program again with empty stacks
+    void
+    Restart()
+    {
+      m_dataStack.Clear();
+      m_returnStack.Clear();
+      ResetIp();
+    }
+
+    /// Current time in seconds
+    static double
+    Now()
+    {
+      struct timespec now;
+      clock_gettime( CLOCK_MONOTONIC, &now);
+      return now.tv_sec + now.tv_nsec * 1e-9;
+    }
+
+};
+
+/// Source code of a program, lines are numbered like in a source file
+class Source
+{
+  public:
+
+    Source()
+      : m_line( forth::Runtime::kOpCodeFirstUser)
+    {
+      // The lines in front of the first user line are ignored
+      for (int i = 1; i < forth::Runtime::kOpCodeFirstUser; ++i)
+        m_text << std::endl;
+    }
+
+    /// Append a line and return its number
+    forth::Runtime::Cell
+    Line(
+      const std::string &a_numbers)
+    {
+      m_text << a_numbers << std::endl;
+      return m_line++;
+    }
+
+    /// Get the number of the next line
+    forth::Runtime::Cell
+    NextLine() const
+    {
+      return m_line;
+    }
+
+    /// Get the text of the program
+    std::string
+    Text() const
+    {
+      return m_text.str();
+    }
+
+  private:
+
+    /// Text of the program so far
+    std::ostringstream m_text;
+
+    /// Number of the next line
+    forth::Runtime::Cell m_line;
+};
+
+/** Text that pushes a number. Pushing 42 would call a line, so it is
+ * computed as 41 plus 1.
+ */
+static std::string
+Num(
+  long a_number)
+{
+  std::ostringstream str;
+  if ( a_number == forth::Runtime::kOpCodeCall)
+    str << (a_number - 1) << " 1 0 42";
+  else
+    str << a_number;
+  return str.str();
+}
+
+/** Program that runs a line of numbers a_iterations times. The numbers have
+ * to leave the stack as they found it. Line 23 is empty, so the numbers can
+ * call it.
+ */
+static std::string
+LoopProgram(
+  const std::string &a_body,
+  long a_iterations)
+{
+  Source source;
+
+  // 21: iterations 22 call 0 exit
+  // 22: body 1 minus loop
+  // 23:
+  // 24: 0
+  //
+  // Only lines with numbers are compiled, line 24 makes line 23 exist.
+  source.Line( Num( a_iterations) + " 22 42 0 14 42");
+  source.Line( a_body + " 1 1 42 11 42");
+  source.Line( "");
+  source.Line( "0");
+  return source.Text();
+}
+
+/** Program that calls line 23 a_iterations times and drops its result.
+ * a_lines holds line 23 and the lines behind it.
+ */
+static std::string
+CallProgram(
+  const std::string &a_argument,
+  const std::vector<std::string> &a_lines,
+  long a_iterations)
+{
+  Source source;
+
+  // 21: iterations 22 call 0 exit
+  // 22: argument 23 call drop 1 minus loop
+  source.Line( Num( a_iterations) + " 22 42 0 14 42");
+  source.Line( a_argument + " 23 42 10 42 1 1 42 11 42");
+  for (size_t i = 0; i < a_lines.size(); ++i)
+    source.Line( a_lines[i]);
+  return source.Text();
+}
+
+/** Program that recurses a_depth times, not as a tail call, and returns
+ * from all of the calls.
+ */
+static std::string
+RecursionProgram(
+  long a_depth,
+  long a_iterations)
+{
+  // 23: dup not 24 plus call
+  // 24: 1 minus 23 call dup drop
+  // 25:
+  // 26: 0
+  std::vector<std::string> lines;
+  lines.push_back( "9 42 7 42 24 0 42 42");
+  lines.push_back( "1 1 42 23 42 9 42 10 42");
+  lines.push_back( "");
+  lines.push_back( "0");
+  return CallProgram( Num( a_depth), lines, a_iterations);
+}
+
+/// Program that calls a chain of a_length lines, each adding one
+static std::string
+ChainProgram(
+  long a_length,
+  long a_iterations)
+{
+  // 23 + i: 1 plus (24 + i) call dup drop
+  std::vector<std::string> lines;
+  for (long i = 0; i + 1 < a_length; ++i)
+    lines.push_back( "1 0 42 " + Num( 24 + i) + " 42 9 42 10 42");
+  lines.push_back( "1 0 42");
+  return CallProgram( "0", lines, a_iterations);
+}
+
+/// A benchmark and the program it runs
+struct Benchmark
+{
+  /// Name to select the benchmark
+  std::string m_name;
+
+  /// Source code, empty if m_file is used
+  std::string m_source;
+
+  /// Source file to run
+  std::string m_file;
+};
+
+/// Collect the benchmarks, iterations are scaled by a_scale
+static std::vector<Benchmark>
+MakeBenchmarks(
+  double a_scale,
+  const std::string &a_examples)
+{
+  struct Micro
+  {
+    const char * m_name;
+    const char * m_body;
+  };
+
+  // Bodies of the loop benchmarks. Each leaves the stack as it found it.
+  static const Micro kMicros[] =
+  {
+    { "literal", "1 2 3 4 10 42 10 42 10 42 10 42" },
+    { "plus", "3 4 0 42 10 42" },
+    { "minus", "3 4 1 42 10 42" },
+    { "mult", "3 4 2 42 10 42" },
+    { "div", "12 3 3 42 10 42" },
+    { "mod", "12 5 4 42 10 42" },
+    { "and", "3 4 5 42 10 42" },
+    { "or", "3 0 6 42 10 42" },
+    { "not", "3 7 42 10 42" },
+    { "swap", "3 4 8 42 10 42 10 42" },
+    { "dup", "3 9 42 10 42 10 42" },
+    { "drop", "3 10 42" },
+    { "loop", "" },
+    { "emit", "65 12 42" },
+    { "read", "13 42 10 42" },
+    { "over", "3 4 15 42 10 42 10 42 10 42" },
+    { "call", "23 42" },
+    { "call_computed", "23 9 42 10 42 42" },
+  };
+
+  long iterations = static_cast<long>( 1000000 * a_scale);
+  if ( iterations < 1)
+    iterations = 1;
+
+  std::vector<Benchmark> benchmarks;
+  for (size_t i = 0; i < sizeof( kMicros) / sizeof( kMicros[0]); ++i)
+  {
+    Benchmark benchmark;
+    benchmark.m_name = kMicros[i].m_name;
+    benchmark.m_source = LoopProgram( kMicros[i].m_body, iterations);
+    benchmarks.push_back( benchmark);
+  }
+
+  // Exit stops the program, so each run exits once
+  Benchmark exiting;
+  exiting.m_name = "exit";
+  exiting.m_source = LoopProgram( "", 1);
+  benchmarks.push_back( exiting);
+
+  Benchmark recursion;
+  recursion.m_name = "recursion";
+  recursion.m_source = RecursionProgram( 100000, iterations / 100000 + 1);
+  benchmarks.push_back( recursion);
+
+  Benchmark chain;
+  chain.m_name = "chain";
+  chain.m_source = ChainProgram( 1000, iterations / 1000 + 1);
+  benchmarks.push_back( chain);
+
+  Benchmark euler1;
+  euler1.m_name = "euler1";
+  euler1.m_file = a_examples + "/euler1.42";
+  benchmarks.push_back( euler1);
+
+  Benchmark bottles;
+  bottles.m_name = "bottles";
+  bottles.m_file = a_examples + "/bottles.42";
+  benchmarks.push_back( bottles);
+
+  return benchmarks;
+}
+
+/// Run one benchmark and print a row of the report
+static void
+RunBenchmark(
+  const Benchmark &a_benchmark,
+  double a_minSeconds,
+  uint32_t a_jitThreshold,
+  int a_null)
+{
+  BenchRuntime forth;
+  forth.SetOutputFile( a_null);
+  if ( a_jitThreshold)
+    forth.SetJit( a_jitThreshold);
+  if ( a_benchmark.m_file.empty())
+    forth::Parser::ParseFromMemory( a_benchmark.m_name.c_str(),
+      a_benchmark.m_source.data(), a_benchmark.m_source.size(), forth);
+  else
+    forth::Parser::ParseFromFile( a_benchmark.m_file.c_str(), forth);
+
+  BenchRuntime::Measurement result = forth.Measure( a_minSeconds);
+  double seconds = result.m_seconds / result.m_runs;
+  double steps = static_cast<double>( result.m_steps);
+
+  std::cout << std::left << std::setw( 16) << a_benchmark.m_name
+            << std::right
+            << std::setw( 12) << result.m_steps
+            << std::setw( 8) << result.m_runs
+            << std::fixed << std::setprecision( 2)
+            << std::setw( 10) << seconds * 1e9 / steps
+            << std::setw( 12) << steps / seconds * 1e-6
+            << std::setw( 8) << result.m_dataDepth
+            << std::setw( 8) << result.m_returnDepth
+            << std::endl;
+}
+
+int
+main(
+  int argc,
+  char * * argv)
+{
+  double scale = 1.0;
+  double min_seconds = 0.5;
+  std::string examples = FORTH_EXAMPLES_DIR;
+  uint32_t jit_threshold = 0;
+
+  // Parse the command line
+  int opti = 1;
+
+  while ( opti < argc)
+  {
+    if ( !strcmp( argv[opti], "-h") || !strcmp( argv[opti], "--help"))
+      ErrorHelp( "Display help text.");
+    else
+    if ( !strcmp( argv[opti], "-s"))
+    {
+      ++opti;
+      if ( opti >= argc)
+        ErrorHelp( "Missing argument after -s");
+
+      scale = strtod( argv[opti], NULL);
+      if ( scale <= 0)
+        ErrorHelp( "Scale must be positive");
+      opti++;
+    }
+    else
+    if ( !strcmp( argv[opti], "-t"))
+    {
+      ++opti;
+      if ( opti >= argc)
+        ErrorHelp( "Missing argument after -t");
+
+      min_seconds = strtod( argv[opti], NULL);
+      opti++;
+    }
+    else
+    if ( !strcmp( argv[opti], "-e"))
+    {
+      ++opti;
+      if ( opti >= argc)
+        ErrorHelp( "Missing argument after -e");
+
+      examples = argv[opti];
+      opti++;
+    }
+    else
+    if ( !strcmp( argv[opti], "-j"))
+    {
+      ++opti;
+      if ( opti >= argc)
+        ErrorHelp( "Missing argument after -j");
+
+      jit_threshold = strtoul( argv[opti], NULL, 10);
+      if ( !jit_threshold)
+        ErrorHelp( "Threshold must be positive");
+      opti++;
+    }
+    else
+      break;
+  }
+
+  // Nothing is printed or read while measuring
+  int null = open( "/dev/null", O_RDWR);
+  if ( null < 0 || dup2( null, STDIN_FILENO) < 0)
+  {
+    std::cerr << "forth_bench: Cannot open /dev/null" << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  std::vector<Benchmark> benchmarks = MakeBenchmarks( scale, examples);
+
+  std::cout << std::left << std::setw( 16) << "Benchmark" << std::right
+            << std::setw( 12) << "Steps"
+            << std::setw( 8) << "Runs"
+            << std::setw( 10) << "ns/step"
+            << std::setw( 12) << "Msteps/s"
+            << std::setw( 8) << "Data"
+            << std::setw( 8) << "Return"
+            << std::endl;
+
+  try
+  {
+    bool any = false;
+    for (size_t i = 0; i < benchmarks.size(); ++i)
+    {
+      bool selected = (opti == argc);
+      for (int j = opti; j < argc; ++j)
+        selected |= (benchmarks[i].m_name == argv[j]);
+      if ( selected)
+      {
+        RunBenchmark( benchmarks[i], min_seconds, jit_threshold, null);
+        any = true;
+      }
+    }
+    if ( !any)
+      ErrorHelp( "No such benchmark");
+  }
+  catch (const std::exception &ex)
+  {
+    std::cerr << ex.what() << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,315 @@
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <vector>
+
+#include "cpp_writer.hpp"
+#include "runtime.hpp"
+
+namespace forth
+{
+  namespace
+  {
+    /// Methods of the machine that execute the intrinsics, by opcode
+    const char * const kIntrinsicMethods[] =
+    {
+      "Plus", "Minus", "Mult", "Div", "Mod", "And", "Or", "Not",
+      "Swap", "Dup", "Drop", "Loop", "Emit", "Read", "Exit", "Over",
+    };
+
+    /// Format a number for the source
+    std::string
+    Number(
+      long a_number)
+    {
+      std::ostringstream str;
+      str << a_number;
+      return str.str();
+    }
+
+    /** Support functions of the translated program. They are inline, as
+     * not every program uses all of them.
+     */
+    const char kSupport[] =
+      "/// Run a line, returns the line to continue with or 0\n"
+      "static Cell\n"
+      "RunLine(\n"
+      "  Machine &m,\n"
+      "  Cell a_line);\n"
+      "\n"
+      "/// Run the lines a called line continues with, then return\n"
+      "inline void\n"
+      "Finish(\n"
+      "  Machine &m,\n"
+      "  Cell a_next)\n"
+      "{\n"
+      "  while ( a_next != 0)\n"
+      "    a_next = RunLine( m, a_next);\n"
+      "  m.Leave();\n"
+      "}\n"
+      "\n"
+      "/** Call the line or intrinsic on top of the stack. Returns true if\n"
+      " * the calling line has to start again.\n"
+      " */\n"
+      "inline bool\n"
+      "Call(\n"
+      "  Machine &m,\n"
+      "  Cell a_line)\n"
+      "{\n"
+      "  Cell target = m.Pop( a_line);\n"
+      "  if ( target < 0)\n"
+      "    return false;\n"
+      "  if ( target < forth::native::kOpCodeFirstUser)\n"
+      "    return m.Intrinsic( a_line, target);\n"
+      "  if ( target >= kLineCount)\n"
+      "    target = forth::native::kOpCodeFirstUser;\n"
+      "  m.Enter( a_line);\n"
+      "  Finish( m, RunLine( m, target));\n"
+      "  return false;\n"
+      "}\n"
+      "\n"
+      "/** Call the line or intrinsic on top of the stack at the end of a\n"
+      " * line. Returns the line to continue with, 0 to return, or -1 if the\n"
+      " * calling line has to start again.\n"
+      " */\n"
+      "inline Cell\n"
+      "TailCall(\n"
+      "  Machine &m,\n"
+      "  Cell a_line)\n"
+      "{\n"
+      "  Cell target = m.Pop( a_line);\n"
+      "  if ( target < 0)\n"
+      "    return 0;\n"
+      "  if ( target < forth::native::kOpCodeFirstUser)\n"
+      "    return m.Intrinsic( a_line, target) ? -1 : 0;\n"
+      "  if ( target >= kLineCount)\n"
+      "    target = forth::native::kOpCodeFirstUser;\n"
+      "  return target;\n"
+      "}\n"
+      "\n";
+  }
+
+  void
+  CppWriter::Write(
+    const Program::View &a_view,
+    const std::string &a_sourceName,
+    std::ostream &a_output)
+  {
+    const size_t first = Runtime::kOpCodeFirstUser;
+
+    a_output <<
+      "// Translated from " << a_sourceName << " by forthytwo --emit-cpp.\n"
+      "// Build it with the directory above forth/ on the include path and\n"
+      "// link the threads library.\n"
+      "\n"
+      "#include <forth/native.hpp>\n"
+      "\n"
+      "typedef forth::native::Cell Cell;\n"
+      "typedef forth::native::Machine Machine;\n"
+      "\n"
+      "/// Number of lines, including the ones of the intrinsics\n"
+      "static const Cell kLineCount = " << a_view.m_lineCount << ";\n"
+      "\n";
+
+    for (size_t row = first; row < a_view.m_lineCount; ++row)
+      a_output << "static Cell Line" << row << "( Machine &m);\n";
+    a_output << "\n" << kSupport;
+
+    for (size_t row = first; row < a_view.m_lineCount; ++row)
+      WriteLine( a_view, row, a_output);
+
+    a_output <<
+      "static Cell\n"
+      "RunLine(\n"
+      "  Machine &m,\n"
+      "  Cell a_line)\n"
+      "{\n"
+      "  switch (a_line)\n"
+      "  {\n";
+    for (size_t row = first; row < a_view.m_lineCount; ++row)
+      a_output << "    case " << row << ": return Line" << row << "( m);\n";
+    a_output <<
+      "  }\n"
+      "  return 0;\n"
+      "}\n"
+      "\n"
+      "/// The program as seen by forth::native::Main\n"
+      "static const forth::native::Program kProgram =\n"
+      "{\n"
+      "  ";
+    WriteString( a_sourceName, a_output);
+    a_output <<
+      ", kLineCount, RunLine\n"
+      "};\n"
+      "\n"
+      "int\n"
+      "main(\n"
+      "  int argc,\n"
+      "  char * * argv)\n"
+      "{\n"
+      "  return forth::native::Main( kProgram, argc, argv);\n"
+      "}\n";
+  }
+
+  void
+  CppWriter::WriteFile(
+    const Program::View &a_view,
+    const std::string &a_sourceName,
+    const char * a_filename)
+  {
+    std::ofstream file( a_filename,
+      std::ios_base::out | std::ios_base::trunc);
+    if ( !file.is_open())
+      throw std::runtime_error(
+        std::string( "Cannot write '") + a_filename + "'");
+
+    Write( a_view, a_sourceName, file);
+
+    if ( !file.good())
+      throw std::runtime_error(
+        std::string( "Cannot write '") + a_filename + "'");
+  }
+
+  void
+  CppWriter::WriteLine(
+    const Program::View &a_view,
+    size_t a_line,
+    std::ostream &a_output)
+  {
+    const Program::Cell * code = a_view.m_code;
+    const Program::Line &line = a_view.m_lines[a_line];
+    const size_t end = line.End();
+
+    // Walk the numbers in the order the decoder does. Statements of more
+    // than one line are indented relative to the body.
+    const std::string here = Number( a_line);
+    std::vector<std::string> body;
+    bool restarts = false;
+    bool returns = false;
+    size_t i = line.m_offset;
+    while ( i < end)
+    {
+      Program::Cell v = code[i];
+
+      if ( v == Runtime::kOpCodeCall)
+      {
+        // Computed call, in the last position it takes no frame
+        ++i;
+        restarts = true;
+        if ( i == end)
+        {
+          body.push_back( "{");
+          body.push_back( "  Cell next = TailCall( m, " + here + ");");
+          body.push_back( "  if ( next >= 0)");
+          body.push_back( "    return next;");
+          body.push_back( "}");
+          returns = true;
+        }
+        else
+        {
+          body.push_back( "if ( Call( m, " + here + "))");
+          body.push_back( "  continue;");
+        }
+        continue;
+      }
+
+      if ( (i + 1 == end) || (code[i + 1] != Runtime::kOpCodeCall))
+      {
+        body.push_back( "m.Push( " + here + ", " + Number( v) + ");");
+        ++i;
+        continue;
+      }
+
+      // A constant followed by a call
+      i += 2;
+      if ( v < 0)
+        continue;
+
+      if ( v < Runtime::kOpCodeFirstUser)
+      {
+        if ( v == Runtime::kOpCodeLoop)
+        {
+          body.push_back( "if ( m.Loop())");
+          body.push_back( "  continue;");
+          restarts = true;
+        }
+        else if ( v == Runtime::kOpCodeSwap)
+          body.push_back( "m.Swap();");
+        else if ( v > Runtime::kOpCodeOver)
+          body.push_back( "m.Exit( " + here + ");");
+        else
+          body.push_back( std::string( "m.") + kIntrinsicMethods[v] + "( " +
+            here + ");");
+        continue;
+      }
+
+      // Calls outside the program go back to the first line
+      size_t target = v;
+      if ( target >= a_view.m_lineCount)
+        target = Runtime::kOpCodeFirstUser;
+      if ( i == end)
+      {
+        body.push_back( "return " + Number( target) + ";");
+        returns = true;
+      }
+      else
+      {
+        body.push_back( "m.Enter( " + here + ");");
+        body.push_back( "Finish( m, Line" + Number( target) + "( m));");
+      }
+    }
+    // Lines doing nothing but returning don't use the machine
+    bool usesMachine = false;
+    for (size_t j = 0; j < body.size(); ++j)
+      usesMachine |= (body[j].compare( 0, 7, "return ") != 0);
+    if ( !returns)
+      body.push_back( "return 0;");
+
+    a_output << "// " << a_line << ":";
+    for (size_t j = line.m_offset; j < end; ++j)
+      a_output << " " << code[j];
+    a_output << "\n"
+      "static Cell\n"
+      "Line" << a_line << "(\n"
+      "  Machine &" << (usesMachine ? "m" : "") << ")\n"
+      "{\n";
+
+    // The loop intrinsic starts the line again
+    std::string indent = "  ";
+    if ( restarts)
+    {
+      a_output << "  for (;;)\n  {\n";
+      indent = "    ";
+    }
+    for (size_t j = 0; j < body.size(); ++j)
+      a_output << indent << body[j] << "\n";
+    if ( restarts)
+      a_output << "  }\n";
+    a_output << "}\n\n";
+  }
+
+  void
+  CppWriter::WriteString(
+    const std::string &a_string,
+    std::ostream &a_output)
+  {
+    a_output << "\"";
+    for (size_t i = 0; i < a_string.size(); ++i)
+    {
+      unsigned char c = a_string[i];
+      if ( (c == '"') || (c == '\\'))
+        a_output << "\\" << c;
+      else if ( (c < 32) || (c > 126))
+      {
+        // Three octal digits, so a digit after it isn't taken in
+        a_output << "\\" << static_cast<char>( '0' + (c >> 6)) <<
+          static_cast<char>( '0' + ((c >> 3) & 7)) <<
+          static_cast<char>( '0' + (c & 7));
+      }
+      else
+        a_output << c;
+    }
+    a_output << "\"";
+  }
+
+}
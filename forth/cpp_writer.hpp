@@ -0,0 +1,66 @@
+#ifndef FORTH_CPP_WRITER_H
+#define FORTH_CPP_WRITER_H
+
+#include <ostream>
+#include <string>
+
+#include "program.hpp"
+
+namespace forth
+{
+  /** Translate a program to C++ source for a native build.
+   *
+   * Each line becomes a function. Calls of constant lines become direct
+   * function calls, computed calls go through a switch over the line
+   * numbers and the loop intrinsic restarts the function body. The
+   * intrinsics are inlined from native.hpp, which is all the translated
+   * program needs besides the threads library.
+   *
+   * The translation follows the decoder: a call in the last position of a
+   * line takes no frame of the return stack, so the translated program
+   * overflows the stacks where the interpreter without fusion does. A
+   * superinstruction that combines a literal with an operation never
+   * pushes the literal, so on a full data stack the fused interpreter
+   * may get one operation further. The translation doesn't count steps.
+   *
+   * The functions are implemented as static members of the CppWriter
+   * struct, following the Decoder.
+   */
+  struct CppWriter
+  {
+    /** Write a program as C++ source. a_sourceName is used in the error
+     * messages of the translated program.
+     */
+    static void
+    Write(
+      const Program::View &a_view,
+      const std::string &a_sourceName,
+      std::ostream &a_output);
+
+    /// Write a program as C++ source into a file
+    static void
+    WriteFile(
+      const Program::View &a_view,
+      const std::string &a_sourceName,
+      const char * a_filename);
+
+    protected:
+
+      /// Write the function of a line
+      static void
+      WriteLine(
+        const Program::View &a_view,
+        size_t a_line,
+        std::ostream &a_output);
+
+      /// Write a string as a C++ literal
+      static void
+      WriteString(
+        const std::string &a_string,
+        std::ostream &a_output);
+
+  };
+
+}
+
+#endif
@@ -0,0 +1,408 @@
+#include <algorithm>
+#include <vector>
+#include "decoder.hpp"
+#include "stack_effect.hpp"
+
+/* The fusion table is a list of FORTH_FUSE( name) entries, see
+ * fusion/default.def. CMake selects it by FORTH_FUSION_TABLE.
+ */
+#ifndef FORTH_FUSION_TABLE
+#define FORTH_FUSION_TABLE "fusion/default.def"
+#endif
+
+namespace forth
+{
+  const Decoder::Superinstruction Decoder::kSuperinstructions[] =
+  {
+#define FORTH_SUPERINSTRUCTION(name, length, op1, op2, op3) \
+  { kOp ## name, length, { op1, op2, op3 } },
+#include "superinstructions.def"
+#undef FORTH_SUPERINSTRUCTION
+  };
+
+  const size_t Decoder::kSuperinstructionCount =
+    sizeof( kSuperinstructions) / sizeof( kSuperinstructions[0]);
+
+  const size_t Decoder::kMinPushBlock = 4;
+
+  const size_t Decoder::kMaxInlined = 16;
+
+  const Operation Decoder::kFusionTable[] =
+  {
+#define FORTH_FUSE(name) kOp ## name,
+#include FORTH_FUSION_TABLE
+#undef FORTH_FUSE
+    kOpCount
+  };
+
+  uint64_t
+  Decoder::Fingerprint()
+  {
+    std::vector<uint64_t> values;
+    values.push_back( kOpCount);
+    values.push_back( sizeof( Instruction));
+    values.push_back( kMinPushBlock);
+    values.push_back( kMaxInlined);
+    for (size_t i = 0; i < kSuperinstructionCount; ++i)
+    {
+      const Superinstruction &super = kSuperinstructions[i];
+      values.push_back( super.m_op);
+      values.push_back( super.m_length);
+      for (size_t j = 0; j < super.m_length; ++j)
+        values.push_back( super.m_sequence[j]);
+    }
+    for (const Operation * op = kFusionTable; *op != kOpCount; ++op)
+      values.push_back( *op);
+
+    // FNV-1a over the values
+    uint64_t fingerprint = 0xcbf29ce484222325ull;
+    for (size_t i = 0; i < values.size(); ++i)
+      fingerprint = (fingerprint ^ values[i]) * 0x100000001b3ull;
+    return fingerprint;
+  }
+
+  void
+  Decoder::Decode(
+    const Runtime::Cell * a_code,
+    size_t a_codeSize,
+    const Runtime::Line * a_lines,
+    size_t a_lineCount,
+    std::vector<Instruction> &a_decoded,
+    bool a_fuse)
+  {
+    // Slots that don't belong to a line can't be reached. Fill them anyway.
+    a_decoded.assign( 2 * a_codeSize, MakeInstruction( kOpReturn, 1));
+    if ( a_codeSize == 0)
+      return;
+
+    Instruction * decoded = &a_decoded[0];
+    for (size_t row = 0; row < a_lineCount; ++row)
+      DecodeLine( a_code, a_lines[row], a_lines, a_lineCount, decoded);
+
+    if ( a_fuse)
+    {
+      // Look up the superinstructions of the fusion table once
+      std::vector<const Superinstruction *> table;
+      for (const Operation * op = kFusionTable; *op != kOpCount; ++op)
+        table.push_back( FindSuperinstruction( *op));
+
+      // Fuse based on a copy of the basic instructions. A slot inside a
+      // fused instruction is fused on its own.
+      std::vector<Instruction> basic( decoded, decoded + a_codeSize);
+      for (size_t i = 0; i < a_codeSize; ++i)
+        decoded[i] = Fuse( &basic[0], i, table);
+
+      MakePushBlocks( decoded, a_codeSize);
+    }
+
+    MakeUncheckedCopy( a_code, a_codeSize, a_lines, a_lineCount, decoded);
+
+    // Inlining changes how the steps are counted, so it goes with fusion.
+    // Runtime::SetFusion documents that both are switched together.
+    if ( a_fuse)
+      Inline( a_lines, a_codeSize, a_decoded);
+  }
+
+  void
+  Decoder::Inline(
+    const Runtime::Line * a_lines,
+    size_t a_codeSize,
+    std::vector<Instruction> &a_decoded)
+  {
+    const size_t size = 2 * a_codeSize;
+    for (size_t i = 0; i < size; ++i)
+    {
+      if (a_decoded[i].m_op != kOpCallLine)
+        continue;
+
+      // A call of the unchecked copy that leaves it belongs to a line that
+      // isn't proven, which is never entered there
+      const Instruction call = a_decoded[i];
+      size_t start = call.m_arg2;
+      if ( (i >= a_codeSize) && (start < a_codeSize))
+        continue;
+
+      const Runtime::Line &line = a_lines[call.m_arg];
+      size_t end = start + line.m_length;
+      if ( (line.m_length > kMaxInlined) ||
+           !IsStraight( &a_decoded[0], start, end))
+        continue;
+
+      // An empty line needs no copy, the call just goes on behind itself
+      a_decoded[i].m_op = kOpInlineLine;
+      if (line.m_length == 0)
+        continue;
+
+      // The copy of the line leaves out the return. What would go on with
+      // it goes on behind the call.
+      const int32_t continuation = static_cast<int32_t>( i + call.m_next);
+      const size_t header = a_decoded.size();
+      a_decoded.push_back( MakeInstruction( kOpNop, 1, line.m_offset,
+        continuation));
+      for (size_t j = start; j < end; ++j)
+      {
+        Instruction insn = a_decoded[j];
+        const int32_t slot = static_cast<int32_t>( a_decoded.size());
+        insn.m_unchecked = static_cast<uint16_t>( slot - header);
+        if (j + insn.m_next == end)
+          insn.m_next = continuation - slot;
+        a_decoded.push_back( insn);
+      }
+      a_decoded[i].m_next = static_cast<int32_t>( header + 1 - i);
+    }
+  }
+
+  bool
+  Decoder::IsStraight(
+    const Instruction * a_decoded,
+    size_t a_start,
+    size_t a_end)
+  {
+    for (size_t i = a_start; i < a_end; i += a_decoded[i].m_next)
+    {
+      switch (a_decoded[i].m_op)
+      {
+        case kOpLoop:
+        case kOpLoopUnchecked:
+        case kOpLiteralMinusLoop:
+        case kOpLiteralMinusLoopUnchecked:
+        case kOpCall:
+        case kOpCallLine:
+        case kOpJumpLine:
+        case kOpTailCall:
+        case kOpInlineLine:
+        case kOpReturn:
+          return false;
+      }
+    }
+    return true;
+  }
+
+  void
+  Decoder::MakeUncheckedCopy(
+    const Runtime::Cell * a_code,
+    size_t a_codeSize,
+    const Runtime::Line * a_lines,
+    size_t a_lineCount,
+    Instruction * a_decoded)
+  {
+    std::vector<StackEffect::Summary> summaries;
+    std::vector<uint32_t> needs;
+    StackEffect::Analyze( a_code, a_codeSize, a_lines, a_lineCount,
+      summaries, needs);
+
+    // Lines that aren't proven are never entered in the copy
+    Instruction * unchecked = a_decoded + a_codeSize;
+    std::copy( a_decoded, a_decoded + a_codeSize, unchecked);
+
+    const int32_t offset = static_cast<int32_t>( a_codeSize);
+    for (size_t row = 0; row < a_lineCount; ++row)
+    {
+      if ( !summaries[row].m_proven)
+        continue;
+
+      const Runtime::Line &line = a_lines[row];
+      for (size_t i = line.m_offset; i <= line.End(); ++i)
+      {
+        // A need too deep for the instruction keeps the line checked, the
+        // copy is still entered by the lines calling it
+        if (needs[i] < 0xffff)
+          a_decoded[i].m_unchecked = static_cast<uint16_t>( needs[i] + 1);
+
+        // A proven line calls only proven lines, so the targets of its
+        // calls and loops are in the copy as well
+        Instruction &insn = unchecked[i];
+        insn.m_op = Unchecked( static_cast<Operation>( insn.m_op));
+        switch (insn.m_op)
+        {
+          case kOpLoopUnchecked:
+            insn.m_arg += offset;
+            break;
+
+          case kOpLiteralMinusLoopUnchecked:
+          case kOpCallLine:
+          case kOpJumpLine:
+            insn.m_arg2 += offset;
+            break;
+        }
+      }
+    }
+  }
+
+  Operation
+  Decoder::Unchecked(
+    Operation a_op)
+  {
+    switch (a_op)
+    {
+#define FORTH_UNCHECKED(name) \
+      case kOp ## name: \
+        return kOp ## name ## Unchecked;
+#include "unchecked.def"
+#undef FORTH_UNCHECKED
+
+      default:
+        return a_op;
+    }
+  }
+
+  void
+  Decoder::MakePushBlocks(
+    Instruction * a_decoded,
+    size_t a_codeSize)
+  {
+    // Count the literals from the back. A run can't leave its line, as the
+    // spare slot holds a return. A literal fused with the operation after it
+    // ends the run in front of it.
+    size_t run = 0;
+    for (size_t i = a_codeSize; i-- > 0; )
+    {
+      if (a_decoded[i].m_op != kOpLiteral)
+      {
+        run = 0;
+        continue;
+      }
+
+      // Each slot of the run pushes the rest of it
+      ++run;
+      if (run >= kMinPushBlock)
+        a_decoded[i] = MakeInstruction( kOpPushBlock, run, run, i);
+    }
+  }
+
+  const Decoder::Superinstruction *
+  Decoder::FindSuperinstruction(
+    Operation a_op)
+  {
+    for (size_t i = 0; i < kSuperinstructionCount; ++i)
+    {
+      if (kSuperinstructions[i].m_op == a_op)
+        return &kSuperinstructions[i];
+    }
+    return NULL;
+  }
+
+  Instruction
+  Decoder::Fuse(
+    const Instruction * a_basic,
+    size_t a_slot,
+    const std::vector<const Superinstruction *> &a_table)
+  {
+    for (size_t i = 0; i < a_table.size(); ++i)
+    {
+      const Superinstruction * super = a_table[i];
+
+      // Follow the chain of instructions as long as it matches. The chain
+      // can't leave the line, as no sequence contains a return.
+      Instruction fused = a_basic[a_slot];
+      size_t slot = a_slot;
+      size_t matched = 0;
+      while ( (matched < super->m_length) &&
+              (a_basic[slot].m_op == super->m_sequence[matched]))
+      {
+        fused.m_arg2 = a_basic[slot].m_arg;
+        slot += a_basic[slot].m_next;
+        ++matched;
+      }
+
+      if (matched == super->m_length)
+      {
+        fused.m_op = super->m_op;
+        fused.m_next = static_cast<int32_t>( slot - a_slot);
+        return fused;
+      }
+    }
+
+    return a_basic[a_slot];
+  }
+
+  void
+  Decoder::DecodeLine(
+    const Runtime::Cell * a_code,
+    const Runtime::Line &a_line,
+    const Runtime::Line * a_lines,
+    size_t a_lineCount,
+    Instruction * a_decoded)
+  {
+    size_t end = a_line.End();
+
+    for (size_t i = a_line.m_offset; i < end; ++i)
+    {
+      Runtime::Cell v = a_code[i];
+
+      if (v == Runtime::kOpCodeCall)
+      {
+        // The target is computed, look at it at run time. Remember the
+        // start of the line in case it turns out to be a loop.
+        a_decoded[i] = MakeInstruction( kOpCall, 1, a_line.m_offset);
+      }
+      else if ( (i + 1 < end) && (a_code[i + 1] == Runtime::kOpCodeCall))
+      {
+        // A constant followed by a call. The slot of the call is still
+        // decoded on its own in the next iteration.
+        a_decoded[i] = DecodeCall( v, a_line, a_lines, a_lineCount);
+      }
+      else
+        a_decoded[i] = MakeInstruction( kOpLiteral, 1, v);
+    }
+
+    // A call in the last position would return only to return again. Jump
+    // instead and leave the return to the called line.
+    for (size_t i = a_line.m_offset; i < end; ++i)
+    {
+      Instruction &insn = a_decoded[i];
+      if ( i + insn.m_next == end)
+      {
+        if ( insn.m_op == kOpCallLine)
+          insn.m_op = kOpJumpLine;
+        else if ( insn.m_op == kOpCall)
+          insn.m_op = kOpTailCall;
+      }
+    }
+
+    // The spare slot after the line returns to the caller
+    a_decoded[end] = MakeInstruction( kOpReturn, 1);
+  }
+
+  Instruction
+  Decoder::DecodeCall(
+    Runtime::Cell a_opCode,
+    const Runtime::Line &a_line,
+    const Runtime::Line * a_lines,
+    size_t a_lineCount)
+  {
+    // Negative opcodes are ignored
+    if (a_opCode < 0)
+      return MakeInstruction( kOpNop, 2);
+
+    // Intrinsics are executed in place. The loop needs the start of the line.
+    if (a_opCode < Runtime::kOpCodeFirstUser)
+      return MakeInstruction( static_cast<Operation>( a_opCode), 2,
+        a_line.m_offset);
+
+    // Calls outside the program go back to the first line
+    size_t target = a_opCode;
+    if (target >= a_lineCount)
+      target = Runtime::kOpCodeFirstUser;
+
+    return MakeInstruction( kOpCallLine, 2, target, a_lines[target].m_offset);
+  }
+
+  Instruction
+  Decoder::MakeInstruction(
+    Operation a_op,
+    int32_t a_next,
+    int32_t a_arg,
+    int32_t a_arg2)
+  {
+    Instruction insn;
+
+    insn.m_op = a_op;
+    insn.m_unchecked = 0;
+    insn.m_next = a_next;
+    insn.m_arg = a_arg;
+    insn.m_arg2 = a_arg2;
+    return insn;
+  }
+
+}
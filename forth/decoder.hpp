@@ -0,0 +1,172 @@
+#ifndef FORTH_DECODER_H
+#define FORTH_DECODER_H
+
+#include <vector>
+#include <stdint.h>
+
+#include "instruction.hpp"
+#include "runtime.hpp"
+
+namespace forth
+{
+  /** Translate the code segment of a program into instructions for the fast
+   * interpreter loop.
+   *
+   * The functions are implemented as static members of the Decoder struct,
+   * following the Parser.
+   */
+  struct Decoder
+  {
+    /// Description of a superinstruction
+    struct Superinstruction
+    {
+      /// Operation of the fused instruction
+      Operation m_op;
+
+      /// Number of operations fused
+      size_t m_length;
+
+      /// Operations fused, in order of execution
+      Operation m_sequence[3];
+    };
+
+    /// All superinstructions the interpreter can execute
+    static const Superinstruction kSuperinstructions[];
+
+    /// Number of entries in kSuperinstructions
+    static const size_t kSuperinstructionCount;
+
+    /// Shortest run of literals decoded into a push block
+    static const size_t kMinPushBlock;
+
+    /// Longest line inlined into its callers, in numbers
+    static const size_t kMaxInlined;
+
+    /** Decode a whole program.
+     *
+     * Each line in the code segment is expected to be followed by one spare
+     * slot, which marks the end of the line. a_decoded receives at least
+     * 2 * a_codeSize instructions.
+     *
+     * If a_fuse is set, sequences of instructions are fused into the
+     * superinstructions selected by the fusion table. Runs of literals left
+     * over are decoded into push blocks. Calls of short lines without
+     * calls and loops are inlined, see Inline.
+     *
+     * The first a_codeSize instructions check the depth of the data stack
+     * as they go. The second a_codeSize are a copy that doesn't for the
+     * lines StackEffect proves. An instruction of the first copy tells in
+     * m_unchecked from which depth the rest of its line can continue in the
+     * second one. Calls and loops of the second copy stay in it.
+     */
+    static void
+    Decode(
+      const Runtime::Cell * a_code,
+      size_t a_codeSize,
+      const Runtime::Line * a_lines,
+      size_t a_lineCount,
+      std::vector<Instruction> &a_decoded,
+      bool a_fuse = true);
+
+    /// Look up the description of a superinstruction
+    static const Superinstruction *
+    FindSuperinstruction(
+      Operation a_op);
+
+    /** Identify the operations and tables this decoder works with, i.e.
+     * the operations, the superinstructions, the fusion table selected at
+     * build time and the limits of push blocks and inlining. A decoded
+     * program can only be run by a build with the same fingerprint.
+     */
+    static uint64_t
+    Fingerprint();
+
+    protected:
+
+      /** Superinstructions selected at build time, in order of preference.
+       * The list is terminated by kOpCount.
+       */
+      static const Operation kFusionTable[];
+
+      /** Fuse the instructions starting at a slot into the first of the
+       * given superinstructions that matches.
+       */
+      static Instruction
+      Fuse(
+        const Instruction * a_basic,
+        size_t a_slot,
+        const std::vector<const Superinstruction *> &a_table);
+
+      /// Replace runs of literals by push blocks
+      static void
+      MakePushBlocks(
+        Instruction * a_decoded,
+        size_t a_codeSize);
+
+      /// Fill the unchecked copy behind the decoded program
+      static void
+      MakeUncheckedCopy(
+        const Runtime::Cell * a_code,
+        size_t a_codeSize,
+        const Runtime::Line * a_lines,
+        size_t a_lineCount,
+        Instruction * a_decoded);
+
+      /** Replace the calls of short lines without calls and loops by
+       * kOpInlineLine and append a copy of the line called per call.
+       *
+       * The copy runs where the call would have entered the line and goes
+       * on behind the call at its end, so the call takes no frame and
+       * there is no return. A loop restarts the line it belongs to, which
+       * is why a line with one is never inlined. Neither is one with
+       * calls, so a copy never holds another one. The copies follow the
+       * unchecked copy, each behind its header, see Instruction.
+       */
+      static void
+      Inline(
+        const Runtime::Line * a_lines,
+        size_t a_codeSize,
+        std::vector<Instruction> &a_decoded);
+
+      /// Check if the instructions of a decoded line run straight through
+      static bool
+      IsStraight(
+        const Instruction * a_decoded,
+        size_t a_start,
+        size_t a_end);
+
+      /// Get the unchecked twin of an operation, if it has one
+      static Operation
+      Unchecked(
+        Operation a_op);
+
+      /// Decode a single line
+      static void
+      DecodeLine(
+        const Runtime::Cell * a_code,
+        const Runtime::Line &a_line,
+        const Runtime::Line * a_lines,
+        size_t a_lineCount,
+        Instruction * a_decoded);
+
+      /// Decode a call to a constant opcode into one instruction
+      static Instruction
+      DecodeCall(
+        Runtime::Cell a_opCode,
+        const Runtime::Line &a_line,
+        const Runtime::Line * a_lines,
+        size_t a_lineCount);
+
+      /// Build an instruction
+      static Instruction
+      MakeInstruction(
+        Operation a_op,
+        int32_t a_next,
+        int32_t a_arg = 0,
+        int32_t a_arg2 = 0);
+
+  };
+
+}
+
+#endif
@@ -0,0 +1,292 @@
+#ifndef FORTH_FIXED_STACK_H
+#define FORTH_FIXED_STACK_H
+
+#include <algorithm>
+#include <cassert>
+#include <cstddef>
+#include <new>
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+namespace forth
+{
+  /** Stack with a capacity fixed at construction.
+   *
+   * The memory is allocated once and never moves, so pushing never
+   * reallocates. Two spare items are kept below the bottom of the stack.
+   * They allow an interpreter loop that keeps the top item in a register to
+   * handle a stack of one or zero items without special cases.
+   *
+   * SetGuarded moves the items into memory mapped between two pages without
+   * access, see there.
+   */
+  template <typename T>
+  class FixedStack
+  {
+    public:
+
+      /// Number of spare items below the bottom of the stack
+      static const size_t kSpare = 2;
+
+      /// Construct an empty stack
+      explicit
+      FixedStack(
+        size_t a_capacity)
+        : m_storage( new T[a_capacity + kSpare])
+        , m_capacity( a_capacity)
+        , m_size( 0)
+        , m_requested( a_capacity)
+        , m_memory( NULL)
+        , m_memorySize( 0)
+        , m_pageSize( sysconf( _SC_PAGESIZE))
+      {
+      }
+
+      /// Destruct the stack
+      ~FixedStack()
+      {
+        Release();
+      }
+
+      /** Move the items into memory between guard pages, or back into
+       * plain memory. The items are kept and the memory moves.
+       *
+       * With guard pages, the capacity is rounded up so that the spare items
+       * and the items fill whole pages. The spare items start where the
+       * lower guard page ends and the items end where the upper one starts.
+       * Reading below the spare items or writing past the capacity faults
+       * right away. Without them, the capacity is the one of the
+       * constructor again, or the size if more items are on the stack.
+       */
+      void
+      SetGuarded(
+        bool a_guarded)
+      {
+        if ( a_guarded == IsGuarded())
+          return;
+
+        T * storage = NULL;
+        char * memory = NULL;
+        size_t memorySize = 0;
+        size_t capacity = (m_size > m_requested) ? m_size : m_requested;
+        if ( a_guarded)
+        {
+          size_t pages = ((capacity + kSpare) * sizeof( T) + m_pageSize - 1) /
+            m_pageSize;
+          memorySize = (pages + 2) * m_pageSize;
+          void * mapped = mmap( NULL, memorySize, PROT_NONE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+          if ( mapped == MAP_FAILED)
+            throw std::bad_alloc();
+          memory = static_cast<char *>( mapped);
+          if ( mprotect( memory + m_pageSize, pages * m_pageSize,
+                 PROT_READ | PROT_WRITE) != 0)
+          {
+            munmap( memory, memorySize);
+            throw std::bad_alloc();
+          }
+          capacity = pages * m_pageSize / sizeof( T) - kSpare;
+          char * upperGuard = memory + memorySize - m_pageSize;
+          storage = reinterpret_cast<T *>(
+            upperGuard - (capacity + kSpare) * sizeof( T));
+        }
+        else
+          storage = new T[capacity + kSpare];
+
+        std::copy( m_storage, m_storage + m_size + kSpare, storage);
+        Release();
+        m_storage = storage;
+        m_capacity = capacity;
+        m_memory = memory;
+        m_memorySize = memorySize;
+      }
+
+      /// Check if the memory lies between guard pages
+      bool
+      IsGuarded() const
+      {
+        return m_memory != NULL;
+      }
+
+      /// Maximal number of items on the stack
+      size_t
+      Capacity() const
+      {
+        return m_capacity;
+      }
+
+      /// Number of items on the stack
+      size_t
+      Size() const
+      {
+        return m_size;
+      }
+
+      /// Check if the stack is empty
+      bool
+      IsEmpty() const
+      {
+        return m_size == 0;
+      }
+
+      /// Check if the stack is full
+      bool
+      IsFull() const
+      {
+        return m_size == m_capacity;
+      }
+
+      /// Access an item, counted from the bottom of the stack
+      T &
+      At(
+        size_t a_index)
+      {
+        assert( a_index < m_size);
+        return Bottom()[a_index];
+      }
+
+      /// Access an item, counted from the bottom of the stack
+      const T &
+      At(
+        size_t a_index) const
+      {
+        assert( a_index < m_size);
+        return Bottom()[a_index];
+      }
+
+      /// Access the top item
+      T &
+      Top()
+      {
+        return At( m_size - 1);
+      }
+
+      /// Access the top item
+      const T &
+      Top() const
+      {
+        return At( m_size - 1);
+      }
+
+      /// Put an item on top. The stack must not be full.
+      void
+      Push(
+        const T &a_item)
+      {
+        assert( !IsFull());
+        Bottom()[m_size++] = a_item;
+      }
+
+      /// Remove the top item and return it. The stack must not be empty.
+      T
+      Pop()
+      {
+        assert( !IsEmpty());
+        return Bottom()[--m_size];
+      }
+
+      /// Remove all items
+      void
+      Clear()
+      {
+        m_size = 0;
+      }
+
+      /// Get the memory including the spare items
+      T *
+      Storage()
+      {
+        return m_storage;
+      }
+
+      /// Get the memory of the item at the bottom
+      T *
+      Bottom()
+      {
+        return m_storage + kSpare;
+      }
+
+      /// Get the memory of the item at the bottom
+      const T *
+      Bottom() const
+      {
+        return m_storage + kSpare;
+      }
+
+      /// Check if an address lies in the guard page below the stack
+      bool
+      IsBelow(
+        const void * a_address) const
+      {
+        const char * address = static_cast<const char *>( a_address);
+        return IsGuarded() &&
+               (address >= m_memory) && (address < m_memory + m_pageSize);
+      }
+
+      /// Check if an address lies in the guard page above the stack
+      bool
+      IsAbove(
+        const void * a_address) const
+      {
+        const char * address = static_cast<const char *>( a_address);
+        return IsGuarded() &&
+               (address >= m_memory + m_memorySize - m_pageSize) &&
+               (address < m_memory + m_memorySize);
+      }
+
+      /// Set the number of items after the memory has been written directly
+      void
+      SetSize(
+        size_t a_size)
+      {
+        assert( a_size <= m_capacity);
+        m_size = a_size;
+      }
+
+    private:
+
+      /// Memory of the stack, starting with the spare items
+      T * m_storage;
+
+      /// Maximal number of items
+      size_t m_capacity;
+
+      /// Current number of items
+      size_t m_size;
+
+      /// Capacity passed to the constructor
+      size_t m_requested;
+
+      /// Mapped memory, including the guard pages, NULL without them
+      char * m_memory;
+
+      /// Size of the mapped memory in bytes
+      size_t m_memorySize;
+
+      /// Size of a guard page in bytes
+      size_t m_pageSize;
+
+      /// Free the memory of the items
+      void
+      Release()
+      {
+        if ( IsGuarded())
+          munmap( m_memory, m_memorySize);
+        else
+          delete[] m_storage;
+      }
+
+      /// No copies
+      FixedStack(
+        const FixedStack &);
+
+      /// No assignment
+      FixedStack &
+      operator=(
+        const FixedStack &);
+  };
+
+}
+
+#endif
@@ -0,0 +1,296 @@
+#include <algorithm>
+#include <sstream>
+
+#include "decoder.hpp"
+#include "fusion_recorder.hpp"
+#include "parser.hpp"
+
+namespace forth
+{
+  namespace
+  {
+    /** Name of each operation, in the order of forth::Operation. The
+     * opcodes between over and literal have no operation.
+     */
+    const char * const kOperationNames[] =
+    {
+      "plus", "minus", "mult", "div", "mod", "and", "or", "not",
+      "swap", "dup", "drop", "loop", "emit", "read", "exit", "over",
+      "", "", "", "", "",
+      "literal", "call", "call_line", "jump_line", "tail_call", "return",
+      "nop", "push_block", "inline_line",
+#define FORTH_SUPERINSTRUCTION(name, length, op1, op2, op3) # name,
+#include "superinstructions.def"
+#undef FORTH_SUPERINSTRUCTION
+#define FORTH_UNCHECKED(name) # name "Unchecked",
+#include "unchecked.def"
+#undef FORTH_UNCHECKED
+    };
+
+    /// Number of entries in kOperationNames
+    const size_t kOperationNameCount =
+      sizeof( kOperationNames) / sizeof( kOperationNames[0]);
+
+    /// Fails to compile if an operation has been added without a name
+    typedef char OperationNamesMatch[
+      (kOperationNameCount == kOpCount) ? 1 : -1];
+  }
+
+  /** Runtime that steps through a program and reports the instructions of
+   * the unfused decoded program to a recorder.
+   */
+  class RecordingRuntime : public Runtime
+  {
+    public:
+
+      /// Run the program and feed the recorder
+      void
+      Record(
+        FusionRecorder &a_recorder,
+        size_t a_maxSteps)
+      {
+        // Decode without fusion, so we see the basic instructions
+        Seal();
+        std::vector<Instruction> basic;
+        Decoder::Decode( m_view.m_code, m_view.m_codeSize,
+          m_view.m_lines, m_view.m_lineCount,
+          basic, false);
+
+        // The sequence of instructions executed back to back so far and the
+        // slot after its last instruction
+        std::vector<Operation> window;
+        size_t boundary = m_view.m_codeSize;
+        size_t lastIp = m_view.m_codeSize;
+
+        ResetIp();
+        for (size_t step = 0; step < a_maxSteps; ++step)
+        {
+          if ( m_ipLine >= m_view.m_lineCount)
+          {
+            // ComputeStep restarts the program
+            window.clear();
+            ComputeStep();
+            continue;
+          }
+
+          size_t ip = m_ip;
+          bool sequential = (ip == lastIp + 1);
+          lastIp = ip;
+
+          // Skip the numbers inside an instruction
+          if ( sequential && (ip < boundary))
+          {
+            ComputeStep();
+            continue;
+          }
+
+          // Anything but the next instruction in the line breaks the sequence
+          if ( !sequential || (ip >= m_view.m_lines[m_ipLine].End()))
+            window.clear();
+
+          if ( ip < m_view.m_lines[m_ipLine].End())
+          {
+            Operation op = Resolve( basic[ip]);
+
+            // Stop before the program ends the process
+            if (op == kOpExit)
+              return;
+
+            window.push_back( op);
+            if ( window.size() > 3)
+              window.erase( window.begin());
+            for (size_t len = 2; len <= window.size(); ++len)
+              a_recorder.CountSequence(
+                std::vector<Operation>( window.end() - len, window.end()));
+
+            boundary = ip + basic[ip].m_next;
+          }
+
+          ComputeStep();
+        }
+      }
+
+    protected:
+
+      /** Get the operation an instruction performs now. A computed call is
+       * resolved with the top of the data stack.
+       */
+      Operation
+      Resolve(
+        const Instruction &a_insn) const
+      {
+        Cell opCode = a_insn.m_op;
+        if (opCode == kOpCall)
+        {
+          if ( m_dataStack.IsEmpty())
+            return kOpCall;
+          opCode = m_dataStack.Top();
+          if (opCode < 0)
+            return kOpNop;
+          if (opCode >= kOpCodeFirstUser)
+            return kOpCallLine;
+        }
+
+        // All unused intrinsics exit
+        if ( (opCode > kOpCodeOver) && (opCode < kOpCodeFirstUser))
+          return kOpExit;
+        return static_cast<Operation>( opCode);
+      }
+
+  };
+
+  const size_t FusionRecorder::kDefaultMaxSteps = 100000000;
+
+  FusionRecorder::FusionRecorder()
+  {
+  }
+
+  void
+  FusionRecorder::Record(
+    const char * a_filename,
+    size_t a_maxSteps)
+  {
+    RecordingRuntime forth;
+
+    Parser::ParseFromFile( a_filename, forth);
+    forth.SetFileName( a_filename);
+    m_programs.push_back( a_filename);
+
+    try
+    {
+      forth.Record( *this, a_maxSteps);
+    }
+    catch (const Runtime::StackUnderflow &)
+    {
+      // A program that returns from its first line is done
+    }
+  }
+
+  void
+  FusionRecorder::CountSequence(
+    const std::vector<Operation> &a_sequence)
+  {
+    m_counts[a_sequence]++;
+  }
+
+  uint64_t
+  FusionRecorder::GetCount(
+    const std::vector<Operation> &a_sequence) const
+  {
+    std::map< std::vector<Operation>, uint64_t >::const_iterator it =
+      m_counts.find( a_sequence);
+    return (it == m_counts.end()) ? 0 : it->second;
+  }
+
+  /// Entry of the generated table, sorted longest first, then hottest first
+  struct FusionCandidate
+  {
+    size_t m_length;
+    uint64_t m_count;
+    std::string m_text;
+
+    bool
+    operator<(
+      const FusionCandidate &a_other) const
+    {
+      if (m_length != a_other.m_length)
+        return m_length > a_other.m_length;
+      if (m_count != a_other.m_count)
+        return m_count > a_other.m_count;
+      return m_text < a_other.m_text;
+    }
+
+  };
+
+  void
+  FusionRecorder::WriteTable(
+    std::ostream &a_output) const
+  {
+    std::vector<FusionCandidate> fused;
+    std::vector<FusionCandidate> unfused;
+
+    // Collect the superinstructions that would have been executed
+    for (size_t i = 0; i < Decoder::kSuperinstructionCount; ++i)
+    {
+      const Decoder::Superinstruction &super =
+        Decoder::kSuperinstructions[i];
+      std::vector<Operation> sequence( super.m_sequence,
+                                       super.m_sequence + super.m_length);
+
+      FusionCandidate candidate;
+      candidate.m_length = super.m_length;
+      candidate.m_count = GetCount( sequence);
+      candidate.m_text = OperationName( super.m_op);
+      if (candidate.m_count > 0)
+        fused.push_back( candidate);
+    }
+
+    // Collect the sequences no superinstruction covers, not even in part
+    for (std::map< std::vector<Operation>, uint64_t >::const_iterator it =
+           m_counts.begin();
+         it != m_counts.end();
+         ++it)
+    {
+      bool covered = false;
+      for (size_t i = 0; i < Decoder::kSuperinstructionCount; ++i)
+      {
+        const Decoder::Superinstruction &super =
+          Decoder::kSuperinstructions[i];
+        covered |= std::search( super.m_sequence,
+                     super.m_sequence + super.m_length,
+                     it->first.begin(), it->first.end()) !=
+                   super.m_sequence + super.m_length;
+      }
+      if (covered)
+        continue;
+
+      FusionCandidate candidate;
+      candidate.m_length = 0;
+      candidate.m_count = it->second;
+      for (size_t i = 0; i < it->first.size(); ++i)
+        candidate.m_text += " " + OperationName( it->first[i]);
+      unfused.push_back( candidate);
+    }
+
+    std::sort( fused.begin(), fused.end());
+    std::sort( unfused.begin(), unfused.end());
+
+    a_output << "/* Fusion table generated by forthytwo --record-fusion"
+             << std::endl << " *" << std::endl
+             << " * Recorded programs:" << std::endl;
+    for (size_t i = 0; i < m_programs.size(); ++i)
+      a_output << " *   " << m_programs[i] << std::endl;
+    a_output << " */" << std::endl;
+
+    for (size_t i = 0; i < fused.size(); ++i)
+      a_output << "FORTH_FUSE( " << fused[i].m_text << ") /* "
+               << fused[i].m_count << " */" << std::endl;
+
+    // List the hottest sequences as a hint for new superinstructions
+    const size_t kHints = 10;
+    if ( !unfused.empty())
+    {
+      a_output << std::endl
+               << "/* Hottest sequences without a superinstruction:"
+               << std::endl;
+      for (size_t i = 0; i < unfused.size() && i < kHints; ++i)
+        a_output << " * " << unfused[i].m_count << ":"
+                 << unfused[i].m_text << std::endl;
+      a_output << " */" << std::endl;
+    }
+  }
+
+  std::string
+  FusionRecorder::OperationName(
+    Operation a_op)
+  {
+    if ( (static_cast<size_t>( a_op) < kOperationNameCount) &&
+         (kOperationNames[a_op][0] != 0))
+      return kOperationNames[a_op];
+
+    std::ostringstream str;
+    str << "op" << a_op;
+    return str.str();
+  }
+
+}
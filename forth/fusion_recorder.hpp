@@ -0,0 +1,72 @@
+#ifndef FORTH_FUSION_RECORDER_H
+#define FORTH_FUSION_RECORDER_H
+
+#include <map>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "instruction.hpp"
+
+namespace forth
+{
+  /** Record the sequences of instructions programs execute and derive a
+   * fusion table from them.
+   *
+   * Each program is stepped with ComputeStep. The recorder follows the
+   * instruction boundaries of the unfused decoded program and counts which
+   * instructions are executed back to back in the same line. The counts
+   * accumulate over all recorded programs.
+   */
+  class FusionRecorder
+  {
+    public:
+
+      /// Default limit of steps per recorded program
+      static const size_t kDefaultMaxSteps;
+
+      /// Construct a recorder without any counts
+      FusionRecorder();
+
+      /** Parse a program and run it until it exits, returns from its first
+       * line, or has done a_maxSteps.
+       */
+      void
+      Record(
+        const char * a_filename,
+        size_t a_maxSteps = kDefaultMaxSteps);
+
+      /** Write a fusion table with all superinstructions that would have
+       * been executed, in a format to be selected by FORTH_FUSION_TABLE.
+       */
+      void
+      WriteTable(
+        std::ostream &a_output) const;
+
+      /// Count a sequence of instructions executed back to back
+      void
+      CountSequence(
+        const std::vector<Operation> &a_sequence);
+
+    protected:
+
+      /// Number of executions of each sequence of two or three instructions
+      std::map< std::vector<Operation>, uint64_t > m_counts;
+
+      /// Names of the programs recorded
+      std::vector<std::string> m_programs;
+
+      /// Number of executions of a sequence, zero if it never occurred
+      uint64_t
+      GetCount(
+        const std::vector<Operation> &a_sequence) const;
+
+      /// Name of an operation for the comments in the table
+      static std::string
+      OperationName(
+        Operation a_op);
+  };
+
+}
+
+#endif
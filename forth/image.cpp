@@ -0,0 +1,171 @@
+#include "image.hpp"
+
+#include <cstddef>
+#include <cstring>
+#include <sstream>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace forth
+{
+  const char kImageMagic[4] = { 'F', '4', '2', 'C' };
+
+  /// Mix the bytes of a block into a checksum, a word at a time
+  static uint64_t
+  MixChecksum(
+    uint64_t a_checksum,
+    const char * a_data,
+    size_t a_size)
+  {
+    const uint64_t kPrime = 0x100000001b3ull;
+    size_t i = 0;
+    for (; i + sizeof( uint64_t) <= a_size; i += sizeof( uint64_t))
+    {
+      uint64_t word;
+      memcpy( &word, a_data + i, sizeof( word));
+      a_checksum = (a_checksum ^ word) * kPrime;
+      a_checksum ^= a_checksum >> 29;
+    }
+    for (; i < a_size; ++i)
+      a_checksum = (a_checksum ^ static_cast<unsigned char>( a_data[i])) *
+        kPrime;
+    return a_checksum;
+  }
+
+  /// Throw an ImageError naming the file
+  static void
+  ThrowImageError(
+    const char * a_filename,
+    const char * a_problem)
+  {
+    std::ostringstream str;
+    str << "'" << a_filename << "': " << a_problem;
+    throw ImageError( str.str().c_str());
+  }
+
+  bool
+  ImageFile::IsImage(
+    const char * a_filename)
+  {
+    int fd = open( a_filename, O_RDONLY);
+    if ( fd < 0)
+      return false;
+
+    char magic[sizeof( kImageMagic)];
+    ssize_t len = read( fd, magic, sizeof( magic));
+    close( fd);
+
+    return (len == static_cast<ssize_t>( sizeof( magic))) &&
+           (memcmp( magic, kImageMagic, sizeof( magic)) == 0);
+  }
+
+  ImageFile::ImageFile(
+    const char * a_filename)
+    : m_data( NULL)
+    , m_size( 0)
+  {
+    int fd = open( a_filename, O_RDONLY);
+    if ( fd < 0)
+      ThrowImageError( a_filename, "Cannot open image");
+
+    struct stat info;
+    if ( fstat( fd, &info) != 0 || !S_ISREG( info.st_mode) ||
+         static_cast<size_t>( info.st_size) < sizeof( ImageHeader))
+    {
+      close( fd);
+      ThrowImageError( a_filename, "Not an image");
+    }
+
+    void * mapped = mmap( NULL, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close( fd);
+    if ( mapped == MAP_FAILED)
+      ThrowImageError( a_filename, "Cannot map image");
+    m_data = static_cast<const char *>( mapped);
+    m_size = info.st_size;
+
+    // Check that we can make sense of the contents
+    const char * problem = NULL;
+    const ImageHeader &header = Header();
+    if ( memcmp( header.m_magic, kImageMagic, sizeof( kImageMagic)) != 0)
+      problem = "Not an image";
+    else if ( header.m_version != kImageVersion)
+      problem = "Unsupported image version";
+    else if ( header.m_byteOrder != kImageByteOrder)
+      problem = "Image has been written with a different byte order";
+    else if ( (m_size - sizeof( ImageHeader)) / sizeof( ImageSection) <
+              header.m_sectionCount)
+      problem = "Section table is truncated";
+    else
+    {
+      const ImageSection * sections =
+        reinterpret_cast<const ImageSection *>( m_data + sizeof( header));
+      for (uint32_t i = 0; i < header.m_sectionCount; ++i)
+      {
+        if ( (sections[i].m_offset % kImageAlignment != 0) ||
+             (sections[i].m_offset > m_size) ||
+             (sections[i].m_size > m_size - sections[i].m_offset))
+          problem = "Section is outside of the image";
+      }
+      if ( (problem == NULL) && (Checksum( m_data, m_size) !=
+                                 header.m_checksum))
+        problem = "Image is corrupt";
+    }
+
+    if ( problem != NULL)
+    {
+      munmap( const_cast<char *>( m_data), m_size);
+      ThrowImageError( a_filename, problem);
+    }
+  }
+
+  ImageFile::~ImageFile()
+  {
+    munmap( const_cast<char *>( m_data), m_size);
+  }
+
+  uint64_t
+  ImageFile::Checksum(
+    const void * a_image,
+    size_t a_size)
+  {
+    // Everything but the checksum itself, followed by the size
+    const char * data = static_cast<const char *>( a_image);
+    const size_t field = offsetof( ImageHeader, m_checksum);
+    const size_t rest = field + sizeof( uint64_t);
+    uint64_t checksum = 0xcbf29ce484222325ull;
+    checksum = MixChecksum( checksum, data, field);
+    if ( a_size > rest)
+      checksum = MixChecksum( checksum, data + rest, a_size - rest);
+    uint64_t size = a_size;
+    return MixChecksum( checksum, reinterpret_cast<const char *>( &size),
+      sizeof( size));
+  }
+
+  const ImageHeader &
+  ImageFile::Header() const
+  {
+    return *reinterpret_cast<const ImageHeader *>( m_data);
+  }
+
+  const void *
+  ImageFile::FindSection(
+    uint32_t a_type,
+    size_t &a_size) const
+  {
+    const ImageSection * sections =
+      reinterpret_cast<const ImageSection *>( m_data + sizeof( ImageHeader));
+    for (uint32_t i = 0; i < Header().m_sectionCount; ++i)
+    {
+      if ( sections[i].m_type == a_type)
+      {
+        a_size = sections[i].m_size;
+        return m_data + sections[i].m_offset;
+      }
+    }
+    return NULL;
+  }
+
+}
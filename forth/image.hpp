@@ -0,0 +1,186 @@
+#ifndef FORTH_IMAGE_H
+#define FORTH_IMAGE_H
+
+#include <stdint.h>
+#include <cstddef>
+#include <stdexcept>
+
+namespace forth
+{
+  /** Header of a precompiled program image (.42c).
+   *
+   * An image starts with this header, followed by a table of sections. Each
+   * section starts at an offset aligned to kImageAlignment. All numbers are
+   * stored in the byte order of the machine that wrote the image, which is
+   * recorded in m_byteOrder.
+   *
+   * Sections of unknown type are skipped when loading, so later versions
+   * can add information without breaking older interpreters.
+   *
+   * The decoded program is run as it is mapped. It is only used if the
+   * fingerprint of the decoder matches, see Decoder::Fingerprint, and the
+   * checksum covers the whole file against corruption.
+   */
+  struct ImageHeader
+  {
+    /// Identifies the file as an image, see kImageMagic
+    char m_magic[4];
+
+    /// Version of the format, see kImageVersion
+    uint32_t m_version;
+
+    /// The value kImageByteOrder as written by the machine
+    uint32_t m_byteOrder;
+
+    /// Size of a number in the code segment
+    uint32_t m_cellSize;
+
+    /// Size of a decoded instruction
+    uint32_t m_instructionSize;
+
+    /// Number of operations of the decoder that wrote the image
+    uint32_t m_operationCount;
+
+    /// Properties of the program, see kImageFused
+    uint32_t m_flags;
+
+    /// Number of entries in the section table
+    uint32_t m_sectionCount;
+
+    /// Decoder::Fingerprint of the decoder that wrote the image
+    uint64_t m_fingerprint;
+
+    /// ImageFile::Checksum of the file, taken with this field zero
+    uint64_t m_checksum;
+  };
+
+  /// Entry of the section table of an image
+  struct ImageSection
+  {
+    /// Type of the contents, e.g. kImageSectionCode
+    uint32_t m_type;
+
+    /// Unused, keeps the offsets aligned
+    uint32_t m_reserved;
+
+    /// Offset of the section from the start of the file
+    uint64_t m_offset;
+
+    /// Size of the section in bytes
+    uint64_t m_size;
+  };
+
+  /// Identifier at the start of an image
+  extern const char kImageMagic[4];
+
+  /** Current version of the image format. It changes with the layout of
+   * the decoded program and with the way the decoder translates the code,
+   * as far as Decoder::Fingerprint doesn't cover it.
+   */
+  static const uint32_t kImageVersion = 3;
+
+  /// Value to detect the byte order
+  static const uint32_t kImageByteOrder = 0x01020304;
+
+  /// Alignment of the sections in the file
+  static const uint64_t kImageAlignment = 16;
+
+  /** Flag in m_flags: the decoded program uses superinstructions and
+   * inlined lines
+   */
+  static const uint32_t kImageFused = 1;
+
+  /** @name Types of sections */
+  /*@{*/
+
+  /// The line table, an array of Runtime::Line
+  static const uint32_t kImageSectionLines = 1;
+
+  /// The code segment, an array of Runtime::Cell
+  static const uint32_t kImageSectionCode = 2;
+
+  /** The decoded program, an array of Instruction with the unchecked copy
+   * and the inlined lines
+   */
+  static const uint32_t kImageSectionDecoded = 3;
+  /*@}*/
+
+  /// Exception to be thrown if an image can't be read or written
+  class ImageError : public std::runtime_error
+  {
+    public:
+
+      ImageError(
+        const char * a_what)
+        : std::runtime_error( a_what)
+      {
+      }
+
+  };
+
+  /** A program image mapped into memory, read only.
+   *
+   * The pages of the file are shared with all other processes that map the
+   * same image.
+   */
+  class ImageFile
+  {
+    public:
+
+      /// Check if a file starts like an image
+      static bool
+      IsImage(
+        const char * a_filename);
+
+      /** Map an image. Throws ImageError if the file can't be mapped or
+       * is not an image this interpreter understands.
+       */
+      explicit
+      ImageFile(
+        const char * a_filename);
+
+      /// Unmap the image
+      ~ImageFile();
+
+      /** Compute the checksum of a whole image in memory, see
+       * ImageHeader::m_checksum. Cheaper than any decoding, it reads each
+       * word once.
+       */
+      static uint64_t
+      Checksum(
+        const void * a_image,
+        size_t a_size);
+
+      /// Get the header of the image
+      const ImageHeader &
+      Header() const;
+
+      /** Find a section by type. Returns NULL if there is none, otherwise
+       * stores the size of the section in a_size.
+       */
+      const void *
+      FindSection(
+        uint32_t a_type,
+        size_t &a_size) const;
+
+    private:
+
+      /// Start of the mapped file
+      const char * m_data;
+
+      /// Size of the mapped file
+      size_t m_size;
+
+      /// No copies
+      ImageFile(
+        const ImageFile &);
+
+      /// No assignment
+      ImageFile &
+      operator=(
+        const ImageFile &);
+  };
+
+}
+
+#endif
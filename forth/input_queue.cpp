@@ -0,0 +1,87 @@
+#include "input_queue.hpp"
+
+namespace forth
+{
+  InputQueue::InputQueue()
+    : m_closed( false)
+    , m_wake( NULL)
+    , m_context( NULL)
+  {
+    pthread_mutex_init( &m_mutex, NULL);
+  }
+
+  InputQueue::~InputQueue()
+  {
+    pthread_mutex_destroy( &m_mutex);
+  }
+
+  void
+  InputQueue::Push(
+    const std::string &a_chars)
+  {
+    pthread_mutex_lock( &m_mutex);
+    m_chars.insert( m_chars.end(), a_chars.begin(), a_chars.end());
+    if ( !a_chars.empty())
+      WakeLocked();
+    pthread_mutex_unlock( &m_mutex);
+  }
+
+  void
+  InputQueue::Close()
+  {
+    pthread_mutex_lock( &m_mutex);
+    m_closed = true;
+    WakeLocked();
+    pthread_mutex_unlock( &m_mutex);
+  }
+
+  InputQueue::ReadStatus
+  InputQueue::TryRead(
+    char &a_char)
+  {
+    ReadStatus status = kRead;
+
+    pthread_mutex_lock( &m_mutex);
+    if ( !m_chars.empty())
+    {
+      a_char = m_chars.front();
+      m_chars.pop_front();
+    }
+    else
+      status = m_closed ? kClosed : kEmpty;
+    pthread_mutex_unlock( &m_mutex);
+
+    return status;
+  }
+
+  bool
+  InputQueue::Park(
+    WakeFunction a_wake,
+    void * a_context)
+  {
+    bool parked = false;
+
+    pthread_mutex_lock( &m_mutex);
+    if ( m_chars.empty() && !m_closed)
+    {
+      m_wake = a_wake;
+      m_context = a_context;
+      parked = true;
+    }
+    pthread_mutex_unlock( &m_mutex);
+
+    return parked;
+  }
+
+  void
+  InputQueue::WakeLocked()
+  {
+    if ( m_wake != NULL)
+    {
+      WakeFunction wake = m_wake;
+      m_wake = NULL;
+      wake( m_context);
+    }
+  }
+
+}
@@ -0,0 +1,101 @@
+#ifndef FORTH_INPUT_QUEUE_H
+#define FORTH_INPUT_QUEUE_H
+
+#include <deque>
+#include <string>
+
+#include <pthread.h>
+
+namespace forth
+{
+  /** Characters for the read intrinsic of a runtime, fed by another thread.
+   *
+   * A runtime reading from an empty queue doesn't block. It stops and waits
+   * to be run again. Whoever runs it may park it at the queue, the next
+   * characters wake it up. Closing the queue marks the end of the input.
+   */
+  class InputQueue
+  {
+    public:
+
+      /// Outcome of an attempt to read a character
+      enum ReadStatus
+      {
+        /// A character has been read
+        kRead,
+
+        /// No character is available yet
+        kEmpty,
+
+        /// No character is available and none will be
+        kClosed
+      };
+
+      /// Prototype of a function to wake a parked reader
+      typedef void (* WakeFunction)(
+        void * a_context);
+
+      /// Construct an empty, open queue
+      InputQueue();
+
+      /// Destruct the queue
+      ~InputQueue();
+
+      /// Append characters and wake a parked reader
+      void
+      Push(
+        const std::string &a_chars);
+
+      /// Mark the end of the input and wake a parked reader
+      void
+      Close();
+
+      /// Take the next character if there is one
+      ReadStatus
+      TryRead(
+        char &a_char);
+
+      /** Park a reader that found the queue empty. a_wake is called with
+       * a_context once there are characters or the queue is closed, on the
+       * thread that pushes them. Returns false without parking if that is
+       * the case already, the reader has to try again right away.
+       */
+      bool
+      Park(
+        WakeFunction a_wake,
+        void * a_context);
+
+    private:
+
+      /// Protects all members
+      pthread_mutex_t m_mutex;
+
+      /// Characters not read yet
+      std::deque<char> m_chars;
+
+      /// Flag if no characters will be pushed anymore
+      bool m_closed;
+
+      /// Function to wake the parked reader, NULL if none is parked
+      WakeFunction m_wake;
+
+      /// Context of m_wake
+      void * m_context;
+
+      /// Wake the parked reader, if any. The mutex is locked by the caller.
+      void
+      WakeLocked();
+
+      /// No copies
+      InputQueue(
+        const InputQueue &);
+
+      /// No assignment
+      InputQueue &
+      operator=(
+        const InputQueue &);
+  };
+
+}
+
+#endif
@@ -0,0 +1,126 @@
+#ifndef FORTH_INSTRUCTION_H
+#define FORTH_INSTRUCTION_H
+
+#include <stdint.h>
+
+namespace forth
+{
+  /** Operations of the decoded program.
+   *
+   * The first operations coincide with the opcodes of the intrinsics. This
+   * way, a computed call can dispatch through the same table as a decoded
+   * one.
+   */
+  enum Operation
+  {
+    kOpPlus = 0,
+    kOpMinus = 1,
+    kOpMult = 2,
+    kOpDiv = 3,
+    kOpMod = 4,
+    kOpAnd = 5,
+    kOpOr = 6,
+    kOpNot = 7,
+    kOpSwap = 8,
+    kOpDup = 9,
+    kOpDrop = 10,
+
+    /// Restart the line at slot m_arg on condition
+    kOpLoop = 11,
+
+    kOpEmit = 12,
+    kOpRead = 13,
+    kOpExit = 14,
+    kOpOver = 15,
+
+    /// Push m_arg onto the data stack
+    kOpLiteral = 21,
+
+    /// Take the opcode from the data stack and execute it
+    kOpCall,
+
+    /// Call line m_arg, which starts at slot m_arg2
+    kOpCallLine,
+
+    /// Continue with line m_arg at slot m_arg2 without returning, a tail call
+    kOpJumpLine,
+
+    /// Like kOpCall, but without returning to the current line
+    kOpTailCall,
+
+    /// End of the line, return to the caller
+    kOpReturn,
+
+    /// Do nothing
+    kOpNop,
+
+    /** Push the m_arg numbers of the code segment starting at index
+     * m_arg2, which are all literals
+     */
+    kOpPushBlock,
+
+    /** Like kOpCallLine, but continue with an inlined copy of the line at
+     * m_next, which returns to the slot behind the call without a frame
+     */
+    kOpInlineLine,
+
+    /** @name Superinstructions, see superinstructions.def */
+    /*@{*/
+#define FORTH_SUPERINSTRUCTION(name, length, op1, op2, op3) kOp ## name,
+#include "superinstructions.def"
+#undef FORTH_SUPERINSTRUCTION
+    /*@}*/
+
+    /** @name Operations without the check of the data stack, see
+     * unchecked.def
+     */
+    /*@{*/
+#define FORTH_UNCHECKED(name) kOp ## name ## Unchecked,
+#include "unchecked.def"
+#undef FORTH_UNCHECKED
+    /*@}*/
+
+    /// Number of operations
+    kOpCount
+  };
+
+  /** One slot of the decoded program.
+   *
+   * The decoded program has the same layout as the code segment. Slot i
+   * performs the computation that starts with the number at index i of the
+   * code segment. An instruction may cover several numbers, e.g. a literal
+   * followed by a call. Each of the covered numbers still has its own slot,
+   * so execution can continue at any index of the code segment.
+   *
+   * A second copy of the layout follows the first. It runs the lines the
+   * stack effect analysis has proven without checking the depth of the
+   * data stack per instruction, see Decoder.
+   *
+   * Behind both copies, small lines are copied once per call that inlines
+   * them. Each copy starts with a header, a kOpNop that holds the index of
+   * the line copied in m_arg and the slot to continue with in m_arg2.
+   */
+  struct Instruction
+  {
+    /// Operation to perform
+    uint16_t m_op;
+
+    /** Depth of the data stack plus one from which the rest of the line
+     * can run in the unchecked copy, 0 if it can't. In an inlined copy,
+     * the distance to its header instead.
+     */
+    uint16_t m_unchecked;
+
+    /// Distance to the following instruction in slots
+    int32_t m_next;
+
+    /// First operand
+    int32_t m_arg;
+
+    /// Second operand
+    int32_t m_arg2;
+  };
+
+}
+
+#endif
@@ -0,0 +1,473 @@
+#include <algorithm>
+#include <cstring>
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "jit.hpp"
+#include "runtime.hpp"
+
+#if defined( __x86_64__) && !defined( FORTH_NO_JIT)
+#define FORTH_JIT_X86_64
+#endif
+
+namespace forth
+{
+#ifdef FORTH_JIT_X86_64
+  namespace
+  {
+    /** Writer of x86-64 machine code for a line.
+     *
+     * Register use of the generated code:
+     *   rdi  memory of the top of the stack, the next item is at [rdi - 4]
+     *   r8d  top of the stack
+     *   rsi  memory of the top of an empty stack
+     *   r9   memory of the top of a full stack
+     *   r10  where to store rdi when done
+     * eax, ecx and edx are scratch registers. Only registers the caller
+     * saves are used, so there is nothing to save.
+     */
+    class Assembler
+    {
+      public:
+
+        /// Start the code of a line
+        Assembler()
+        {
+          // mov r9, rdx; mov r10, rcx; mov r8d, [rdi]
+          Emit( "\x49\x89\xd1\x49\x89\xca\x44\x8b\x07", 9);
+          m_lineStart = m_code.size();
+        }
+
+        /// Get the code
+        const std::vector<uint8_t> &
+        Code() const
+        {
+          return m_code;
+        }
+
+        /// Emit raw bytes
+        void
+        Emit(
+          const char * a_bytes,
+          size_t a_count)
+        {
+          m_code.insert( m_code.end(), a_bytes, a_bytes + a_count);
+        }
+
+        /// Emit a 32 bit immediate
+        void
+        Emit32(
+          uint32_t a_value)
+        {
+          for (int i = 0; i < 4; ++i)
+            m_code.push_back( static_cast<uint8_t>( a_value >> (8 * i)));
+        }
+
+        /// Leave to the interpreter at a slot unless there are a_count items
+        void
+        NeedItems(
+          size_t a_count,
+          size_t a_slot)
+        {
+          // lea rax, [rsi + 4 * count]; cmp rdi, rax; jb exit
+          Emit( "\x48\x8d\x86", 3);
+          Emit32( 4 * a_count);
+          Emit( "\x48\x39\xc7\x0f\x82", 5);
+          ExitFixup( a_slot);
+        }
+
+        /// Leave to the interpreter at a slot unless a_count items fit
+        void
+        NeedRoom(
+          size_t a_count,
+          size_t a_slot)
+        {
+          // lea rax, [rdi + 4 * count]; cmp rax, r9; ja exit
+          Emit( "\x48\x8d\x87", 3);
+          Emit32( 4 * a_count);
+          Emit( "\x4c\x39\xc8\x0f\x87", 5);
+          ExitFixup( a_slot);
+        }
+
+        /// Push a number, the room has been checked
+        void
+        Push(
+          uint32_t a_value)
+        {
+          // mov [rdi], r8d; add rdi, 4; mov r8d, value
+          Emit( "\x44\x89\x07\x48\x83\xc7\x04\x41\xb8", 9);
+          Emit32( a_value);
+        }
+
+        /// Drop the item below the top, which has been combined with it
+        void
+        DropSecond()
+        {
+          // sub rdi, 4
+          Emit( "\x48\x83\xef\x04", 4);
+        }
+
+        /// Drop the top
+        void
+        DropTop()
+        {
+          // sub rdi, 4; mov r8d, [rdi]
+          Emit( "\x48\x83\xef\x04\x44\x8b\x07", 7);
+        }
+
+        /// Restart the line unless the top is 0
+        void
+        LoopUnlessZero()
+        {
+          // test r8d, r8d; jnz start
+          Emit( "\x45\x85\xc0\x0f\x85", 5);
+          Emit32( m_lineStart - (m_code.size() + 4));
+        }
+
+        /// Leave to the interpreter at a slot
+        void
+        Exit(
+          size_t a_slot)
+        {
+          // mov [rdi], r8d; mov [r10], rdi; mov eax, slot; ret
+          Emit( "\x44\x89\x07\x49\x89\x3a\xb8", 7);
+          Emit32( a_slot);
+          Emit( "\xc3", 1);
+        }
+
+        /// Emit the exits the checks jump to
+        void
+        EmitExits()
+        {
+          for (size_t i = 0; i < m_fixups.size(); ++i)
+          {
+            size_t target = m_code.size();
+            Exit( m_fixups[i].m_slot);
+            Patch32( m_fixups[i].m_offset, target - (m_fixups[i].m_offset + 4));
+          }
+          m_fixups.clear();
+        }
+
+      private:
+
+        /// Jump to an exit, to be patched once the exit is emitted
+        struct Fixup
+        {
+          /// Offset of the 32 bit displacement
+          size_t m_offset;
+
+          /// Slot of the exit
+          size_t m_slot;
+        };
+
+        /// Code emitted so far
+        std::vector<uint8_t> m_code;
+
+        /// Offset of the code executed by a loop
+        size_t m_lineStart;
+
+        /// Jumps to patch
+        std::vector<Fixup> m_fixups;
+
+        /// Emit the displacement of a jump to an exit
+        void
+        ExitFixup(
+          size_t a_slot)
+        {
+          Fixup fixup = { m_code.size(), a_slot };
+          m_fixups.push_back( fixup);
+          Emit32( 0);
+        }
+
+        /// Overwrite a 32 bit immediate
+        void
+        Patch32(
+          size_t a_offset,
+          uint32_t a_value)
+        {
+          for (int i = 0; i < 4; ++i)
+            m_code[a_offset + i] = static_cast<uint8_t>( a_value >> (8 * i));
+        }
+    };
+
+    /** Emit an intrinsic that only works on the stack. The slot is the one
+     * of the number in front of the call. Returns false for intrinsics left
+     * to the interpreter.
+     */
+    bool
+    EmitIntrinsic(
+      Assembler &a_asm,
+      Program::Cell a_opCode,
+      size_t a_slot)
+    {
+      switch (a_opCode)
+      {
+        case kOpPlus:
+          // add r8d, [rdi - 4]
+          a_asm.NeedItems( 2, a_slot);
+          a_asm.Emit( "\x44\x03\x47\xfc", 4);
+          a_asm.DropSecond();
+          return true;
+
+        case kOpMinus:
+          // mov eax, [rdi - 4]; sub eax, r8d; mov r8d, eax
+          a_asm.NeedItems( 2, a_slot);
+          a_asm.Emit( "\x8b\x47\xfc\x44\x29\xc0\x41\x89\xc0", 9);
+          a_asm.DropSecond();
+          return true;
+
+        case kOpMult:
+          // imul r8d, [rdi - 4]
+          a_asm.NeedItems( 2, a_slot);
+          a_asm.Emit( "\x44\x0f\xaf\x47\xfc", 5);
+          a_asm.DropSecond();
+          return true;
+
+        case kOpDiv:
+          // mov eax, [rdi - 4]; cdq; idiv r8d; mov r8d, eax
+          a_asm.NeedItems( 2, a_slot);
+          a_asm.Emit( "\x8b\x47\xfc\x99\x41\xf7\xf8\x41\x89\xc0", 10);
+          a_asm.DropSecond();
+          return true;
+
+        case kOpMod:
+          // mov eax, [rdi - 4]; cdq; idiv r8d; mov r8d, edx
+          a_asm.NeedItems( 2, a_slot);
+          a_asm.Emit( "\x8b\x47\xfc\x99\x41\xf7\xf8\x41\x89\xd0", 10);
+          a_asm.DropSecond();
+          return true;
+
+        case kOpAnd:
+        case kOpOr:
+          // xor eax, eax; cmp dword [rdi - 4], 0; setne al;
+          // xor ecx, ecx; test r8d, r8d; setne cl;
+          // and/or eax, ecx; mov r8d, eax
+          a_asm.NeedItems( 2, a_slot);
+          a_asm.Emit( "\x31\xc0\x83\x7f\xfc\x00\x0f\x95\xc0"
+                      "\x31\xc9\x45\x85\xc0\x0f\x95\xc1", 17);
+          a_asm.Emit( (a_opCode == kOpAnd) ? "\x21\xc8" : "\x09\xc8", 2);
+          a_asm.Emit( "\x41\x89\xc0", 3);
+          a_asm.DropSecond();
+          return true;
+
+        case kOpNot:
+          // xor eax, eax; test r8d, r8d; sete al; mov r8d, eax
+          a_asm.NeedItems( 1, a_slot);
+          a_asm.Emit( "\x31\xc0\x45\x85\xc0\x0f\x94\xc0\x41\x89\xc0", 11);
+          return true;
+
+        case kOpSwap:
+          // mov eax, [rdi - 4]; mov [rdi - 4], r8d; mov r8d, eax
+          a_asm.NeedItems( 2, a_slot);
+          a_asm.Emit( "\x8b\x47\xfc\x44\x89\x47\xfc\x41\x89\xc0", 10);
+          return true;
+
+        case kOpDup:
+          // mov [rdi], r8d; add rdi, 4
+          a_asm.NeedItems( 1, a_slot);
+          a_asm.NeedRoom( 1, a_slot);
+          a_asm.Emit( "\x44\x89\x07\x48\x83\xc7\x04", 7);
+          return true;
+
+        case kOpDrop:
+          a_asm.NeedItems( 1, a_slot);
+          a_asm.DropTop();
+          return true;
+
+        case kOpLoop:
+          a_asm.NeedItems( 1, a_slot);
+          a_asm.LoopUnlessZero();
+          a_asm.DropTop();
+          return true;
+
+        case kOpOver:
+          // mov eax, [rdi - 4]; mov [rdi], r8d; add rdi, 4; mov r8d, eax
+          a_asm.NeedItems( 2, a_slot);
+          a_asm.NeedRoom( 1, a_slot);
+          a_asm.Emit( "\x8b\x47\xfc\x44\x89\x07\x48\x83\xc7\x04\x41\x89\xc0",
+            13);
+          return true;
+
+        default:
+          return false;
+      }
+    }
+  }
+#endif
+
+  Jit::Jit(
+    uint32_t a_threshold)
+    : m_threshold( a_threshold)
+    , m_prepared( false)
+    , m_disabled( !IsSupported())
+    , m_compiledLines( 0)
+  {
+  }
+
+  Jit::~Jit()
+  {
+    ReleaseChunks();
+  }
+
+  bool
+  Jit::IsSupported()
+  {
+#ifdef FORTH_JIT_X86_64
+    return true;
+#else
+    return false;
+#endif
+  }
+
+  void
+  Jit::Invalidate()
+  {
+    m_prepared = false;
+    m_lineCode.clear();
+    m_lineAt.clear();
+    m_compiledLines = 0;
+    ReleaseChunks();
+  }
+
+  void
+  Jit::Prepare(
+    const Program::View &a_view)
+  {
+    if ( m_prepared)
+      return;
+
+    m_view = a_view;
+    LineCode empty = { NULL, 0 };
+    m_lineCode.assign( m_view.m_lineCount, empty);
+    m_lineAt.assign( m_view.m_codeSize, 0);
+    for (size_t row = 0; row < m_view.m_lineCount; ++row)
+      m_lineAt[m_view.m_lines[row].m_offset] = row;
+    m_prepared = true;
+  }
+
+  Jit::Function
+  Jit::Compile(
+    size_t a_line)
+  {
+    if ( m_disabled)
+      return NULL;
+
+#ifdef FORTH_JIT_X86_64
+    const Program::Line &line = m_view.m_lines[a_line];
+    const Program::Cell * code = m_view.m_code;
+    const size_t end = line.End();
+
+    // Translate the numbers like the decoder does, up to the first one
+    // left to the interpreter
+    Assembler assembler;
+    size_t i = line.m_offset;
+    bool loops = false;
+    while ( i < end)
+    {
+      if ( code[i] == Runtime::kOpCodeCall)
+        break;
+
+      if ( (i + 1 < end) && (code[i + 1] == Runtime::kOpCodeCall))
+      {
+        // Negative opcodes are ignored, calls of lines are left to the
+        // interpreter
+        Program::Cell opCode = code[i];
+        if ( (opCode >= 0) && !EmitIntrinsic( assembler, opCode, i))
+          break;
+        loops |= (opCode == Runtime::kOpCodeLoop);
+        i += 2;
+        continue;
+      }
+
+      // Push a run of literals after checking the room once
+      size_t run = i;
+      while ( (run < end) && (code[run] != Runtime::kOpCodeCall) &&
+              !((run + 1 < end) && (code[run + 1] == Runtime::kOpCodeCall)))
+        ++run;
+      assembler.NeedRoom( run - i, i);
+      for (; i < run; ++i)
+        assembler.Push( static_cast<uint32_t>( code[i]));
+    }
+
+    // A few numbers aren't worth the extra call, unless they loop
+    if ( !loops && (i - line.m_offset < kMinNumbers))
+      return NULL;
+
+    // Continue with the first number not translated, or return
+    assembler.Exit( i);
+    assembler.EmitExits();
+
+    void * memory = Install( assembler.Code());
+    if ( memory == NULL)
+      return NULL;
+    ++m_compiledLines;
+    m_lineCode[a_line].m_function = reinterpret_cast<Function>( memory);
+    return m_lineCode[a_line].m_function;
+#else
+    return NULL;
+#endif
+  }
+
+  void *
+  Jit::Install(
+    const std::vector<uint8_t> &a_code)
+  {
+    const size_t kChunkSize = 64 * 1024;
+
+    if ( m_chunks.empty() ||
+         (m_chunks.back().m_used + a_code.size() > m_chunks.back().m_size))
+    {
+      size_t page = sysconf( _SC_PAGESIZE);
+      Chunk chunk;
+      chunk.m_size = std::max( kChunkSize,
+        (a_code.size() + page - 1) / page * page);
+      chunk.m_used = 0;
+      void * memory = mmap( NULL, chunk.m_size, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if ( memory == MAP_FAILED)
+      {
+        Disable();
+        return NULL;
+      }
+      chunk.m_memory = static_cast<uint8_t *>( memory);
+      m_chunks.push_back( chunk);
+    }
+
+    // The memory is never writable and executable at the same time
+    Chunk &chunk = m_chunks.back();
+    if ( mprotect( chunk.m_memory, chunk.m_size, PROT_READ | PROT_WRITE) != 0)
+    {
+      Disable();
+      return NULL;
+    }
+    uint8_t * memory = chunk.m_memory + chunk.m_used;
+    memcpy( memory, &a_code[0], a_code.size());
+    chunk.m_used += a_code.size();
+    if ( mprotect( chunk.m_memory, chunk.m_size, PROT_READ | PROT_EXEC) != 0)
+    {
+      Disable();
+      return NULL;
+    }
+    return memory;
+  }
+
+  void
+  Jit::Disable()
+  {
+    // Code already installed may not be executable any more
+    m_disabled = true;
+    for (size_t i = 0; i < m_lineCode.size(); ++i)
+      m_lineCode[i].m_function = NULL;
+    m_compiledLines = 0;
+  }
+
+  void
+  Jit::ReleaseChunks()
+  {
+    for (size_t i = 0; i < m_chunks.size(); ++i)
+      munmap( m_chunks[i].m_memory, m_chunks[i].m_size);
+    m_chunks.clear();
+  }
+
+}
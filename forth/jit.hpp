@@ -0,0 +1,189 @@
+#ifndef FORTH_JIT_H
+#define FORTH_JIT_H
+
+#include <vector>
+#include <stdint.h>
+#include <cstddef>
+
+#include "program.hpp"
+
+namespace forth
+{
+  /** Compiler of hot lines to native code.
+   *
+   * Run counts how often each line is entered. Once a line has been entered
+   * often enough, it is translated to x86-64 code. The native code keeps the
+   * top of the data stack in a register, executes the arithmetic and stack
+   * intrinsics in place and restarts the line by a jump when it loops.
+   *
+   * Everything else is left to the interpreter. The native code returns the
+   * slot of the decoded program to continue at when it reaches a call, an
+   * intrinsic that prints, reads or exits, or the end of the line. It also
+   * returns before an instruction that would take from an empty stack or
+   * push onto a full one, so the interpreter reports the error with the same
+   * state it would have had without the native code. A line that doesn't
+   * loop and would return to the interpreter after a few numbers stays
+   * interpreted, as the call would cost more than it saves.
+   *
+   * On other CPUs, or if the memory for the code can't be made executable,
+   * no line is compiled and Run interprets all of them.
+   *
+   * Each runtime has a compiler of its own, so nothing has to be
+   * synchronized.
+   */
+  class Jit
+  {
+    public:
+
+      /// Contents of the data stack
+      typedef Program::Cell Cell;
+
+      /** Native code of a line.
+       *
+       * a_top points to the memory of the top of the stack, a_bottom to the
+       * memory an empty stack's top would be in and a_limit to the memory
+       * of the top of a full stack. The top when done is stored in
+       * a_newTop. Returns the slot of the decoded program to continue at.
+       */
+      typedef uint32_t (* Function)(
+        Cell * a_top,
+        const Cell * a_bottom,
+        const Cell * a_limit,
+        Cell * * a_newTop);
+
+      /// Check if native code can be generated for this CPU
+      static bool
+      IsSupported();
+
+      /** Construct a compiler that compiles a line once it has been entered
+       * a_threshold times.
+       */
+      explicit
+      Jit(
+        uint32_t a_threshold);
+
+      /// Release the native code
+      ~Jit();
+
+      /// Forget all native code, e.g. when the program changes
+      void
+      Invalidate();
+
+      /// Get ready to compile lines of a program, unless done already
+      void
+      Prepare(
+        const Program::View &a_view);
+
+      /** Count an entry into the line starting at a slot. Returns its native
+       * code once it is hot, NULL otherwise.
+       */
+      Function
+      Enter(
+        size_t a_slot)
+      {
+        size_t row = m_lineAt[a_slot];
+        LineCode &line = m_lineCode[row];
+        if ( line.m_function != NULL)
+          return line.m_function;
+
+        // Lines that have been tried once aren't counted any more
+        if ( (line.m_entries == m_threshold) ||
+             (++line.m_entries != m_threshold))
+          return NULL;
+        return Compile( row);
+      }
+
+      /// Get the number of lines compiled so far
+      size_t
+      CountCompiledLines() const
+      {
+        return m_compiledLines;
+      }
+
+    private:
+
+      /// Minimal number of numbers to translate in a line without a loop
+      static const size_t kMinNumbers = 8;
+
+      /// Native code of a line
+      struct LineCode
+      {
+        /// Native code, NULL if not compiled
+        Function m_function;
+
+        /// Number of entries, up to the threshold
+        uint32_t m_entries;
+      };
+
+      /// Block of executable memory
+      struct Chunk
+      {
+        /// Start of the memory
+        uint8_t * m_memory;
+
+        /// Size of the memory
+        size_t m_size;
+
+        /// Number of bytes used
+        size_t m_used;
+      };
+
+      /// Number of entries after which a line is compiled
+      uint32_t m_threshold;
+
+      /// Program to compile
+      Program::View m_view;
+
+      /// Flag if Prepare has been called since Invalidate
+      bool m_prepared;
+
+      /// Flag if native code can't be generated
+      bool m_disabled;
+
+      /// Native code and entries, indexed by line
+      std::vector<LineCode> m_lineCode;
+
+      /// Lines, indexed by the slot they start at
+      std::vector<uint32_t> m_lineAt;
+
+      /// Executable memory
+      std::vector<Chunk> m_chunks;
+
+      /// Number of lines compiled
+      size_t m_compiledLines;
+
+      /** Compile a line. Returns NULL if it can't be compiled, or isn't
+       * worth it.
+       */
+      Function
+      Compile(
+        size_t a_line);
+
+      /** Copy code into executable memory. Returns NULL if there is no
+       * memory.
+       */
+      void *
+      Install(
+        const std::vector<uint8_t> &a_code);
+
+      /// Stop compiling and forget all native code
+      void
+      Disable();
+
+      /// Release the executable memory
+      void
+      ReleaseChunks();
+
+      /// No copies
+      Jit(
+        const Jit &);
+
+      /// No assignment
+      Jit &
+      operator=(
+        const Jit &);
+  };
+
+}
+
+#endif
@@ -0,0 +1,378 @@
+#include <algorithm>
+#include <cstring>
+
+#include "memo_cache.hpp"
+#include "runtime.hpp"
+
+namespace forth
+{
+  namespace
+  {
+    /// State of a line during the analysis
+    enum AnalysisState
+    {
+      kUnvisited,
+      kVisiting,
+      kDone
+    };
+
+    /// Mark a signature as not pure
+    void
+    SetImpure(
+      MemoCache::Signature &a_signature)
+    {
+      a_signature.m_pure = false;
+      a_signature.m_inputs = 0;
+      a_signature.m_outputs = 0;
+      a_signature.m_peak = 0;
+      a_signature.m_calls = 0;
+    }
+
+    /// Line whose signature is being computed
+    struct Visit
+    {
+      /// Row of the line
+      size_t m_line;
+
+      /// Slot to go on with
+      size_t m_slot;
+
+      /// Depth relative to the entry, its minimum gives the cells taken
+      long m_depth;
+
+      /// Lowest depth so far
+      long m_lowest;
+
+      /// Highest depth so far
+      long m_highest;
+
+      /// Deepest nesting of calls so far
+      uint32_t m_calls;
+    };
+
+    /// Mark a line as visited and put it on top of the visits
+    void
+    BeginVisit(
+      const Program::View &a_view,
+      size_t a_line,
+      std::vector<MemoCache::Signature> &a_signatures,
+      std::vector<AnalysisState> &a_states,
+      std::vector<Visit> &a_visits)
+    {
+      a_states[a_line] = kVisiting;
+      SetImpure( a_signatures[a_line]);
+      Visit visit = { a_line, a_view.m_lines[a_line].m_offset, 0, 0, 0, 0 };
+      a_visits.push_back( visit);
+    }
+
+    /** Follow one slot of a line. Returns false if the line turns out
+     * impure. Sets a_target to a line that has to be analyzed before the
+     * slot can be followed, the slot is left as it was then.
+     */
+    bool
+    FollowSlot(
+      const Program::View &a_view,
+      size_t a_slot,
+      Visit &a_visit,
+      const std::vector<MemoCache::Signature> &a_signatures,
+      const std::vector<AnalysisState> &a_states,
+      size_t &a_target)
+    {
+      const Program::Line &line = a_view.m_lines[a_visit.m_line];
+      const Program::Cell * code = a_view.m_code;
+      size_t i = a_slot;
+      if (code[i] != Runtime::kOpCodeCall)
+      {
+        ++a_visit.m_depth;
+        a_visit.m_highest = std::max( a_visit.m_highest, a_visit.m_depth);
+        return true;
+      }
+
+      // A computed target could be anything
+      if ( (i == line.m_offset) || (code[i - 1] == Runtime::kOpCodeCall))
+        return false;
+
+      // The call takes the opcode pushed before it
+      Program::Cell opCode = code[i - 1];
+      if (opCode < 0)
+      {
+        --a_visit.m_depth;
+        return true;
+      }
+
+      long taken;
+      long left;
+      if (opCode < Runtime::kOpCodeFirstUser)
+      {
+        switch (opCode)
+        {
+          case kOpPlus:
+          case kOpMinus:
+          case kOpMult:
+          case kOpDiv:
+          case kOpMod:
+          case kOpAnd:
+          case kOpOr:
+            taken = 2;
+            left = 1;
+            break;
+
+          case kOpNot:
+            taken = 1;
+            left = 1;
+            break;
+
+          case kOpSwap:
+            taken = 2;
+            left = 2;
+            break;
+
+          case kOpDup:
+            taken = 1;
+            left = 2;
+            break;
+
+          case kOpDrop:
+            taken = 1;
+            left = 0;
+            break;
+
+          case kOpOver:
+            taken = 2;
+            left = 3;
+            break;
+
+          default:
+            // Loop, emit, read and exit depend on more than the stack
+            return false;
+        }
+        --a_visit.m_depth;
+        a_visit.m_lowest = std::min( a_visit.m_lowest,
+          a_visit.m_depth - taken);
+        a_visit.m_depth += left - taken;
+        a_visit.m_highest = std::max( a_visit.m_highest, a_visit.m_depth);
+        return true;
+      }
+
+      // Calls outside the program go to the first line
+      size_t target = opCode;
+      if (target >= a_view.m_lineCount)
+        target = Runtime::kOpCodeFirstUser;
+
+      // Recursion can't end without a loop or a computed call
+      if (a_states[target] == kVisiting)
+        return false;
+      if (a_states[target] == kUnvisited)
+      {
+        a_target = target;
+        return true;
+      }
+
+      const MemoCache::Signature &callee = a_signatures[target];
+      if ( !callee.m_pure)
+        return false;
+      --a_visit.m_depth;
+      a_visit.m_lowest = std::min( a_visit.m_lowest,
+        a_visit.m_depth - long( callee.m_inputs));
+      a_visit.m_highest = std::max( a_visit.m_highest,
+        a_visit.m_depth + long( callee.m_peak));
+      a_visit.m_depth += long( callee.m_outputs) - long( callee.m_inputs);
+      a_visit.m_calls = std::max( a_visit.m_calls, callee.m_calls + 1);
+      return true;
+    }
+
+    /** Compute the signature of a line and the lines it calls. Calls may
+     * nest as deep as the program has lines, so they aren't followed by
+     * recursion. A line found impure is left visiting, so its callers are
+     * impure as well.
+     */
+    void
+    AnalyzeLine(
+      const Program::View &a_view,
+      size_t a_line,
+      std::vector<MemoCache::Signature> &a_signatures,
+      std::vector<AnalysisState> &a_states)
+    {
+      std::vector<Visit> visits;
+      BeginVisit( a_view, a_line, a_signatures, a_states, visits);
+      while (!visits.empty())
+      {
+        Visit &visit = visits.back();
+        const Program::Line &line = a_view.m_lines[visit.m_line];
+
+        // Follow the line until it ends, turns out impure or calls a line
+        // that hasn't been analyzed yet
+        bool pure = true;
+        size_t target = a_view.m_lineCount;
+        while (pure && (target == a_view.m_lineCount) &&
+               (visit.m_slot < line.End()))
+        {
+          pure = FollowSlot( a_view, visit.m_slot, visit, a_signatures,
+            a_states, target);
+          if (pure && (target == a_view.m_lineCount))
+            ++visit.m_slot;
+        }
+
+        if (!pure)
+        {
+          visits.pop_back();
+          continue;
+        }
+        if (target != a_view.m_lineCount)
+        {
+          BeginVisit( a_view, target, a_signatures, a_states, visits);
+          continue;
+        }
+
+        MemoCache::Signature &signature = a_signatures[visit.m_line];
+        signature.m_pure = true;
+        signature.m_inputs = -visit.m_lowest;
+        signature.m_outputs = visit.m_depth - visit.m_lowest;
+        signature.m_peak = visit.m_highest;
+        signature.m_calls = visit.m_calls;
+        a_states[visit.m_line] = kDone;
+        visits.pop_back();
+      }
+    }
+  }
+
+  MemoCache::MemoCache(
+    size_t a_entries)
+    : m_prepared( false)
+    , m_hits( 0)
+    , m_misses( 0)
+  {
+    size_t size = 1;
+    while ( size < a_entries)
+      size *= 2;
+
+    Entry unused;
+    memset( &unused, 0, sizeof( unused));
+    unused.m_line = -1;
+    m_entries.resize( size, unused);
+  }
+
+  void
+  MemoCache::Analyze(
+    const Program::View &a_view,
+    std::vector<Signature> &a_signatures)
+  {
+    a_signatures.resize( a_view.m_lineCount);
+    std::vector<AnalysisState> states( a_view.m_lineCount, kUnvisited);
+
+    // Intrinsics are executed in place, they are never called as lines
+    for (size_t row = 0; row < a_view.m_lineCount; ++row)
+    {
+      if (row < static_cast<size_t>( Runtime::kOpCodeFirstUser))
+      {
+        SetImpure( a_signatures[row]);
+        states[row] = kDone;
+      }
+      else if (states[row] == kUnvisited)
+        AnalyzeLine( a_view, row, a_signatures, states);
+
+      // A line that has been found to be impure while visited stays that way
+      states[row] = kDone;
+    }
+  }
+
+  void
+  MemoCache::Invalidate()
+  {
+    m_prepared = false;
+    m_signatures.clear();
+    m_memoized.clear();
+    m_calls.clear();
+    for (size_t i = 0; i < m_entries.size(); ++i)
+      m_entries[i].m_line = -1;
+  }
+
+  void
+  MemoCache::Prepare(
+    const Program::View &a_view)
+  {
+    if (m_prepared)
+      return;
+
+    Analyze( a_view, m_signatures);
+    m_memoized.assign( m_signatures.size(), false);
+    for (size_t row = 0; row < m_signatures.size(); ++row)
+    {
+      const Signature &signature = m_signatures[row];
+      m_memoized[row] = signature.m_pure &&
+                        (signature.m_inputs <= kMaxCells) &&
+                        (signature.m_outputs <= kMaxCells);
+    }
+    m_prepared = true;
+  }
+
+  bool
+  MemoCache::Lookup(
+    size_t a_line,
+    Cell * a_cells)
+  {
+    const Signature &signature = m_signatures[a_line];
+    Entry &entry = Slot( a_line, a_cells, signature.m_inputs);
+    if ( (entry.m_line != static_cast<int32_t>( a_line)) ||
+         !std::equal( a_cells, a_cells + signature.m_inputs,
+           entry.m_inputs))
+    {
+      ++m_misses;
+      return false;
+    }
+
+    std::copy( entry.m_outputs, entry.m_outputs + signature.m_outputs,
+      a_cells);
+    ++m_hits;
+    return true;
+  }
+
+  void
+  MemoCache::BeginCall(
+    size_t a_depth,
+    size_t a_line,
+    const Cell * a_inputs)
+  {
+    PendingCall call;
+    call.m_depth = a_depth;
+    call.m_line = a_line;
+    std::copy( a_inputs, a_inputs + m_signatures[a_line].m_inputs,
+      call.m_inputs);
+    m_calls.push_back( call);
+  }
+
+  void
+  MemoCache::EndCall(
+    const Cell * a_end)
+  {
+    const PendingCall &call = m_calls.back();
+    const Signature &signature = m_signatures[call.m_line];
+
+    Entry &entry = Slot( call.m_line, call.m_inputs, signature.m_inputs);
+    entry.m_line = static_cast<int32_t>( call.m_line);
+    std::copy( call.m_inputs, call.m_inputs + signature.m_inputs,
+      entry.m_inputs);
+    std::copy( a_end - signature.m_outputs, a_end, entry.m_outputs);
+    m_calls.pop_back();
+  }
+
+  void
+  MemoCache::AbandonCalls()
+  {
+    m_calls.clear();
+  }
+
+  MemoCache::Entry &
+  MemoCache::Slot(
+    size_t a_line,
+    const Cell * a_inputs,
+    size_t a_count)
+  {
+    uint32_t hash = static_cast<uint32_t>( a_line) * 0x9e3779b1u;
+    for (size_t i = 0; i < a_count; ++i)
+      hash = (hash ^ static_cast<uint32_t>( a_inputs[i])) * 0x01000193u;
+    hash ^= hash >> 15;
+    return m_entries[hash & (m_entries.size() - 1)];
+  }
+
+}
@@ -0,0 +1,215 @@
+#ifndef FORTH_MEMO_CACHE_H
+#define FORTH_MEMO_CACHE_H
+
+#include <vector>
+#include <stdint.h>
+#include <cstddef>
+
+#include "program.hpp"
+
+namespace forth
+{
+  /** Results of calls of pure lines, keyed by the cells they take.
+   *
+   * A line is pure if its effect depends on nothing but the top-most cells
+   * of the data stack. It doesn't print, read, exit or loop, and it calls
+   * only pure lines by constant opcodes. The number of cells it takes and
+   * leaves is then known before it runs, so a call with the same cells can
+   * be replaced by the cells it left last time.
+   *
+   * The cache has a fixed number of entries and is direct mapped. A new
+   * result replaces the one in its slot.
+   *
+   * Each runtime has a cache of its own, so runtimes sharing a program don't
+   * share their results.
+   */
+  class MemoCache
+  {
+    public:
+
+      /// Contents of the data stack
+      typedef Program::Cell Cell;
+
+      /// Most cells a memoized line may take or leave
+      static const size_t kMaxCells = 4;
+
+      /// Stack effect of a line
+      struct Signature
+      {
+        /// Flag if the line is pure, the counts below are valid only then
+        bool m_pure;
+
+        /// Number of cells taken from the data stack
+        uint32_t m_inputs;
+
+        /// Number of cells left in their place
+        uint32_t m_outputs;
+
+        /// Most cells above the entry depth while the line runs
+        uint32_t m_peak;
+
+        /// Deepest nesting of calls made by the line
+        uint32_t m_calls;
+      };
+
+      /** Construct an empty cache. The number of entries is rounded up to a
+       * power of two.
+       */
+      explicit
+      MemoCache(
+        size_t a_entries);
+
+      /** Compute the signatures of all lines of a program, indexed by line.
+       * Intrinsics and lines outside the program are not pure.
+       */
+      static void
+      Analyze(
+        const Program::View &a_view,
+        std::vector<Signature> &a_signatures);
+
+      /// Forget the signatures and all results, e.g. when the program changes
+      void
+      Invalidate();
+
+      /// Analyze the program unless that has been done since Invalidate
+      void
+      Prepare(
+        const Program::View &a_view);
+
+      /// Check if calls of a line are memoized
+      bool
+      IsMemoized(
+        size_t a_line) const
+      {
+        return m_memoized[a_line];
+      }
+
+      /// Get the signature of a line
+      const Signature &
+      GetSignature(
+        size_t a_line) const
+      {
+        return m_signatures[a_line];
+      }
+
+      /** Look up the result of a call. a_cells holds the cells taken, bottom
+       * first. On a hit, they are replaced by the cells left.
+       */
+      bool
+      Lookup(
+        size_t a_line,
+        Cell * a_cells);
+
+      /** Remember a call that missed the cache. a_depth is the depth of the
+       * return stack after the call, a_inputs the cells taken.
+       */
+      void
+      BeginCall(
+        size_t a_depth,
+        size_t a_line,
+        const Cell * a_inputs);
+
+      /// Check if a return at a given return stack depth ends a call
+      bool
+      IsCallEnding(
+        size_t a_depth) const
+      {
+        return !m_calls.empty() && (m_calls.back().m_depth == a_depth);
+      }
+
+      /** Store the result of the innermost call. a_end points behind the top
+       * of the data stack.
+       */
+      void
+      EndCall(
+        const Cell * a_end);
+
+      /** Forget the calls in progress, e.g. when execution leaves them
+       * without returning.
+       */
+      void
+      AbandonCalls();
+
+      /// Get the number of calls answered from the cache
+      uint64_t
+      CountHits() const
+      {
+        return m_hits;
+      }
+
+      /// Get the number of calls that had to be executed
+      uint64_t
+      CountMisses() const
+      {
+        return m_misses;
+      }
+
+    private:
+
+      /// Result of a call
+      struct Entry
+      {
+        /// Line called, -1 for an unused entry
+        int32_t m_line;
+
+        /// Cells taken, bottom first
+        Cell m_inputs[kMaxCells];
+
+        /// Cells left, bottom first
+        Cell m_outputs[kMaxCells];
+      };
+
+      /// Call that missed the cache and is still running
+      struct PendingCall
+      {
+        /// Depth of the return stack while the line runs
+        size_t m_depth;
+
+        /// Line called
+        size_t m_line;
+
+        /// Cells taken, bottom first
+        Cell m_inputs[kMaxCells];
+      };
+
+      /// Flag if the signatures are up to date
+      bool m_prepared;
+
+      /// Signatures, indexed by line
+      std::vector<Signature> m_signatures;
+
+      /// Flags if the calls of a line are memoized, indexed by line
+      std::vector<bool> m_memoized;
+
+      /// Results, the size is a power of two
+      std::vector<Entry> m_entries;
+
+      /// Calls in progress, innermost last
+      std::vector<PendingCall> m_calls;
+
+      /// Number of hits
+      uint64_t m_hits;
+
+      /// Number of misses
+      uint64_t m_misses;
+
+      /// Find the entry a call is stored in
+      Entry &
+      Slot(
+        size_t a_line,
+        const Cell * a_inputs,
+        size_t a_count);
+
+      /// No copies
+      MemoCache(
+        const MemoCache &);
+
+      /// No assignment
+      MemoCache &
+      operator=(
+        const MemoCache &);
+  };
+
+}
+
+#endif
@@ -0,0 +1,723 @@
+#ifndef FORTH_NATIVE_H
+#define FORTH_NATIVE_H
+
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+#include <pthread.h>
+
+namespace forth
+{
+  /** Support of programs translated to C++ by forthytwo --emit-cpp.
+   *
+   * The translated program needs nothing but this header and the threads
+   * library. Each line becomes a function working on a Machine, which holds
+   * the data stack, counts the frames of the return stack and buffers the
+   * output. The errors are reported with the same messages as the
+   * interpreter.
+   *
+   * A line returns 0 to its caller, or the number of a line to continue
+   * with after a call in its last position. This way, such calls take no
+   * frame, like in the interpreter.
+   */
+  namespace native
+  {
+    /// Contents of the data stack, same as Runtime::Cell
+    typedef int32_t Cell;
+
+    /// First line that isn't an intrinsic, same as Runtime::kOpCodeFirstUser
+    static const Cell kOpCodeFirstUser = 21;
+
+    /// Maximal number of items on the data stack, as in the interpreter
+    static const size_t kDataStackDepth = 1 << 20;
+
+    /// Maximal number of frames on the return stack, as in the interpreter
+    static const size_t kReturnStackDepth = 1 << 20;
+
+    /// Bytes of the native stack reserved for each frame of the return stack
+    static const size_t kStackPerFrame = 256;
+
+    /// Thrown by the exit intrinsic to leave all lines
+    struct ExitRequest
+    {
+    };
+
+    /// State of a running program
+    class Machine
+    {
+      public:
+
+        /// Construct a machine with empty stacks
+        explicit
+        Machine(
+          const char * a_filename)
+          : m_storage( kDataStackDepth + 1)
+          , m_filename( a_filename)
+          , m_depth( 0)
+          , m_exited( false)
+          , m_exitCode( 0)
+          , m_capture( NULL)
+        {
+          m_bottom = &m_storage[0];
+          m_limit = m_bottom + kDataStackDepth;
+          m_sp = m_bottom;
+        }
+
+        /// Flush the output
+        ~Machine()
+        {
+          Flush();
+        }
+
+        /// Push a number
+        void
+        Push(
+          Cell a_line,
+          Cell a_value)
+        {
+          if ( m_sp == m_limit)
+            Fail( a_line, "data stack overflow");
+          *++m_sp = a_value;
+        }
+
+        /// Pop a number
+        Cell
+        Pop(
+          Cell a_line)
+        {
+          if ( m_sp == m_bottom)
+            Fail( a_line, "data stack underflow");
+          return *m_sp--;
+        }
+
+        /** @name Intrinsics
+         *
+         * a_line is the line that executes them, for the error messages.
+         */
+        /*@{*/
+
+        void
+        Plus(
+          Cell a_line)
+        {
+          Need( a_line, 2);
+          --m_sp;
+          m_sp[0] = Wrap( static_cast<uint32_t>( m_sp[0]) +
+                          static_cast<uint32_t>( m_sp[1]));
+        }
+
+        void
+        Minus(
+          Cell a_line)
+        {
+          Need( a_line, 2);
+          --m_sp;
+          m_sp[0] = Wrap( static_cast<uint32_t>( m_sp[0]) -
+                          static_cast<uint32_t>( m_sp[1]));
+        }
+
+        void
+        Mult(
+          Cell a_line)
+        {
+          Need( a_line, 2);
+          --m_sp;
+          m_sp[0] = Wrap( static_cast<uint32_t>( m_sp[0]) *
+                          static_cast<uint32_t>( m_sp[1]));
+        }
+
+        void
+        Div(
+          Cell a_line)
+        {
+          Need( a_line, 2);
+          --m_sp;
+          m_sp[0] /= m_sp[1];
+        }
+
+        void
+        Mod(
+          Cell a_line)
+        {
+          Need( a_line, 2);
+          --m_sp;
+          m_sp[0] %= m_sp[1];
+        }
+
+        void
+        And(
+          Cell a_line)
+        {
+          Need( a_line, 2);
+          --m_sp;
+          m_sp[0] = ((m_sp[0] != 0) && (m_sp[1] != 0)) ? 1 : 0;
+        }
+
+        void
+        Or(
+          Cell a_line)
+        {
+          Need( a_line, 2);
+          --m_sp;
+          m_sp[0] = ((m_sp[0] != 0) || (m_sp[1] != 0)) ? 1 : 0;
+        }
+
+        void
+        Not(
+          Cell a_line)
+        {
+          Need( a_line, 1);
+          m_sp[0] = (m_sp[0] == 0) ? 1 : 0;
+        }
+
+        void
+        Swap()
+        {
+          if ( m_sp - m_bottom < 2)
+            throw std::runtime_error( "Swap");
+          Cell top = m_sp[0];
+          m_sp[0] = m_sp[-1];
+          m_sp[-1] = top;
+        }
+
+        void
+        Dup(
+          Cell a_line)
+        {
+          if ( m_sp == m_bottom)
+            throw std::runtime_error( "Dup");
+          Push( a_line, m_sp[0]);
+        }
+
+        void
+        Drop(
+          Cell a_line)
+        {
+          Pop( a_line);
+        }
+
+        /// Returns true if the line has to start again
+        bool
+        Loop()
+        {
+          if ( m_sp == m_bottom)
+            throw std::runtime_error( "Dup");
+          if ( m_sp[0] != 0)
+            return true;
+          --m_sp;
+          return false;
+        }
+
+        void
+        Emit(
+          Cell a_line)
+        {
+          Cell value = Pop( a_line);
+          if ( (0 <= value) && (value < 255))
+          {
+            m_output += static_cast<char>( value);
+            if ( (m_capture == NULL) && (m_output.size() >= 4096))
+              Flush();
+          }
+        }
+
+        /// Read a character, -1 at the end of the input
+        void
+        Read(
+          Cell a_line)
+        {
+          Flush();
+          char c;
+          if ( std::cin >> c)
+            Push( a_line, c);
+          else
+            Push( a_line, -1);
+        }
+
+        void
+        Exit(
+          Cell a_line)
+        {
+          m_exitCode = Pop( a_line);
+          m_exited = true;
+          throw ExitRequest();
+        }
+
+        void
+        Over(
+          Cell a_line)
+        {
+          if ( m_sp - m_bottom < 2)
+            throw std::runtime_error( "Over");
+          Push( a_line, m_sp[-1]);
+        }
+
+        /*@}*/
+
+        /** Execute an intrinsic chosen at run time. Returns true if the line
+         * has to start again.
+         */
+        bool
+        Intrinsic(
+          Cell a_line,
+          Cell a_opCode)
+        {
+          switch (a_opCode)
+          {
+            case 0: Plus( a_line); break;
+            case 1: Minus( a_line); break;
+            case 2: Mult( a_line); break;
+            case 3: Div( a_line); break;
+            case 4: Mod( a_line); break;
+            case 5: And( a_line); break;
+            case 6: Or( a_line); break;
+            case 7: Not( a_line); break;
+            case 8: Swap(); break;
+            case 9: Dup( a_line); break;
+            case 10: Drop( a_line); break;
+            case 11: return Loop();
+            case 12: Emit( a_line); break;
+            case 13: Read( a_line); break;
+            case 15: Over( a_line); break;
+            default: Exit( a_line); break;
+          }
+          return false;
+        }
+
+        /// Take a frame of the return stack for a call from a line
+        void
+        Enter(
+          Cell a_line)
+        {
+          if ( m_depth == kReturnStackDepth)
+            Fail( a_line, "return stack overflow");
+          ++m_depth;
+        }
+
+        /// Give back the frame of a call
+        void
+        Leave()
+        {
+          --m_depth;
+        }
+
+        /// Report an error in a line
+        void
+        Fail(
+          Cell a_line,
+          const char * a_what) const
+        {
+          std::ostringstream str;
+          str << m_filename << "(" << a_line << "): " << a_what;
+          throw std::runtime_error( str.str().c_str());
+        }
+
+        /// Write the output
+        void
+        Flush()
+        {
+          if ( m_capture != NULL)
+            *m_capture += m_output;
+          else
+          {
+            std::cout.flush();
+            fwrite( m_output.data(), 1, m_output.size(), stdout);
+            fflush( stdout);
+          }
+          m_output.clear();
+        }
+
+        /// Collect the output in a string instead of printing it
+        void
+        SetCapture(
+          std::string * a_capture)
+        {
+          Flush();
+          m_capture = a_capture;
+        }
+
+        /// Get the numbers on the data stack, bottom first
+        std::vector<Cell>
+        GetDataStack() const
+        {
+          return std::vector<Cell>( m_bottom + 1, m_sp + 1);
+        }
+
+        /// Flag if the program called the exit intrinsic
+        bool
+        HasExited() const
+        {
+          return m_exited;
+        }
+
+        /// Code passed to the exit intrinsic
+        Cell
+        GetExitCode() const
+        {
+          return m_exitCode;
+        }
+
+      private:
+
+        /// Memory of the data stack, the first item is never used
+        std::vector<Cell> m_storage;
+
+        /// Top of the data stack, m_bottom if it is empty
+        Cell * m_sp;
+
+        /// Top of an empty data stack
+        Cell * m_bottom;
+
+        /// Top of a full data stack
+        Cell * m_limit;
+
+        /// Name of the source file for the error messages
+        const char * m_filename;
+
+        /// Number of frames on the return stack
+        size_t m_depth;
+
+        /// Flag if the exit intrinsic has been called
+        bool m_exited;
+
+        /// Code passed to the exit intrinsic
+        Cell m_exitCode;
+
+        /// Output not written yet
+        std::string m_output;
+
+        /// String to collect the output in, NULL to print it
+        std::string * m_capture;
+
+        /// Make sure there are a_count numbers on the stack
+        void
+        Need(
+          Cell a_line,
+          long a_count) const
+        {
+          if ( m_sp - m_bottom < a_count)
+            Fail( a_line, "data stack underflow");
+        }
+
+        /// Convert the result of unsigned arithmetic
+        static Cell
+        Wrap(
+          uint32_t a_value)
+        {
+          return static_cast<Cell>( a_value);
+        }
+
+        /// No copies
+        Machine(
+          const Machine &);
+
+        /// No assignments
+        Machine &
+        operator=(
+          const Machine &);
+    };
+
+    /// Description of a translated program
+    struct Program
+    {
+      /// Name of the source file
+      const char * m_filename;
+
+      /// Number of lines, including the ones of the intrinsics
+      Cell m_lineCount;
+
+      /** Run a line. Returns the line to continue with after a call in its
+       * last position, 0 if it is done.
+       */
+      Cell (* m_runLine)(
+        Machine &a_machine,
+        Cell a_line);
+    };
+
+    /// Run a line and the ones it continues with
+    inline void
+    Call(
+      const Program &a_program,
+      Machine &a_machine,
+      Cell a_line)
+    {
+      while ( a_line != 0)
+        a_line = a_program.m_runLine( a_machine, a_line);
+    }
+
+    /// Run the program from its first line, returns the exit code
+    inline Cell
+    RunProgram(
+      const Program &a_program)
+    {
+      Machine machine( a_program.m_filename);
+      if ( a_program.m_lineCount <= kOpCodeFirstUser)
+        return 0;
+      try
+      {
+        // Like in the interpreter, the first line has nowhere to return to.
+        // The lines it continues with end it, so the error names it.
+        Call( a_program, machine, kOpCodeFirstUser);
+        machine.Fail( kOpCodeFirstUser, "return stack underflow");
+      }
+      catch (const ExitRequest &)
+      {
+      }
+      return machine.GetExitCode();
+    }
+
+    /// Test case of a test script
+    struct TestCase
+    {
+      /// Name of the test case
+      std::string m_name;
+
+      /// Line to call
+      Cell m_startLine;
+
+      /// Data stack before the call
+      std::vector<Cell> m_input;
+
+      /// Expected data stack after the call
+      std::vector<Cell> m_output;
+    };
+
+    /// Parse the numbers of a line of a test script
+    inline bool
+    ParseNumbers(
+      const std::string &a_text,
+      std::vector<Cell> &a_numbers)
+    {
+      std::istringstream parser( a_text);
+      while ( !parser.eof())
+      {
+        Cell number;
+        if ( !(parser >> number))
+          return false;
+        a_numbers.push_back( number);
+      }
+      return true;
+    }
+
+    /// Read a test script in the format of forthytwo --test
+    inline std::vector<TestCase>
+    ParseTestFile(
+      const char * a_filename)
+    {
+      std::ifstream input( a_filename);
+      if ( !input.is_open())
+        throw std::runtime_error(
+          std::string( "Cannot open '") + a_filename + "'");
+
+      std::vector<TestCase> testCases;
+      std::string line;
+      for (size_t lineNo = 1; std::getline( input, line); ++lineNo)
+      {
+        if ( (line.find_first_not_of( " \t") == std::string::npos) ||
+             (line[0] == '#'))
+          continue;
+
+        const char * error = NULL;
+        std::string param = (line.size() > 2) ? line.substr( 2) : "";
+        if ( (line.size() < 2) || (line[1] != ' '))
+          error = "Missing space in line leader";
+        else if ( line[0] == '=')
+        {
+          TestCase testCase;
+          testCase.m_name = param;
+          testCase.m_startLine = -1;
+          testCases.push_back( testCase);
+        }
+        else if ( testCases.empty())
+          error = "No test declared";
+        else if ( line[0] == '@')
+        {
+          std::istringstream parser( param);
+          if ( !(parser >> testCases.back().m_startLine))
+            error = "Can't parse start line";
+          else if ( testCases.back().m_startLine < kOpCodeFirstUser)
+            error = "Start line too low";
+        }
+        else if ( line[0] == '^')
+        {
+          if ( !ParseNumbers( param, testCases.back().m_input))
+            error = "Can't parse number";
+        }
+        else if ( line[0] == 'v')
+        {
+          if ( !ParseNumbers( param, testCases.back().m_output))
+            error = "Can't parse number";
+        }
+        else
+          error = "Bad line leader";
+
+        if ( error != NULL)
+        {
+          std::ostringstream msg;
+          msg << a_filename << ":" << lineNo << ": Parse error (" << error
+              << ")";
+          throw std::runtime_error( msg.str().c_str());
+        }
+      }
+      return testCases;
+    }
+
+    /// Print the numbers of a stack for a test report
+    inline void
+    WriteStack(
+      const std::vector<Cell> &a_stack)
+    {
+      for ( size_t i = 0; i < a_stack.size(); ++i)
+        std::cout << a_stack[i] << " ";
+    }
+
+    /** Run the test cases of a script and print a report like forthytwo
+     * --test. Returns true if all of them passed.
+     */
+    inline bool
+    RunTests(
+      const Program &a_program,
+      const char * a_filename)
+    {
+      std::vector<TestCase> testCases = ParseTestFile( a_filename);
+
+      std::cout << "Running tests ..." << std::endl;
+      bool allOk = true;
+      for (size_t i = 0; i < testCases.size(); ++i)
+      {
+        const TestCase &testCase = testCases[i];
+        std::cout << "  " << (i + 1) << "/" << testCases.size() << ": "
+                  << testCase.m_name << " --> ";
+
+        std::string printed;
+        Machine machine( a_program.m_filename);
+        machine.SetCapture( &printed);
+        try
+        {
+          if ( testCase.m_startLine >= a_program.m_lineCount)
+            throw std::runtime_error( "Test case '" + testCase.m_name +
+              "': Illegal start line");
+          for (size_t j = 0; j < testCase.m_input.size(); ++j)
+            machine.Push( testCase.m_startLine, testCase.m_input[j]);
+
+          // The test takes the frame of the caller
+          machine.Enter( testCase.m_startLine);
+          Call( a_program, machine, testCase.m_startLine);
+        }
+        catch (const ExitRequest &)
+        {
+        }
+        catch (const std::exception &)
+        {
+          machine.Flush();
+          std::cout << printed;
+          throw;
+        }
+        machine.Flush();
+        std::cout << printed;
+
+        std::vector<Cell> dataStack = machine.GetDataStack();
+        bool ok = (dataStack == testCase.m_output) && !machine.HasExited();
+        std::cout << "    " << (ok ? "pass" : "FAILED") << std::endl;
+        if ( machine.HasExited())
+          std::cout << "    Exited with code " << machine.GetExitCode()
+                    << std::endl;
+        if ( !ok)
+        {
+          std::cout << "    Stack should be: [";
+          WriteStack( testCase.m_output);
+          std::cout << "]" << std::endl;
+          std::cout << "    Stack is       : [";
+          WriteStack( dataStack);
+          std::cout << "]" << std::endl;
+        }
+        allOk &= ok;
+      }
+      return allOk;
+    }
+
+    /// Arguments and result of Main on the large stack
+    struct MainJob
+    {
+      /// Program to run
+      const Program * m_program;
+
+      /// Test script to run, NULL to run the program
+      const char * m_testFile;
+
+      /// Exit code of the process
+      int m_result;
+    };
+
+    /// Run the program or its tests and report errors
+    inline void *
+    RunMainJob(
+      void * a_job)
+    {
+      MainJob &job = *static_cast<MainJob *>( a_job);
+      try
+      {
+        if ( job.m_testFile == NULL)
+          job.m_result = RunProgram( *job.m_program);
+        else if ( RunTests( *job.m_program, job.m_testFile))
+          job.m_result = EXIT_SUCCESS;
+        else
+        {
+          std::cerr << "AT LEAST ONE TEST FAILED!" << std::endl;
+          job.m_result = EXIT_FAILURE;
+        }
+      }
+      catch (const std::exception &ex)
+      {
+        std::cerr << ex.what() << std::endl;
+        job.m_result = EXIT_FAILURE;
+      }
+      return NULL;
+    }
+
+    /** Main function of a translated program. Without arguments, the
+     * program runs and its exit code is returned. With --test <testfile>,
+     * the test cases of the script are run instead.
+     *
+     * Lines call each other as functions, so the program runs on a thread
+     * with a stack large enough for a full return stack.
+     */
+    inline int
+    Main(
+      const Program &a_program,
+      int argc,
+      char * * argv)
+    {
+      MainJob job = { &a_program, NULL, EXIT_FAILURE };
+      if ( (argc == 3) && (std::string( argv[1]) == "--test"))
+        job.m_testFile = argv[2];
+      else if ( argc != 1)
+      {
+        std::cerr << "USAGE: " << argv[0] << " [--test <testfile>]"
+                  << std::endl;
+        return EXIT_FAILURE;
+      }
+
+      pthread_attr_t attributes;
+      pthread_t thread;
+      pthread_attr_init( &attributes);
+      if ( (pthread_attr_setstacksize( &attributes,
+              kReturnStackDepth * kStackPerFrame) == 0) &&
+           (pthread_create( &thread, &attributes, RunMainJob, &job) == 0))
+        pthread_join( thread, NULL);
+      else
+        RunMainJob( &job);
+      pthread_attr_destroy( &attributes);
+      return job.m_result;
+    }
+  }
+}
+
+#endif
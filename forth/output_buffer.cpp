@@ -0,0 +1,78 @@
+#include "output_buffer.hpp"
+
+#include <cerrno>
+#include <unistd.h>
+
+namespace forth
+{
+  const size_t OutputBuffer::kCapacity = 64 * 1024;
+
+  OutputBuffer::OutputBuffer(
+    int a_fd)
+    : m_data( new char[kCapacity])
+    , m_size( 0)
+    , m_fd( a_fd)
+    , m_lineBuffered( isatty( a_fd) != 0)
+    , m_capture( NULL)
+  {
+  }
+
+  OutputBuffer::~OutputBuffer()
+  {
+    Flush();
+    delete[] m_data;
+  }
+
+  void
+  OutputBuffer::Flush()
+  {
+    if ( m_capture != NULL)
+    {
+      m_capture->append( m_data, m_size);
+      m_size = 0;
+      return;
+    }
+
+    // The file descriptor may take less than we offer. Repeat until all is
+    // written. If writing fails, the output is lost, just like it would be
+    // with std::cout.
+    size_t written = 0;
+    while ( written < m_size)
+    {
+      ssize_t res = write( m_fd, m_data + written, m_size - written);
+      if ( res < 0)
+      {
+        if ( errno == EINTR)
+          continue;
+        break;
+      }
+      written += res;
+    }
+    m_size = 0;
+  }
+
+  void
+  OutputBuffer::SetFile(
+    int a_fd)
+  {
+    Flush();
+    m_fd = a_fd;
+    m_lineBuffered = (isatty( a_fd) != 0);
+  }
+
+  void
+  OutputBuffer::SetCapture(
+    std::string * a_capture)
+  {
+    Flush();
+    m_capture = a_capture;
+  }
+
+  void
+  OutputBuffer::SetLineBuffered(
+    bool a_lineBuffered)
+  {
+    m_lineBuffered = a_lineBuffered;
+  }
+
+}
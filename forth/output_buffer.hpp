@@ -0,0 +1,100 @@
+#ifndef FORTH_OUTPUT_BUFFER_H
+#define FORTH_OUTPUT_BUFFER_H
+
+#include <cstddef>
+#include <string>
+
+namespace forth
+{
+  /** Buffer for the characters a program prints.
+   *
+   * Characters are collected in a fixed block of memory and handed to the
+   * operating system with a single write(2) when the block is full or when
+   * the buffer is flushed explicitly. In line buffered mode, each newline
+   * flushes as well.
+   */
+  class OutputBuffer
+  {
+    public:
+
+      /// Size of the buffer in bytes
+      static const size_t kCapacity;
+
+      /** Construct an empty buffer writing to a file descriptor. The buffer
+       * is line buffered if the file descriptor refers to a terminal.
+       */
+      explicit
+      OutputBuffer(
+        int a_fd);
+
+      /// Write the remaining characters and destruct the buffer
+      ~OutputBuffer();
+
+      /// Append a character
+      void
+      Put(
+        char a_char)
+      {
+        m_data[m_size++] = a_char;
+        if ( m_size == kCapacity || (m_lineBuffered && a_char == '\n'))
+          Flush();
+      }
+
+      /// Write all characters in the buffer to the file descriptor
+      void
+      Flush();
+
+      /// Flush and write to another file descriptor from now on
+      void
+      SetFile(
+        int a_fd);
+
+      /// Select if each newline flushes the buffer
+      void
+      SetLineBuffered(
+        bool a_lineBuffered);
+
+      /** Flush and collect the output in a string instead of writing it to
+       * the file descriptor. Pass NULL to write to the file descriptor again.
+       */
+      void
+      SetCapture(
+        std::string * a_capture);
+
+      /// Check if the output is collected in a string
+      bool
+      IsCapturing() const
+      {
+        return m_capture != NULL;
+      }
+
+    private:
+
+      /// Memory of the buffer
+      char * m_data;
+
+      /// Number of characters in the buffer
+      size_t m_size;
+
+      /// File descriptor to write to
+      int m_fd;
+
+      /// Flag if a newline flushes the buffer
+      bool m_lineBuffered;
+
+      /// String to collect the output in, NULL to write to m_fd
+      std::string * m_capture;
+
+      /// No copies
+      OutputBuffer(
+        const OutputBuffer &);
+
+      /// No assignment
+      OutputBuffer &
+      operator=(
+        const OutputBuffer &);
+  };
+
+}
+
+#endif
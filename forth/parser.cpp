@@ -1,7 +1,16 @@
 #include <cstring>
 #include <fstream>
+#include <iterator>
 #include <sstream>
 #include <string>
+#include <vector>
+
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 #include "parser.hpp"
 
 /// Length of the line we present to the user in case of a parsing error.
@@ -9,51 +18,208 @@
 
 namespace forth
 {
+  /** Contents of a file in memory. Regular files are mapped, everything
+   * else is read into a buffer.
+   */
+  class SourceFile
+  {
+    public:
+
+      /// Open the file and make its contents available
+      explicit
+      SourceFile(
+        const char * a_filename)
+        : m_mapped( NULL)
+        , m_size( 0)
+      {
+        int fd = open( a_filename, O_RDONLY);
+        if ( fd < 0)
+        {
+          std::ostringstream str;
+          str << "Cannot open '" << a_filename << "'";
+          throw Parser::ParseError( str.str().c_str());
+        }
+
+        struct stat info;
+        if ( fstat( fd, &info) == 0 && S_ISREG( info.st_mode) &&
+             info.st_size > 0)
+        {
+          void * mapped = mmap( NULL, info.st_size, PROT_READ, MAP_PRIVATE,
+            fd, 0);
+          if ( mapped != MAP_FAILED)
+          {
+            m_mapped = static_cast<const char *>( mapped);
+            m_size = info.st_size;
+            madvise( mapped, m_size, MADV_SEQUENTIAL);
+          }
+        }
+
+        // Pipes and the like can't be mapped
+        if ( m_mapped == NULL)
+        {
+          char chunk[64 * 1024];
+          for (;; )
+          {
+            ssize_t len = read( fd, chunk, sizeof( chunk));
+            if ( len < 0 && errno == EINTR)
+              continue;
+            if ( len <= 0)
+              break;
+            m_buffer.insert( m_buffer.end(), chunk, chunk + len);
+          }
+          m_size = m_buffer.size();
+        }
+
+        close( fd);
+      }
+
+      /// Release the contents
+      ~SourceFile()
+      {
+        if ( m_mapped != NULL)
+          munmap( const_cast<char *>( m_mapped), m_size);
+      }
+
+      /// First character of the file
+      const char *
+      Data() const
+      {
+        if ( m_mapped != NULL)
+          return m_mapped;
+        return m_buffer.empty() ? NULL : &m_buffer[0];
+      }
+
+      /// Number of characters in the file
+      size_t
+      Size() const
+      {
+        return m_size;
+      }
+
+    private:
+
+      /// Mapped contents, NULL if the file has been read
+      const char * m_mapped;
+
+      /// Contents read from the file
+      std::vector<char> m_buffer;
+
+      /// Number of characters
+      size_t m_size;
+
+      /// No copies
+      SourceFile(
+        const SourceFile &);
+
+      /// No assignment
+      SourceFile &
+      operator=(
+        const SourceFile &);
+  };
 
   void
   Parser::ParseFromFile(
     const char * a_filename,
     Runtime &a_runtime)
   {
-    std::ifstream f( a_filename, std::ios_base::in);
+    SourceFile file( a_filename);
+
+    ParseFromMemory( a_filename, file.Data(), file.Size(), a_runtime);
+  }
+
+  void
+  Parser::ParseFromMemory(
+    const char * a_filename,
+    const char * a_data,
+    size_t a_size,
+    Runtime &a_runtime)
+  {
+    const char * pos = a_data;
+    const char * end = a_data + a_size;
 
-    if ( !f.is_open())
+    // Start counting the line numbers starting from 1. A last line without
+    // a newline is incomplete and ignored.
+    size_t lineNo = 1;
+    while ( pos != end)
     {
-      std::ostringstream str;
-      str << "Cannot open '" << a_filename << "'";
-      throw ParseError( str.str().c_str());
+      const char * eol = static_cast<const char *>(
+        memchr( pos, '\n', end - pos));
+      if ( eol == NULL)
+        break;
+
+      // If the line can be called, we process it
+      if ( lineNo >= static_cast<size_t>( Runtime::kOpCodeFirstUser))
+      {
+        CompileLine( a_filename, lineNo, pos, eol, a_runtime);
+      }
+      ++lineNo;
+      pos = eol + 1;
+    }
+
+    // The program is complete, pack it for execution
+    a_runtime.Seal();
+  }
+
+  bool
+  Parser::ScanNumber(
+    const char * &a_pos,
+    const char * a_end,
+    Runtime::Cell &a_number)
+  {
+    const char * pos = a_pos;
+
+    // Skip the same white space as a stream does
+    while ( pos != a_end &&
+            (*pos == ' ' || ('\t' <= *pos && *pos <= '\r')))
+      ++pos;
+
+    bool negative = false;
+    if ( pos != a_end && (*pos == '-' || *pos == '+'))
+    {
+      negative = (*pos == '-');
+      ++pos;
+    }
+
+    // Read all digits. Once the magnitude is too large for a cell, keep
+    // reading, but stop accumulating.
+    const int64_t kLimit = static_cast<int64_t>( 1) << 31;
+    const char * digits = pos;
+    int64_t magnitude = 0;
+    while ( pos != a_end && '0' <= *pos && *pos <= '9')
+    {
+      if ( magnitude <= kLimit)
+        magnitude = magnitude * 10 + (*pos - '0');
+      ++pos;
     }
 
-    ParseFromStream( a_filename, f, a_runtime);
+    if ( pos == digits)
+      return false;
+    if ( magnitude > (negative ? kLimit : kLimit - 1))
+      return false;
+
+    a_number = static_cast<Runtime::Cell>(
+      negative ? -magnitude : magnitude);
+    a_pos = pos;
+    return true;
   }
 
   void
   Parser::CompileLine(
     const char * a_filename,
     size_t a_lineNo,
-    const std::string &a_line,
+    const char * a_begin,
+    const char * a_end,
     Runtime &a_runtime)
   {
-    // If we find a non-space in the line, we have to parse it. If not, we can
-    // ignore the line as empty.
-    std::string::size_type firstNonSpace = a_line.find_first_not_of( " \t");
-    if (firstNonSpace == std::string::npos)
-      return;
-
-    // Seems like a legit line. Read the numbers one by one.
-    std::istringstream line( a_line);
-    while ( !line.eof())
-    {
-      Runtime::Cell v;
-
-      // If we can parse a number, it's a number
-      if ( !(line >> v))
-      {
-        // If we can't parse a number, silently return
-        // We even keep the already parsed stuff
-        return;
-      }
+    // Read the numbers one by one. Empty lines and lines with only white
+    // space contain no number.
+    const char * pos = a_begin;
+    Runtime::Cell v;
 
+    // If we can't parse a number, silently return. We even keep the already
+    // parsed stuff.
+    while ( ScanNumber( pos, a_end, v))
+    {
       // If everything worked, we add the number to the program
       a_runtime.Compile( a_lineNo, v);
     }
@@ -65,26 +231,12 @@ namespace forth
     std::istream &a_input,
     Runtime &a_runtime)
   {
-    // Start counting the line numbers starting from 1
-    size_t lineNo = 1;
-
-    while ( !a_input.eof())
-    {
-      // Read a line
-      std::string line;
-      std::getline( a_input, line);
-
-      // If the line can't be read, we quit
-      if (!a_input.good())
-        break;
+    // Read everything and parse it in memory
+    std::string contents( (std::istreambuf_iterator<char>( a_input)),
+      std::istreambuf_iterator<char>());
 
-      // If the line can be called, we process it
-      if ( lineNo >= Runtime::kOpCodeFirstUser)
-      {
-        CompileLine( a_filename, lineNo, line, a_runtime);
-      }
-      ++lineNo;
-    }
+    ParseFromMemory( a_filename, contents.data(), contents.size(),
+      a_runtime);
   }
 
 }
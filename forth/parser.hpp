@@ -33,16 +33,40 @@ namespace forth
       const char * a_filename,
       Runtime &a_runtime);
 
+    /** Parse a program held in memory, e.g. a mapped file.
+     *
+     * Only lines terminated by a newline are compiled. Lines before the
+     * first user-programmable line are ignored. Each line is compiled up to
+     * the first token that is not a number.
+     */
+    static void
+    ParseFromMemory(
+      const char * a_filename,
+      const char * a_data,
+      size_t a_size,
+      Runtime &a_runtime);
+
     protected:
 
-      /// Process a line from the stream
+      /// Process a line, a_end points behind its last character
       static void
       CompileLine(
         const char * a_filename,
         size_t a_lineNo,
-        const std::string &a_line,
+        const char * a_begin,
+        const char * a_end,
         Runtime &a_runtime);
 
+      /** Read one number and advance a_pos behind it. Leading white space is
+       * skipped. Returns false if there is no number or it doesn't fit into
+       * a cell, just like reading from a stream would.
+       */
+      static bool
+      ScanNumber(
+        const char * &a_pos,
+        const char * a_end,
+        Runtime::Cell &a_number);
+
       /// Parse the stream
       static void
       ParseFromStream(
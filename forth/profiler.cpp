@@ -0,0 +1,262 @@
+#include <algorithm>
+#include <iomanip>
+
+#include "profiler.hpp"
+
+namespace forth
+{
+  Profiler::Profiler()
+    : m_steps( 0)
+    , m_intrinsicCalls( Runtime::kOpCodeFirstUser, 0)
+    , m_current( 0)
+  {
+    Node root = { 0, 0, 0 };
+    m_nodes.push_back( root);
+  }
+
+  void
+  Profiler::AddLine(
+    size_t a_line)
+  {
+    if ( a_line >= m_lineEntries.size())
+    {
+      m_lineEntries.resize( a_line + 1, 0);
+      m_lineSteps.resize( a_line + 1, 0);
+    }
+  }
+
+  void
+  Profiler::Start(
+    size_t a_line)
+  {
+    m_current = 0;
+    EnterLine( a_line);
+  }
+
+  void
+  Profiler::EnterLine(
+    size_t a_line)
+  {
+    AddLine( a_line);
+    ++m_lineEntries[a_line];
+    if ( m_current != 0)
+      ++m_calls[Edge( m_nodes[m_current].m_line, a_line)];
+
+    // Find the call stack, or add it to the tree
+    Edge key( m_current, a_line);
+    std::map<Edge, size_t>::const_iterator it = m_children.find( key);
+    if ( it != m_children.end())
+      m_current = it->second;
+    else
+    {
+      Node node = { m_current, a_line, 0 };
+      m_nodes.push_back( node);
+      m_current = m_nodes.size() - 1;
+      m_children[key] = m_current;
+    }
+  }
+
+  void
+  Profiler::LeaveLine()
+  {
+    m_current = m_nodes[m_current].m_parent;
+  }
+
+  uint64_t
+  Profiler::CountEntries(
+    size_t a_line) const
+  {
+    return (a_line < m_lineEntries.size()) ? m_lineEntries[a_line] : 0;
+  }
+
+  uint64_t
+  Profiler::CountSteps(
+    size_t a_line) const
+  {
+    return (a_line < m_lineSteps.size()) ? m_lineSteps[a_line] : 0;
+  }
+
+  uint64_t
+  Profiler::CountIntrinsicCalls(
+    Runtime::Cell a_opCode) const
+  {
+    return m_intrinsicCalls[a_opCode];
+  }
+
+  uint64_t
+  Profiler::CountCalls(
+    size_t a_caller,
+    size_t a_callee) const
+  {
+    std::map<Edge, uint64_t>::const_iterator it =
+      m_calls.find( Edge( a_caller, a_callee));
+    return (it == m_calls.end()) ? 0 : it->second;
+  }
+
+  /// Row of the summary, sorted hottest first
+  struct ProfileRow
+  {
+    uint64_t m_count;
+    size_t m_index;
+
+    bool
+    operator<(
+      const ProfileRow &a_other) const
+    {
+      if (m_count != a_other.m_count)
+        return m_count > a_other.m_count;
+      return m_index < a_other.m_index;
+    }
+
+  };
+
+  void
+  Profiler::WriteSummary(
+    std::ostream &a_output) const
+  {
+    static const char * const kIntrinsicNames[] =
+    {
+      "plus", "minus", "mult", "div", "mod", "and", "or", "not",
+      "swap", "dup", "drop", "loop", "emit", "read", "exit", "over",
+      "", "", "", "", ""
+    };
+
+    a_output << "Profile: " << m_steps << " steps" << std::endl
+             << std::endl
+             << "    Line     Entries       Steps  Steps %" << std::endl;
+
+    std::vector<ProfileRow> rows;
+    for (size_t line = 0; line < m_lineSteps.size(); ++line)
+    {
+      if ( m_lineEntries[line] != 0)
+      {
+        ProfileRow row = { m_lineSteps[line], line };
+        rows.push_back( row);
+      }
+    }
+    std::sort( rows.begin(), rows.end());
+    for (size_t i = 0; i < rows.size(); ++i)
+    {
+      size_t line = rows[i].m_index;
+      a_output << std::setw( 8) << line
+               << std::setw( 12) << m_lineEntries[line]
+               << std::setw( 12) << m_lineSteps[line]
+               << std::setw( 9) << std::fixed << std::setprecision( 2)
+               << (m_steps ? 100.0 * m_lineSteps[line] / m_steps : 0.0)
+               << std::endl;
+    }
+
+    a_output << std::endl << "    Intrinsic       Calls" << std::endl;
+    rows.clear();
+    for (size_t opCode = 0; opCode < m_intrinsicCalls.size(); ++opCode)
+    {
+      if ( m_intrinsicCalls[opCode] != 0)
+      {
+        ProfileRow row = { m_intrinsicCalls[opCode], opCode };
+        rows.push_back( row);
+      }
+    }
+    std::sort( rows.begin(), rows.end());
+    for (size_t i = 0; i < rows.size(); ++i)
+    {
+      const char * name = kIntrinsicNames[rows[i].m_index];
+      a_output << "    " << std::left << std::setw( 9)
+               << (name[0] ? name : "unused") << std::right
+               << std::setw( 12) << rows[i].m_count << std::endl;
+    }
+
+    a_output << std::endl << "  Caller    Callee       Calls" << std::endl;
+    std::vector< std::pair<uint64_t, Edge> > calls;
+    for (std::map<Edge, uint64_t>::const_iterator it = m_calls.begin();
+         it != m_calls.end();
+         ++it)
+      calls.push_back( std::make_pair( it->second, it->first));
+    std::sort( calls.rbegin(), calls.rend());
+    for (size_t i = 0; i < calls.size(); ++i)
+      a_output << std::setw( 8) << calls[i].second.first
+               << std::setw( 10) << calls[i].second.second
+               << std::setw( 12) << calls[i].first << std::endl;
+  }
+
+  void
+  Profiler::WriteStack(
+    std::ostream &a_output,
+    size_t a_node) const
+  {
+    const Node &node = m_nodes[a_node];
+    if ( node.m_parent != 0)
+    {
+      WriteStack( a_output, node.m_parent);
+      a_output << ';';
+    }
+    a_output << "line " << node.m_line;
+  }
+
+  void
+  Profiler::WriteFoldedStacks(
+    std::ostream &a_output) const
+  {
+    for (size_t i = 1; i < m_nodes.size(); ++i)
+    {
+      if ( m_nodes[i].m_steps != 0)
+      {
+        WriteStack( a_output, i);
+        a_output << ' ' << m_nodes[i].m_steps << std::endl;
+      }
+    }
+  }
+
+  Runtime::Cell
+  ProfilingRuntime::Profile(
+    Profiler &a_profiler)
+  {
+    if ( !m_program->IsSealed())
+      Seal();
+
+    // Without a first line there is nothing to run
+    ResetIp();
+    if ( m_view.m_lineCount <= static_cast<size_t>( kOpCodeFirstUser))
+      return 0;
+
+    a_profiler.Start( m_ipLine);
+    while ( !HasExited())
+    {
+      // A call outside the program continues with the first line, which
+      // the profiler has entered already
+      if ( m_ipLine >= m_view.m_lineCount)
+      {
+        ComputeStep();
+        continue;
+      }
+
+      size_t depth = m_returnStack.Size();
+      if ( m_ip < m_view.m_lines[m_ipLine].End())
+      {
+        a_profiler.CountStep();
+
+        // A call of an intrinsic runs it right away
+        Cell opCode = m_view.m_code[m_ip];
+        if ( opCode == kOpCodeCall && !m_dataStack.IsEmpty())
+        {
+          opCode = m_dataStack.Top();
+          if ( opCode >= 0 && opCode < kOpCodeFirstUser)
+            a_profiler.CountIntrinsic( opCode);
+        }
+      }
+
+      ComputeStep();
+
+      // Calls outside the program go to the first line
+      if ( m_returnStack.Size() > depth)
+        a_profiler.EnterLine( (m_ipLine < m_view.m_lineCount) ?
+          m_ipLine : kOpCodeFirstUser);
+      else
+      if ( m_returnStack.Size() < depth)
+        a_profiler.LeaveLine();
+    }
+
+    FlushOutput();
+    return GetExitCode();
+  }
+
+}
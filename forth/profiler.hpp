@@ -0,0 +1,173 @@
+#ifndef FORTH_PROFILER_H
+#define FORTH_PROFILER_H
+
+#include <map>
+#include <ostream>
+#include <utility>
+#include <vector>
+
+#include "runtime.hpp"
+
+namespace forth
+{
+  /** Execution profile of a program.
+   *
+   * Counts how often each line is entered, how many steps are executed in
+   * each line, how often each intrinsic is called and how often each line
+   * calls another one. The steps are also counted per call stack, so they
+   * can be written as folded stacks for flame graph tools.
+   */
+  class Profiler
+  {
+    public:
+
+      /// Construct a profiler without any counts
+      Profiler();
+
+      /// Enter the first line of the program, or restart it
+      void
+      Start(
+        size_t a_line);
+
+      /// Count a step executed in the current line
+      void
+      CountStep()
+      {
+        Node &node = m_nodes[m_current];
+        ++node.m_steps;
+        ++m_lineSteps[node.m_line];
+        ++m_steps;
+      }
+
+      /// Count a call of an intrinsic
+      void
+      CountIntrinsic(
+        Runtime::Cell a_opCode)
+      {
+        ++m_intrinsicCalls[a_opCode];
+      }
+
+      /// Count a call from the current line to another one
+      void
+      EnterLine(
+        size_t a_line);
+
+      /// Return from the current line to its caller
+      void
+      LeaveLine();
+
+      /** Write a table of the hottest lines, the intrinsics and the calls
+       * between lines.
+       */
+      void
+      WriteSummary(
+        std::ostream &a_output) const;
+
+      /** Write the steps per call stack in the folded format of flame graph
+       * tools. Each line holds the lines on the stack, outermost first and
+       * separated by semicolons, followed by the number of steps.
+       */
+      void
+      WriteFoldedStacks(
+        std::ostream &a_output) const;
+
+      /// Get the total number of steps
+      uint64_t
+      CountSteps() const
+      {
+        return m_steps;
+      }
+
+      /// Get the number of times a line has been entered
+      uint64_t
+      CountEntries(
+        size_t a_line) const;
+
+      /// Get the number of steps executed in a line
+      uint64_t
+      CountSteps(
+        size_t a_line) const;
+
+      /// Get the number of calls of an intrinsic
+      uint64_t
+      CountIntrinsicCalls(
+        Runtime::Cell a_opCode) const;
+
+      /// Get the number of calls from one line to another
+      uint64_t
+      CountCalls(
+        size_t a_caller,
+        size_t a_callee) const;
+
+    protected:
+
+      /// Node of the tree of call stacks
+      struct Node
+      {
+        /// Index of the calling node, the root is its own parent
+        size_t m_parent;
+
+        /// Line executed in this node
+        size_t m_line;
+
+        /// Steps executed in this line with this call stack
+        uint64_t m_steps;
+      };
+
+      /// Caller and callee of a call
+      typedef std::pair<size_t, size_t> Edge;
+
+      /// Total number of steps
+      uint64_t m_steps;
+
+      /// Number of entries, indexed by line
+      std::vector<uint64_t> m_lineEntries;
+
+      /// Number of steps, indexed by line
+      std::vector<uint64_t> m_lineSteps;
+
+      /// Number of calls, indexed by intrinsic
+      std::vector<uint64_t> m_intrinsicCalls;
+
+      /// Number of calls between two lines
+      std::map<Edge, uint64_t> m_calls;
+
+      /// Tree of call stacks, the root is at index 0 and executes no line
+      std::vector<Node> m_nodes;
+
+      /// Children of the nodes, indexed by parent node and line
+      std::map<Edge, size_t> m_children;
+
+      /// Node of the current call stack
+      size_t m_current;
+
+      /// Make room for the counts of a line
+      void
+      AddLine(
+        size_t a_line);
+
+      /// Append the call stack of a node, outermost line first
+      void
+      WriteStack(
+        std::ostream &a_output,
+        size_t a_node) const;
+  };
+
+  /** Runtime that steps through a program and feeds a profiler.
+   *
+   * Profiling uses ComputeStep instead of Run, so Run doesn't pay for it.
+   * As ComputeStep performs no tail calls, the call stacks are exact.
+   */
+  class ProfilingRuntime : public Runtime
+  {
+    public:
+
+      /// Run the program until it exits and return the exit code
+      Cell
+      Profile(
+        Profiler &a_profiler);
+  };
+
+}
+
+#endif
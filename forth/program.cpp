@@ -0,0 +1,386 @@
+#include "program.hpp"
+#include "decoder.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+
+namespace forth
+{
+  Program::Program()
+    : m_references( 1)
+    , m_image( NULL)
+    , m_sealed( true)
+    , m_fuse( true)
+  {
+    UpdateView();
+  }
+
+  Program::~Program()
+  {
+    delete m_image;
+  }
+
+  void
+  Program::Acquire()
+  {
+    __sync_add_and_fetch( &m_references, 1);
+  }
+
+  void
+  Program::Release()
+  {
+    if ( __sync_sub_and_fetch( &m_references, 1) == 0)
+      delete this;
+  }
+
+  bool
+  Program::IsShared() const
+  {
+    return m_references > 1;
+  }
+
+  Program *
+  Program::Clone() const
+  {
+    Program * copy = new Program;
+
+    copy->m_code.assign( m_view.m_code, m_view.m_code + m_view.m_codeSize);
+    copy->m_lines.assign( m_view.m_lines,
+      m_view.m_lines + m_view.m_lineCount);
+    if ( m_sealed && m_view.m_codeSize != 0)
+      copy->m_decoded.assign( m_view.m_decoded,
+        m_view.m_decoded + m_view.m_decodedSize);
+    copy->m_sealed = m_sealed;
+    copy->m_fuse = m_fuse;
+    copy->UpdateView();
+    return copy;
+  }
+
+  /// Order a code segment index before all lines that start behind it
+  static bool
+  IsLineBehind(
+    size_t a_index,
+    const Program::Line &a_line)
+  {
+    return a_index < a_line.m_offset;
+  }
+
+  size_t
+  Program::FindLine(
+    size_t a_index) const
+  {
+    // A sealed program has its lines back to back in order. The line is the
+    // last one that starts at or before the index.
+    if ( m_sealed)
+    {
+      const Line * behind =
+        std::upper_bound( m_view.m_lines, m_view.m_lines + m_view.m_lineCount,
+          a_index, IsLineBehind);
+      return (behind - m_view.m_lines) - 1;
+    }
+
+    // Otherwise, lines may have been moved. Look at each of them.
+    for (size_t row = 0; row < m_view.m_lineCount; ++row)
+    {
+      const Line &line = m_view.m_lines[row];
+      if ( line.m_offset <= a_index && a_index <= line.End())
+        return row;
+    }
+    return m_view.m_lineCount;
+  }
+
+  void
+  Program::Compile(
+    size_t a_row,
+    Cell a_number,
+    size_t a_firstRow)
+  {
+    // If it's a valid line
+    if ( a_row >= a_firstRow)
+    {
+      ReleaseImage();
+      m_sealed = false;
+
+      // Resize the line table if required. New lines start empty at the end
+      // of the code segment, followed by their spare slot.
+      while ( m_lines.size() <= a_row)
+      {
+        Line empty = { static_cast<uint32_t>( m_code.size()), 0 };
+        m_lines.push_back( empty);
+        m_code.push_back( 0);
+      }
+
+      // If the line is not the last one in the code segment, move it to the
+      // end so it can grow.
+      Line &line = m_lines[a_row];
+      if ( line.End() + 1 != m_code.size())
+      {
+        size_t offset = m_code.size();
+        for (size_t i = 0; i <= line.m_length; ++i)
+          m_code.push_back( m_code[line.m_offset + i]);
+
+        line.m_offset = static_cast<uint32_t>( offset);
+      }
+
+      // Append the number to the line, in front of the spare slot
+      m_code.back() = a_number;
+      m_code.push_back( 0);
+      line.m_length++;
+      UpdateView();
+    }
+  }
+
+  void
+  Program::Seal()
+  {
+    ReleaseImage();
+
+    // Each line occupies its numbers and the spare slot
+    size_t used = m_lines.size();
+    for (size_t row = 0; row < m_lines.size(); ++row)
+      used += m_lines[row].m_length;
+
+    // Copy the lines in order into a fresh segment of the exact size, unless
+    // nothing has been moved
+    if ( used != m_code.size())
+    {
+      std::vector<Cell> code;
+      code.reserve( used);
+      for (size_t row = 0; row < m_lines.size(); ++row)
+      {
+        Line &line = m_lines[row];
+        size_t offset = code.size();
+        code.insert( code.end(),
+          m_code.begin() + line.m_offset,
+          m_code.begin() + line.End() + 1);
+        line.m_offset = static_cast<uint32_t>( offset);
+      }
+      m_code.swap( code);
+    }
+
+    // Decode with the unchecked copy and the inlined lines
+    std::vector<Instruction> decoded;
+    Decoder::Decode( m_code.empty() ? NULL : &m_code[0], m_code.size(),
+      m_lines.empty() ? NULL : &m_lines[0], m_lines.size(),
+      decoded, m_fuse);
+    m_decoded.swap( decoded);
+    m_sealed = true;
+    UpdateView();
+  }
+
+  void
+  Program::UpdateView()
+  {
+    m_view.m_code = m_code.empty() ? NULL : &m_code[0];
+    m_view.m_codeSize = m_code.size();
+    m_view.m_lines = m_lines.empty() ? NULL : &m_lines[0];
+    m_view.m_lineCount = m_lines.size();
+    m_view.m_decoded = m_decoded.empty() ? NULL : &m_decoded[0];
+    m_view.m_decodedSize = m_decoded.size();
+  }
+
+  void
+  Program::ReleaseImage()
+  {
+    if ( m_image == NULL)
+      return;
+
+    // The decoded program is rebuilt by the next Seal
+    m_code.assign( m_view.m_code, m_view.m_code + m_view.m_codeSize);
+    m_lines.assign( m_view.m_lines, m_view.m_lines + m_view.m_lineCount);
+    m_decoded.clear();
+    m_sealed = false;
+
+    delete m_image;
+    m_image = NULL;
+    UpdateView();
+  }
+
+  /// Build the exception for a problem with an image file
+  static ImageError
+  MakeImageError(
+    const char * a_filename,
+    const char * a_problem)
+  {
+    std::ostringstream str;
+    str << "'" << a_filename << "': " << a_problem;
+    return ImageError( str.str().c_str());
+  }
+
+  /// Get a section of an image that holds a_count items of a_itemSize bytes
+  static const void *
+  FindImageArray(
+    const ImageFile &a_image,
+    const char * a_filename,
+    uint32_t a_type,
+    size_t a_itemSize,
+    size_t &a_count)
+  {
+    size_t size = 0;
+    const void * section = a_image.FindSection( a_type, size);
+    if ( section == NULL || size % a_itemSize != 0)
+      throw MakeImageError( a_filename, "Image is incomplete");
+    a_count = size / a_itemSize;
+    return section;
+  }
+
+  void
+  Program::LoadImage(
+    const char * a_filename)
+  {
+    ImageFile * image = new ImageFile( a_filename);
+    try
+    {
+      const ImageHeader &header = image->Header();
+      if ( header.m_cellSize != sizeof( Cell))
+        throw MakeImageError( a_filename,
+                "Image has been written with a different cell size");
+
+      View view;
+      view.m_code = static_cast<const Cell *>( FindImageArray( *image,
+        a_filename, kImageSectionCode, sizeof( Cell), view.m_codeSize));
+      view.m_lines = static_cast<const Line *>( FindImageArray( *image,
+        a_filename, kImageSectionLines, sizeof( Line), view.m_lineCount));
+
+      // The lines and their spare slots have to fit into the code segment.
+      // FindLine needs them in order, each behind the spare slot of the one
+      // before.
+      for (size_t row = 0; row < view.m_lineCount; ++row)
+      {
+        const Line &line = view.m_lines[row];
+        if ( (line.End() >= view.m_codeSize) ||
+             ((row > 0) && (line.m_offset <= view.m_lines[row - 1].End())))
+          throw MakeImageError( a_filename,
+                  "Line table of image doesn't match the code");
+      }
+
+      // The decoded program of the image is run as it is mapped if this
+      // decoder would have made the same of the code. The checksum has
+      // ruled out corruption. An image of another build is decoded again.
+      std::vector<Instruction> decoded;
+      bool fuse = (header.m_flags & kImageFused) != 0;
+      if ( (header.m_instructionSize == sizeof( Instruction)) &&
+           (header.m_operationCount == kOpCount) &&
+           (header.m_fingerprint == Decoder::Fingerprint()))
+      {
+        view.m_decoded = static_cast<const Instruction *>( FindImageArray(
+          *image, a_filename, kImageSectionDecoded, sizeof( Instruction),
+          view.m_decodedSize));
+        if ( view.m_decodedSize < 2 * view.m_codeSize)
+          throw MakeImageError( a_filename, "Image is incomplete");
+      }
+      else
+      {
+        Decoder::Decode( view.m_code, view.m_codeSize,
+          view.m_lines, view.m_lineCount,
+          decoded, fuse);
+        view.m_decoded = decoded.empty() ? NULL : &decoded[0];
+        view.m_decodedSize = decoded.size();
+      }
+
+      // Switch to the image
+      delete m_image;
+      m_image = image;
+      m_code.clear();
+      m_lines.clear();
+      m_decoded.swap( decoded);
+      m_fuse = fuse;
+      m_view = view;
+      if ( !m_decoded.empty())
+        m_view.m_decoded = &m_decoded[0];
+      m_sealed = true;
+    }
+    catch (...)
+    {
+      if ( m_image != image)
+        delete image;
+      throw;
+    }
+  }
+
+  /// Round a file offset up to the alignment of sections
+  static uint64_t
+  AlignImageOffset(
+    uint64_t a_offset)
+  {
+    return (a_offset + kImageAlignment - 1) / kImageAlignment *
+           kImageAlignment;
+  }
+
+  void
+  Program::WriteImage(
+    const char * a_filename) const
+  {
+    assert( m_sealed);
+
+    ImageHeader header;
+    memcpy( header.m_magic, kImageMagic, sizeof( kImageMagic));
+    header.m_version = kImageVersion;
+    header.m_byteOrder = kImageByteOrder;
+    header.m_cellSize = sizeof( Cell);
+    header.m_instructionSize = sizeof( Instruction);
+    header.m_operationCount = kOpCount;
+    header.m_flags = m_fuse ? kImageFused : 0;
+    header.m_sectionCount = 3;
+    header.m_fingerprint = Decoder::Fingerprint();
+    header.m_checksum = 0;
+
+    // Lay out the sections behind the section table
+    const void * contents[3] =
+    {
+      m_view.m_lines, m_view.m_code, m_view.m_decoded
+    };
+    ImageSection sections[3];
+    sections[0].m_type = kImageSectionLines;
+    sections[0].m_size = m_view.m_lineCount * sizeof( Line);
+    sections[1].m_type = kImageSectionCode;
+    sections[1].m_size = m_view.m_codeSize * sizeof( Cell);
+    sections[2].m_type = kImageSectionDecoded;
+    sections[2].m_size = m_view.m_decodedSize * sizeof( Instruction);
+
+    uint64_t offset = sizeof( header) + sizeof( sections);
+    for (size_t i = 0; i < 3; ++i)
+    {
+      sections[i].m_reserved = 0;
+      sections[i].m_offset = AlignImageOffset( offset);
+      offset = sections[i].m_offset + sections[i].m_size;
+    }
+
+    // Put the image together in memory, the checksum covers all of it
+    std::string image( offset, '\0');
+    memcpy( &image[0] + sizeof( header), sections, sizeof( sections));
+    for (size_t i = 0; i < 3; ++i)
+    {
+      if ( sections[i].m_size != 0)
+        memcpy( &image[0] + sections[i].m_offset, contents[i],
+          sections[i].m_size);
+    }
+    memcpy( &image[0], &header, sizeof( header));
+    header.m_checksum = ImageFile::Checksum( image.data(), image.size());
+    memcpy( &image[0], &header, sizeof( header));
+
+    std::ofstream file( a_filename,
+      std::ios_base::out | std::ios_base::binary | std::ios_base::trunc);
+    if ( !file.is_open())
+      throw MakeImageError( a_filename, "Cannot write image");
+    file.write( image.data(), image.size());
+
+    if ( !file.good())
+      throw MakeImageError( a_filename, "Cannot write image");
+  }
+
+  void
+  Program::SetFusion(
+    bool a_fuse)
+  {
+    if ( m_fuse != a_fuse)
+    {
+      m_fuse = a_fuse;
+      m_sealed = false;
+    }
+  }
+
+}
@@ -0,0 +1,213 @@
+#ifndef FORTH_PROGRAM_H
+#define FORTH_PROGRAM_H
+
+#include <vector>
+#include <stdint.h>
+#include <cstddef>
+
+#include "image.hpp"
+#include "instruction.hpp"
+
+namespace forth
+{
+  /** Program memory of the language, shared by all runtimes executing it.
+   *
+   * All lines are stored back to back in a single code segment. A line table
+   * holds the offset and length of each line within that segment. Sealing
+   * the program packs the segment and decodes it for the fast interpreter
+   * loop.
+   *
+   * A program is reference counted. While more than one runtime refers to
+   * it, it must not be changed. A runtime that wants to change a shared
+   * program clones it first. Taking and dropping references is thread safe,
+   * so runtimes on different threads can execute one program.
+   */
+  class Program
+  {
+    public:
+
+      /// Contents of the code segment
+      typedef int32_t Cell;
+
+      /** Location of a line inside the code segment.
+       *
+       * Each line is followed by one spare slot in the code segment. The
+       * decoded program uses it to return to the caller.
+       */
+      struct Line
+      {
+        /// Index of the first number of the line in the code segment
+        uint32_t m_offset;
+
+        /// Number of numbers in the line
+        uint32_t m_length;
+
+        /// Index of the first number after the line
+        size_t
+        End() const
+        {
+          return static_cast<size_t>( m_offset) + m_length;
+        }
+
+      };
+
+      /** Program as seen by execution. Points either to memory of the
+       * program or into a mapped image.
+       */
+      struct View
+      {
+        /// Code segment
+        const Cell * m_code;
+
+        /// Number of numbers in the code segment
+        size_t m_codeSize;
+
+        /// Line table
+        const Line * m_lines;
+
+        /// Number of lines
+        size_t m_lineCount;
+
+        /** Decoded program, valid if sealed. It holds the 2 * m_codeSize
+         * instructions of the code segment followed by the inlined lines,
+         * see Decoder::Decode.
+         */
+        const Instruction * m_decoded;
+
+        /// Number of instructions in the decoded program
+        size_t m_decodedSize;
+      };
+
+      /// Construct an empty program with a single reference
+      Program();
+
+      /// Destruct the program
+      ~Program();
+
+      /// Take another reference
+      void
+      Acquire();
+
+      /// Drop a reference, deletes the program when it was the last one
+      void
+      Release();
+
+      /// Check if more than one reference has been taken
+      bool
+      IsShared() const;
+
+      /// Make an unshared copy of the program
+      Program *
+      Clone() const;
+
+      /** Add a number to a given line. Lines before the first
+       * user-programmable line are ignored.
+       *
+       * Compiling to any line but the last one moves that line to the end of
+       * the code segment.
+       */
+      void
+      Compile(
+        size_t a_row,
+        Cell a_number,
+        size_t a_firstRow);
+
+      /// Pack all lines into one contiguous block of memory and decode them
+      void
+      Seal();
+
+      /// Select if the decoder uses superinstructions and inlines lines
+      void
+      SetFusion(
+        bool a_fuse);
+
+      /// Check if the program is packed and decoded
+      bool
+      IsSealed() const
+      {
+        return m_sealed;
+      }
+
+      /// Check if the program is executed from a mapped image
+      bool
+      IsMapped() const
+      {
+        return m_image != NULL;
+      }
+
+      /// Get the view used for execution
+      const View &
+      GetView() const
+      {
+        return m_view;
+      }
+
+      /** Find the line an index into the code segment belongs to. The spare
+       * slot counts as part of its line.
+       */
+      size_t
+      FindLine(
+        size_t a_index) const;
+
+      /** Replace the program by a mapped image. If the image has been
+       * decoded by an interpreter with a different set of operations, it is
+       * decoded again.
+       */
+      void
+      LoadImage(
+        const char * a_filename);
+
+      /// Write the sealed program as an image
+      void
+      WriteImage(
+        const char * a_filename) const;
+
+    private:
+
+      /// Number of references
+      int m_references;
+
+      /// Code segment, all lines back to back
+      std::vector<Cell> m_code;
+
+      /// Line table, indexed by line number
+      std::vector<Line> m_lines;
+
+      /// Decoded program, twice the layout of the code segment
+      std::vector<Instruction> m_decoded;
+
+      /// Program as seen by execution
+      View m_view;
+
+      /// Image the program has been loaded from, NULL if none
+      ImageFile * m_image;
+
+      /// Flag if the program is packed and decoded
+      bool m_sealed;
+
+      /// Flag if the decoder fuses instructions
+      bool m_fuse;
+
+      /// Point the view to the members
+      void
+      UpdateView();
+
+      /** Copy a loaded image into the members so it can be changed. Does
+       * nothing if no image is loaded.
+       */
+      void
+      ReleaseImage();
+
+      /// No copies, use Clone
+      Program(
+        const Program &);
+
+      /// No assignment
+      Program &
+      operator=(
+        const Program &);
+  };
+
+}
+
+#endif
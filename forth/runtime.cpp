@@ -1,11 +1,102 @@
 #include "runtime.hpp"
+#include "cpp_writer.hpp"
+#include "decoder.hpp"
+#include "stack_effect.hpp"
 
+#include <algorithm>
 #include <cassert>
+#include <cstring>
+#include <fstream>
 #include <iostream>
 #include <sstream>
+#include <pthread.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <unistd.h>
+
+/* Dispatch with computed goto (a GNU extension) where the compiler supports
+ * it. Define FORTH_NO_COMPUTED_GOTO to force the portable switch statement.
+ */
+#if defined(__GNUC__) && !defined(FORTH_NO_COMPUTED_GOTO)
+#define FORTH_COMPUTED_GOTO
+#endif
 
 namespace forth
 {
+  namespace
+  {
+    /// Stacks a thread watches while it runs with the stack guard
+    struct GuardScope
+    {
+      /// Where the handler continues after a fault
+      sigjmp_buf m_jump;
+
+      /// Data stack of the runtime
+      const FixedStack<Runtime::Cell> * m_dataStack;
+
+      /// Return stack of the runtime
+      const FixedStack<Runtime::Frame> * m_returnStack;
+
+      /// Address that faulted
+      const void * volatile m_fault;
+
+      /// Scope of a Run further out on the same thread, or NULL
+      GuardScope * m_outer;
+    };
+
+    /// Innermost scope of the thread, NULL outside of Run
+    __thread GuardScope * g_guardScope = NULL;
+
+    /// Handler of SIGSEGV before ours
+    struct sigaction g_previousAction;
+
+    /// Installs the handler once per process
+    pthread_once_t g_installOnce = PTHREAD_ONCE_INIT;
+
+    /// Leave Run if the fault is in a guard page, pass it on otherwise
+    void
+    HandleFault(
+      int a_signal,
+      siginfo_t * a_info,
+      void * a_context)
+    {
+      GuardScope * scope = g_guardScope;
+      const void * address = a_info->si_addr;
+      if ( (scope != NULL) &&
+           (scope->m_dataStack->IsBelow( address) ||
+            scope->m_dataStack->IsAbove( address) ||
+            scope->m_returnStack->IsBelow( address) ||
+            scope->m_returnStack->IsAbove( address)))
+      {
+        scope->m_fault = address;
+        siglongjmp( scope->m_jump, 1);
+      }
+
+      if ( (g_previousAction.sa_flags & SA_SIGINFO) != 0)
+        g_previousAction.sa_sigaction( a_signal, a_info, a_context);
+      else if ( (g_previousAction.sa_handler != SIG_DFL) &&
+                (g_previousAction.sa_handler != SIG_IGN))
+        g_previousAction.sa_handler( a_signal);
+      else
+      {
+        // The faulting instruction runs again and ends the process
+        signal( a_signal, SIG_DFL);
+      }
+    }
+
+    /// Install HandleFault. It doesn't block SIGSEGV, so it can jump out.
+    void
+    InstallFaultHandler()
+    {
+      struct sigaction action;
+      memset( &action, 0, sizeof( action));
+      action.sa_sigaction = HandleFault;
+      action.sa_flags = SA_SIGINFO | SA_NODEFER | SA_ONSTACK;
+      sigemptyset( &action.sa_mask);
+      sigaction( SIGSEGV, &action, &g_previousAction);
+    }
+  }
+
   const Runtime::Cell Runtime::kOpCodePlus = 0;
   const Runtime::Cell Runtime::kOpCodeMinus = 1;
   const Runtime::Cell Runtime::kOpCodeMult = 2;
@@ -63,16 +154,40 @@ namespace forth
     IntrExit,
   };
 
-  Runtime::Runtime()
-    : m_ipLine( kOpCodeFirstUser)
-    , m_ipCol( 0)
+  const size_t Runtime::kDefaultDataStackDepth = 1 << 20;
+  const size_t Runtime::kDefaultReturnStackDepth = 1 << 20;
+  const size_t Runtime::kNoColumn = static_cast<size_t>( -1);
+  const Runtime::Frame Runtime::kHostFrame = static_cast<Frame>( -1);
+
+  Runtime::Runtime(
+    size_t a_dataStackDepth,
+    size_t a_returnStackDepth)
+    : m_returnStack( a_returnStackDepth)
+    , m_dataStack( a_dataStackDepth)
+    , m_program( new Program)
+    , m_output( STDOUT_FILENO)
+    , m_exited( false)
+    , m_exitCode( 0)
+    , m_hostDepth( 0)
+    , m_input( NULL)
+    , m_waiting( false)
+    , m_memo( NULL)
+    , m_jit( NULL)
+    , m_stackGuard( false)
+    , m_ipLine( kOpCodeFirstUser)
+    , m_bottomLine( kOpCodeFirstUser)
+    , m_ip( kOpCodeFirstUser)
   {
-
+    // The lines in front of the first user line hold only their spare slot.
+    // Thus, the first user line will start at the index of its number.
+    m_view = m_program->GetView();
   }
 
   Runtime::~Runtime()
   {
-
+    delete m_jit;
+    delete m_memo;
+    m_program->Release();
   }
 
   void
@@ -94,46 +209,98 @@ namespace forth
   Runtime::PushDataNoExec(
     Cell a_data)
   {
-    m_dataStack.push_back( a_data);
+    // Handle a full stack
+    if ( m_dataStack.IsFull())
+    {
+      std::ostringstream str;
+      str << m_filename << "(" << m_ipLine << "): data stack overflow";
+      throw StackOverflow( str.str().c_str());
+    }
+
+    m_dataStack.Push( a_data);
   }
 
   Runtime::Cell
   Runtime::PopData()
   {
     // Handle an empty stack
-    if ( m_dataStack.empty())
+    if ( m_dataStack.IsEmpty())
     {
       std::ostringstream str;
       str << m_filename << "(" << m_ipLine << "): data stack underflow";
       throw StackUnderflow( str.str().c_str());
     }
 
-    Cell res = m_dataStack.back();
-    m_dataStack.pop_back();
-    return res;
+    return m_dataStack.Pop();
   }
 
   void
   Runtime::PushReturn(
-    Cell a_data)
+    Frame a_frame)
   {
-    m_returnStack.push_back( a_data);
+    // Handle a full stack
+    if ( m_returnStack.IsFull())
+    {
+      std::ostringstream str;
+      str << m_filename << "(" << m_ipLine << "): return stack overflow";
+      throw StackOverflow( str.str().c_str());
+    }
+
+    m_returnStack.Push( a_frame);
   }
 
-  size_t
+  Runtime::Frame
   Runtime::PopReturn()
   {
     // Handle an empty stack
-    if ( m_returnStack.empty())
+    if ( m_returnStack.IsEmpty())
     {
       std::ostringstream str;
       str << m_filename << "(" << m_ipLine << "): return stack underflow";
       throw StackUnderflow( str.str().c_str());
     }
 
-    Cell res = m_returnStack.back();
-    m_returnStack.pop_back();
-    return res;
+    return m_returnStack.Pop();
+  }
+
+  size_t
+  Runtime::FindLine(
+    size_t a_index) const
+  {
+    return m_program->FindLine( a_index);
+  }
+
+  Program &
+  Runtime::EditProgram()
+  {
+    if ( m_program->IsShared())
+    {
+      Program * copy = m_program->Clone();
+      m_program->Release();
+      m_program = copy;
+    }
+    return *m_program;
+  }
+
+  size_t
+  Runtime::GetIpColumn() const
+  {
+    if ( m_ipLine >= m_view.m_lineCount)
+      return kNoColumn;
+    return m_ip - m_view.m_lines[m_ipLine].m_offset;
+  }
+
+  void
+  Runtime::UpdateView(
+    size_t a_ipColumn)
+  {
+    m_view = m_program->GetView();
+    if ( m_memo != NULL)
+      m_memo->Invalidate();
+    if ( m_jit != NULL)
+      m_jit->Invalidate();
+    if ( a_ipColumn != kNoColumn)
+      m_ip = m_view.m_lines[m_ipLine].m_offset + a_ipColumn;
   }
 
   void
@@ -141,16 +308,96 @@ namespace forth
     size_t a_row,
     Cell a_number)
   {
-    // If it's a valid line
-    if ( a_row >= kOpCodeFirstUser)
+    size_t column = GetIpColumn();
+    EditProgram().Compile( a_row, a_number, kOpCodeFirstUser);
+    UpdateView( column);
+  }
+
+  void
+  Runtime::Seal()
+  {
+    size_t column = GetIpColumn();
+    EditProgram().Seal();
+    UpdateView( column);
+  }
+
+  void
+  Runtime::SetFusion(
+    bool a_fuse)
+  {
+    size_t column = GetIpColumn();
+    EditProgram().SetFusion( a_fuse);
+    UpdateView( column);
+  }
+
+  void
+  Runtime::LoadImage(
+    const char * a_filename)
+  {
+    Program * program = new Program;
+    try
     {
-      // Resize the program memory if required
-      if ( m_program.size() <= a_row)
-        m_program.resize( a_row + 1);
+      program->LoadImage( a_filename);
+    }
+    catch (...)
+    {
+      program->Release();
+      throw;
+    }
+
+    m_program->Release();
+    m_program = program;
+    UpdateView( kNoColumn);
+    ResetIp( kOpCodeFirstUser);
+  }
 
-      // Append the number to the line
-      m_program[a_row].push_back( a_number);
+  void
+  Runtime::ShareProgram(
+    const Runtime &a_other)
+  {
+    a_other.m_program->Acquire();
+    m_program->Release();
+    m_program = a_other.m_program;
+    UpdateView( kNoColumn);
+    ResetIp( kOpCodeFirstUser);
+  }
+
+  void
+  Runtime::WriteImage(
+    const char * a_filename)
+  {
+    if ( !m_program->IsSealed())
+      Seal();
+    m_program->WriteImage( a_filename);
+  }
+
+  void
+  Runtime::WriteCpp(
+    const char * a_filename)
+  {
+    if ( !m_program->IsSealed())
+      Seal();
+    CppWriter::WriteFile( m_program->GetView(), m_filename, a_filename);
+  }
+
+  std::vector<std::string>
+  Runtime::Lint()
+  {
+    if ( !m_program->IsSealed())
+      Seal();
+
+    // The program starts at the first line with an empty stack
+    std::vector<std::string> messages;
+    size_t line = 0;
+    if ( (m_view.m_lineCount > static_cast<size_t>( kOpCodeFirstUser)) &&
+         StackEffect::FindUnderflow( m_view.m_code, m_view.m_lines,
+           m_view.m_lineCount, kOpCodeFirstUser, 0, line))
+    {
+      std::ostringstream str;
+      str << m_filename << "(" << line << "): data stack underflow";
+      messages.push_back( str.str());
     }
+    return messages;
   }
 
   void
@@ -166,12 +413,10 @@ namespace forth
       else
       {
         // Otherwise, we remember where we are
-        PushReturn( m_ipLine);
-        PushReturn( m_ipCol);
+        PushReturn( m_ip);
 
         // And set the IP to the new position
-        m_ipLine = a_opCode;
-        m_ipCol = 0;
+        ResetIp( a_opCode);
       }
     }
   }
@@ -181,23 +426,44 @@ namespace forth
     size_t a_line)
   {
     m_ipLine = a_line;
-    m_ipCol = 0;
+    m_ip = (a_line < m_view.m_lineCount) ?
+           m_view.m_lines[a_line].m_offset : 0;
+    if ( m_returnStack.IsEmpty())
+      m_bottomLine = a_line;
+    m_exited = false;
+    m_waiting = false;
+    if ( m_memo != NULL)
+      m_memo->AbandonCalls();
   }
 
   void
   Runtime::ComputeStep()
   {
+    // An exited program stays where it is
+    if ( m_exited)
+      return;
+
+    // Single steps don't record results, the calls Run started may not
+    // return the way it expects
+    if ( m_memo != NULL)
+      m_memo->AbandonCalls();
+
+    // A program waiting for input tries to read again
+    if ( m_waiting)
+    {
+      m_waiting = false;
+      IntrRead( *this);
+      return;
+    }
+
     // If the IP is outside the program, we jump back to the beginning.
-    if (m_ipLine < m_program.size())
+    if (m_ipLine < m_view.m_lineCount)
     {
       // If we still have things to do on this line
-      if (m_ipCol < m_program[m_ipLine].size())
+      if (m_ip < m_view.m_lines[m_ipLine].End())
       {
-        // Read the value
-        Cell v = m_program[m_ipLine][m_ipCol];
-
-        // Advance the IP
-        m_ipCol++;
+        // Read the value and advance the IP
+        Cell v = m_view.m_code[m_ip++];
 
         // Push the data or execute the code
         PushData( v);
@@ -206,16 +472,926 @@ namespace forth
       {
         // We are at the end of the line, pop the return stack and continue
         // where we left off
-        m_ipCol = PopReturn();
-        m_ipLine = PopReturn();
+        m_ip = PopReturn();
+
+        // Run leaves the frames of calls made in the unchecked copy
+        if ( (m_ip >= m_view.m_codeSize) && (m_ip < 2 * m_view.m_codeSize))
+          m_ip -= m_view.m_codeSize;
+        m_ipLine = FindLine( m_ip);
       }
     }
     else
     {
       // Go to start
-      m_ipLine = kOpCodeFirstUser;
-      m_ipCol = 0;
+      ResetIp( kOpCodeFirstUser);
+    }
+  }
+
+  Runtime::RunResult
+  Runtime::Run()
+  {
+    if ( m_stackGuard)
+      return RunGuarded( false, 0);
+    return RunEngine<false>( false, 0);
+  }
+
+  Runtime::RunResult
+  Runtime::Run(
+    uint64_t a_maxSteps)
+  {
+    if ( m_stackGuard)
+      return RunGuarded( true, a_maxSteps);
+    return RunEngine<false>( true, a_maxSteps);
+  }
+
+  template <bool t_guard>
+  Runtime::RunResult
+  Runtime::RunEngine(
+    bool a_limited,
+    uint64_t a_maxSteps)
+  {
+    if ( a_limited)
+    {
+      if ( m_memo != NULL)
+        return Execute<true, true, false, t_guard>( a_maxSteps);
+      return Execute<true, false, false, t_guard>( a_maxSteps);
+    }
+    if ( m_jit != NULL)
+    {
+      if ( m_memo != NULL)
+        return Execute<false, true, true, t_guard>( 0);
+      return Execute<false, false, true, t_guard>( 0);
+    }
+    if ( m_memo != NULL)
+      return Execute<false, true, false, t_guard>( 0);
+    return Execute<false, false, false, t_guard>( 0);
+  }
+
+  Runtime::RunResult
+  Runtime::RunGuarded(
+    bool a_limited,
+    uint64_t a_maxSteps)
+  {
+    // The guard pages are only hit by Execute itself, the out-of-line code
+    // it calls checks the stacks. Execute and RunEngine keep their state in
+    // plain locals, so jumping out of them skips no destructors. The signal
+    // mask stays as it is, the handler doesn't block SIGSEGV.
+    GuardScope scope;
+    scope.m_dataStack = &m_dataStack;
+    scope.m_returnStack = &m_returnStack;
+    scope.m_fault = NULL;
+    scope.m_outer = g_guardScope;
+    if ( sigsetjmp( scope.m_jump, 0) != 0)
+    {
+      g_guardScope = scope.m_outer;
+      ReportStackFault( scope.m_fault);
+    }
+
+    g_guardScope = &scope;
+    RunResult result;
+    try
+    {
+      result = RunEngine<true>( a_limited, a_maxSteps);
+    }
+    catch (...)
+    {
+      g_guardScope = scope.m_outer;
+      throw;
     }
+    g_guardScope = scope.m_outer;
+    return result;
+  }
+
+  void
+  Runtime::ReportStackFault(
+    const void * a_address)
+  {
+    // Let the usual functions report the error on an empty or full stack.
+    // Both are left empty.
+    m_dataStack.Clear();
+    m_returnStack.Clear();
+    try
+    {
+      if ( m_dataStack.IsBelow( a_address))
+        PopData();
+      else if ( m_dataStack.IsAbove( a_address))
+      {
+        m_dataStack.SetSize( m_dataStack.Capacity());
+        PushDataNoExec( 0);
+      }
+      else if ( m_returnStack.IsBelow( a_address))
+        PopReturn();
+      else
+      {
+        m_returnStack.SetSize( m_returnStack.Capacity());
+        PushReturn( 0);
+      }
+    }
+    catch (...)
+    {
+      m_dataStack.Clear();
+      m_returnStack.Clear();
+      throw;
+    }
+  }
+
+  template <bool t_limited, bool t_memo, bool t_jit, bool t_guard>
+  Runtime::RunResult
+  Runtime::Execute(
+    uint64_t a_maxSteps)
+  {
+#ifdef FORTH_COMPUTED_GOTO
+    // Jump table of the operations. Keep in sync with forth::Operation.
+    static const void * const kDispatch[ kOpCount] =
+    {
+      &&op_plus,
+      &&op_minus,
+      &&op_mult,
+      &&op_div,
+      &&op_mod,
+      &&op_and,
+      &&op_or,
+      &&op_not,
+
+      &&op_swap,
+      &&op_dup,
+      &&op_drop,
+
+      &&op_loop,
+
+      &&op_emit,
+      &&op_read,
+
+      &&op_exit,
+
+      &&op_over,
+      &&op_exit,
+      &&op_exit,
+      &&op_exit,
+      &&op_exit,
+      &&op_exit,
+
+      &&op_literal,
+      &&op_call,
+      &&op_call_line,
+      &&op_jump_line,
+      &&op_tail_call,
+      &&op_return,
+      &&op_nop,
+      &&op_push_block,
+      &&op_inline_line,
+
+#define FORTH_SUPERINSTRUCTION(name, length, op1, op2, op3) &&op_ ## name,
+#include "superinstructions.def"
+#undef FORTH_SUPERINSTRUCTION
+
+#define FORTH_UNCHECKED(name) &&op_ ## name ## Unchecked,
+#include "unchecked.def"
+#undef FORTH_UNCHECKED
+    };
+#define FORTH_OP(label, op) label
+#define FORTH_DISPATCH(op) goto *kDispatch[op]
+#else
+#define FORTH_OP(label, op) case op
+#define FORTH_DISPATCH(op) opCode = (op); goto dispatch
+#endif
+
+/** Fetch the instruction at the IP, advance the IP and execute it. With a
+ * limit, stop before the instruction once the budget is used up.
+ */
+#define FORTH_NEXT() \
+  if ( t_limited && (budget-- == 0)) \
+    goto op_step_limit; \
+  insn = ip; \
+  ip += insn->m_next; \
+  FORTH_DISPATCH( insn->m_op)
+
+/// Leave an intrinsic to its out-of-line implementation
+#define FORTH_SLOW(op) \
+  opCode = (op); \
+  goto op_intrinsic
+
+/// Number of steps done so far, only counted with a limit
+#define FORTH_STEPS() (t_limited ? a_maxSteps - budget : 0)
+
+/// Number of items on the data stack
+#define FORTH_DEPTH() static_cast<size_t>( sp - storage)
+
+/** Push a number, spilling the old top of the stack to memory. With the
+ * guard, spilling past the capacity faults instead.
+ */
+#define FORTH_PUSH(value) \
+  { \
+    Cell pushed = (value); \
+    if ( !t_guard && (FORTH_DEPTH() >= capacity)) \
+      goto op_overflow; \
+    *++sp = tos; \
+    tos = pushed; \
+  }
+
+/// Write the cached top of the stack and the return stack back
+#define FORTH_STORE_STACK() \
+  sp[1] = tos; \
+  m_dataStack.SetSize( FORTH_DEPTH()); \
+  m_returnStack.SetSize( rp - frames)
+
+/// Reload the cached stack pointers after the stacks have changed
+#define FORTH_LOAD_STACK() \
+  sp = storage + m_dataStack.Size(); \
+  tos = sp[1]; \
+  rp = frames + m_returnStack.Size()
+
+/// Index in the code segment of an instruction of either copy
+#define FORTH_INDEX(pointer) \
+  (static_cast<size_t>( (pointer) - base) - \
+   (((pointer) >= unchecked) ? codeSize : 0))
+
+/// Store the machine state for an out-of-line call, IP at the instruction
+#define FORTH_STORE_STATE(pointer) \
+  FORTH_STORE_STACK(); \
+  m_ip = FORTH_INDEX( pointer); \
+  m_ipLine = FindLine( m_ip)
+
+/** Check if an instruction belongs to an inlined line. They follow both
+ * copies. Only the slow paths need to know, so the start is read from the
+ * view rather than kept in a register.
+ */
+#define FORTH_IS_INLINED(pointer) \
+  ((pointer) >= m_view.m_decoded + 2 * m_view.m_codeSize)
+
+/// Header of the inlined line an instruction belongs to
+#define FORTH_HEADER(pointer) ((pointer) - (pointer)->m_unchecked)
+
+/// Index in the code segment of an instruction of an inlined line
+#define FORTH_ORIGIN(pointer) \
+  static_cast<size_t>( FORTH_HEADER( pointer)->m_arg + \
+    ((pointer) - FORTH_HEADER( pointer)) - 1)
+
+/** Store the machine state like FORTH_STORE_STATE, where the IP may be
+ * inside an inlined line. The frame its call didn't take is pushed first.
+ */
+#define FORTH_STORE_STATE_INLINED(pointer) \
+  if ( FORTH_IS_INLINED( pointer)) \
+  { \
+    *rp++ = FORTH_HEADER( pointer)->m_arg2; \
+    FORTH_STORE_STACK(); \
+    m_ip = FORTH_ORIGIN( pointer); \
+    m_ipLine = FindLine( m_ip); \
+  } \
+  else \
+  { \
+    FORTH_STORE_STATE( pointer); \
+  }
+
+/** Continue in the unchecked copy if the data stack is deep enough for the
+ * rest of the line at the IP. In the copy, m_unchecked is 0. Both ways
+ * dispatch on their own, so fetching the instruction doesn't wait for the
+ * check.
+ */
+#define FORTH_UNCHECK() \
+  if ( FORTH_DEPTH() >= static_cast<size_t>( ip->m_unchecked) - 1) \
+  { \
+    ip += codeSize; \
+    FORTH_NEXT(); \
+  }
+
+/// With the JIT, continue natively if the line starting at the IP is hot
+#define FORTH_ENTER_LINE() \
+  if ( t_jit) \
+    goto op_enter_line
+
+/** Push the literal of a superinstruction and continue with the rest of the
+ * sequence, which is decoded on its own in the next slot.
+ */
+#define FORTH_UNFUSE_LITERAL() \
+  FORTH_PUSH( insn->m_arg); \
+  ip = insn + 1; \
+  FORTH_NEXT()
+
+    if ( !m_program->IsSealed())
+      Seal();
+    // Only the variant with t_memo uses the cache, and op_memo_call is only
+    // reached from there
+    MemoCache * const memo = m_memo;
+    if ( t_memo)
+      memo->Prepare( m_view);
+    Jit * const jit = m_jit;
+    if ( t_jit)
+      jit->Prepare( m_view);
+
+    // Without a first line there is nothing to run
+    if ( m_view.m_lineCount <= static_cast<size_t>( kOpCodeFirstUser))
+      m_exited = true;
+    if ( m_exited)
+    {
+      FlushOutput();
+      RunResult result = { RunResult::kExited, m_exitCode, 0 };
+      return result;
+    }
+
+    // A program waiting for input tries to read again before it continues
+    if ( m_waiting)
+    {
+      m_waiting = false;
+      IntrRead( *this);
+      if ( m_waiting)
+      {
+        RunResult result = { RunResult::kWaitingForInput, 0, 0 };
+        return result;
+      }
+    }
+
+    // If the IP is outside the program, we start at the beginning.
+    if ( m_ipLine >= m_view.m_lineCount)
+      ResetIp( kOpCodeFirstUser);
+
+    // Keep the machine state in locals. It is written back only when we
+    // leave the loop or call an out-of-line intrinsic.
+    //
+    // The top of the data stack lives in tos, sp points to the item below
+    // it. The spare items of the fixed stack give both a place to point to
+    // if the stack holds less than two items. The number of items is the
+    // distance of sp from the start of the memory.
+    //
+    // The return stack grows from frames up to rp. The current line is not
+    // tracked, it is looked up when an out-of-line call needs it.
+    Cell * const storage = m_dataStack.Storage();
+    const size_t capacity = m_dataStack.Capacity();
+    Frame * const frames = m_returnStack.Bottom();
+    Frame * const framesEnd = frames + m_returnStack.Capacity();
+    Frame * const hostFrames = frames + m_hostDepth;
+    Cell * sp;
+    Cell tos;
+    Frame * rp;
+    FORTH_LOAD_STACK();
+
+    const Instruction * const base = m_view.m_decoded;
+    const size_t codeSize = m_view.m_codeSize;
+    const Instruction * const unchecked = base + codeSize;
+    const Cell * const code = m_view.m_code;
+    const Line * const lines = m_view.m_lines;
+    const size_t lineCount = m_view.m_lineCount;
+    const Instruction * ip = base + m_ip;
+    const Instruction * insn = ip;
+    Cell opCode = 0;
+    uint64_t budget = a_maxSteps;
+    bool tailCall = false;
+
+    FORTH_NEXT();
+
+#ifndef FORTH_COMPUTED_GOTO
+dispatch:
+    switch (opCode)
+    {
+#endif
+
+    FORTH_OP( op_literal, kOpLiteral) :
+      FORTH_PUSH( insn->m_arg);
+      FORTH_NEXT();
+
+    FORTH_OP( op_call, kOpCall) :
+      if ( FORTH_DEPTH() == 0)
+      {
+        // Let PopData report the underflow
+        FORTH_STORE_STATE( ip);
+        PopData();
+      }
+      opCode = tos;
+      tos = *sp--;
+
+      // Only handle legal, i.e. non-negative opcodes
+      if (opCode < 0)
+      {
+        FORTH_NEXT();
+      }
+
+      // Intrinsics are executed by their operation
+      if (opCode < kOpCodeFirstUser)
+      {
+        FORTH_DISPATCH( opCode);
+      }
+
+      // Remember where we are and jump to the line. Calls outside the
+      // program go to the start.
+      if ( !t_guard && (rp == framesEnd))
+        goto op_return_overflow;
+      *rp++ = ip - base;
+      if ( static_cast<size_t>( opCode) >= lineCount)
+        opCode = kOpCodeFirstUser;
+      ip = base + lines[opCode].m_offset;
+      FORTH_ENTER_LINE();
+      FORTH_UNCHECK();
+      FORTH_NEXT();
+
+    FORTH_OP( op_call_line, kOpCallLine) :
+      if ( !t_guard && (rp == framesEnd))
+        goto op_return_overflow;
+      if ( t_memo && memo->IsMemoized( insn->m_arg))
+      {
+        tailCall = false;
+        goto op_memo_call;
+      }
+      *rp++ = ip - base;
+      ip = base + insn->m_arg2;
+      FORTH_ENTER_LINE();
+      FORTH_UNCHECK();
+      FORTH_NEXT();
+
+    FORTH_OP( op_jump_line, kOpJumpLine) :
+      if ( t_memo && (rp != framesEnd) && memo->IsMemoized( insn->m_arg))
+      {
+        tailCall = true;
+        goto op_memo_call;
+      }
+      ip = base + insn->m_arg2;
+      FORTH_ENTER_LINE();
+      FORTH_UNCHECK();
+      FORTH_NEXT();
+
+    FORTH_OP( op_tail_call, kOpTailCall) :
+      if ( FORTH_DEPTH() == 0)
+      {
+        // Let PopData report the underflow
+        FORTH_STORE_STATE( ip);
+        PopData();
+      }
+      opCode = tos;
+      tos = *sp--;
+
+      // Negative opcodes and intrinsics continue with the end of the line
+      if (opCode < 0)
+      {
+        FORTH_NEXT();
+      }
+      if (opCode < kOpCodeFirstUser)
+      {
+        FORTH_DISPATCH( opCode);
+      }
+
+      // Go to the line, the caller of this line becomes its caller
+      if ( static_cast<size_t>( opCode) >= lineCount)
+        opCode = kOpCodeFirstUser;
+      ip = base + lines[opCode].m_offset;
+      FORTH_ENTER_LINE();
+      FORTH_UNCHECK();
+      FORTH_NEXT();
+
+    FORTH_OP( op_return, kOpReturn) :
+      // We are at the end of the line, continue where we left off
+      if ( rp == hostFrames)
+      {
+        if ( rp == frames)
+        {
+          // Let PopReturn report the underflow at the end of the bottom
+          // line, tail calls may have jumped to another one since
+          FORTH_STORE_STATE( insn);
+          if ( m_bottomLine < lineCount)
+          {
+            m_ipLine = m_bottomLine;
+            m_ip = lines[m_bottomLine].End();
+          }
+          PopReturn();
+        }
+        goto op_host_return;
+      }
+      if ( t_memo && memo->IsCallEnding( rp - frames))
+      {
+        sp[1] = tos;
+        memo->EndCall( sp + 2);
+      }
+      ip = base + *--rp;
+      FORTH_NEXT();
+
+    FORTH_OP( op_inline_line, kOpInlineLine) :
+      // The line follows without a frame, but it needs room for one in
+      // case it stops inside. A memoized line is called as before.
+      if ( !t_guard && (rp == framesEnd))
+        goto op_return_overflow;
+      if ( t_memo && memo->IsMemoized( insn->m_arg))
+      {
+        ip = insn + 2;
+        tailCall = false;
+        goto op_memo_call;
+      }
+      FORTH_NEXT();
+
+    FORTH_OP( op_nop, kOpNop) :
+      FORTH_NEXT();
+
+    FORTH_OP( op_push_block, kOpPushBlock) :
+      if ( FORTH_DEPTH() + insn->m_arg > capacity)
+      {
+        // Push one by one to report the overflow at the right literal
+        FORTH_PUSH( code[insn->m_arg2]);
+        ip = insn + 1;
+        FORTH_NEXT();
+      }
+
+      // The literals are the numbers in the code segment
+      sp[1] = tos;
+      memcpy( sp + 2, code + insn->m_arg2, insn->m_arg * sizeof( Cell));
+      sp += insn->m_arg;
+      tos = sp[1];
+      FORTH_NEXT();
+
+    // The unchecked twin of an operation starts behind its check, see
+    // unchecked.def
+    FORTH_OP( op_plus, kOpPlus) :
+      if (FORTH_DEPTH() < 2)
+      {
+        FORTH_SLOW( kOpPlus);
+      }
+    FORTH_OP( op_PlusUnchecked, kOpPlusUnchecked) :
+      tos = *sp-- + tos;
+      FORTH_NEXT();
+
+    FORTH_OP( op_minus, kOpMinus) :
+      if (FORTH_DEPTH() < 2)
+      {
+        FORTH_SLOW( kOpMinus);
+      }
+    FORTH_OP( op_MinusUnchecked, kOpMinusUnchecked) :
+      tos = *sp-- - tos;
+      FORTH_NEXT();
+
+    FORTH_OP( op_mult, kOpMult) :
+      if (FORTH_DEPTH() < 2)
+      {
+        FORTH_SLOW( kOpMult);
+      }
+    FORTH_OP( op_MultUnchecked, kOpMultUnchecked) :
+      tos = *sp-- * tos;
+      FORTH_NEXT();
+
+    FORTH_OP( op_div, kOpDiv) :
+      if (FORTH_DEPTH() < 2)
+      {
+        FORTH_SLOW( kOpDiv);
+      }
+    FORTH_OP( op_DivUnchecked, kOpDivUnchecked) :
+      tos = *sp-- / tos;
+      FORTH_NEXT();
+
+    FORTH_OP( op_mod, kOpMod) :
+      if (FORTH_DEPTH() < 2)
+      {
+        FORTH_SLOW( kOpMod);
+      }
+    FORTH_OP( op_ModUnchecked, kOpModUnchecked) :
+      tos = *sp-- % tos;
+      FORTH_NEXT();
+
+    FORTH_OP( op_and, kOpAnd) :
+      if (FORTH_DEPTH() < 2)
+      {
+        FORTH_SLOW( kOpAnd);
+      }
+    FORTH_OP( op_AndUnchecked, kOpAndUnchecked) :
+      tos = (*sp-- != 0 && tos != 0) ? 1 : 0;
+      FORTH_NEXT();
+
+    FORTH_OP( op_or, kOpOr) :
+      if (FORTH_DEPTH() < 2)
+      {
+        FORTH_SLOW( kOpOr);
+      }
+    FORTH_OP( op_OrUnchecked, kOpOrUnchecked) :
+      tos = (*sp-- != 0 || tos != 0) ? 1 : 0;
+      FORTH_NEXT();
+
+    FORTH_OP( op_not, kOpNot) :
+      if (FORTH_DEPTH() < 1)
+      {
+        FORTH_SLOW( kOpNot);
+      }
+    FORTH_OP( op_NotUnchecked, kOpNotUnchecked) :
+      tos = (tos == 0) ? 1 : 0;
+      FORTH_NEXT();
+
+    FORTH_OP( op_swap, kOpSwap) :
+      if (FORTH_DEPTH() < 2)
+      {
+        FORTH_SLOW( kOpSwap);
+      }
+    FORTH_OP( op_SwapUnchecked, kOpSwapUnchecked) :
+      std::swap( *sp, tos);
+      FORTH_NEXT();
+
+    FORTH_OP( op_dup, kOpDup) :
+      if (FORTH_DEPTH() < 1)
+      {
+        FORTH_SLOW( kOpDup);
+      }
+    FORTH_OP( op_DupUnchecked, kOpDupUnchecked) :
+      FORTH_PUSH( tos);
+      FORTH_NEXT();
+
+    FORTH_OP( op_drop, kOpDrop) :
+      if (FORTH_DEPTH() < 1)
+      {
+        FORTH_SLOW( kOpDrop);
+      }
+    FORTH_OP( op_DropUnchecked, kOpDropUnchecked) :
+      tos = *sp--;
+      FORTH_NEXT();
+
+    FORTH_OP( op_loop, kOpLoop) :
+      if (FORTH_DEPTH() < 1)
+      {
+        FORTH_SLOW( kOpLoop);
+      }
+    FORTH_OP( op_LoopUnchecked, kOpLoopUnchecked) :
+      // Drop a zero and continue, otherwise restart the line
+      if (tos == 0)
+        tos = *sp--;
+      else
+      {
+        ip = base + insn->m_arg;
+        FORTH_ENTER_LINE();
+      }
+      FORTH_NEXT();
+
+    FORTH_OP( op_emit, kOpEmit) :
+      FORTH_SLOW( kOpEmit);
+
+    FORTH_OP( op_read, kOpRead) :
+      FORTH_SLOW( kOpRead);
+
+    FORTH_OP( op_exit, kOpExit) :
+      FORTH_SLOW( kOpExit);
+
+    FORTH_OP( op_over, kOpOver) :
+      if (FORTH_DEPTH() < 2)
+      {
+        FORTH_SLOW( kOpOver);
+      }
+    FORTH_OP( op_OverUnchecked, kOpOverUnchecked) :
+      FORTH_PUSH( *sp);
+      FORTH_NEXT();
+
+    FORTH_OP( op_DupNotNot, kOpDupNotNot) :
+      if (FORTH_DEPTH() < 1)
+      {
+        FORTH_SLOW( kOpDup);
+      }
+    FORTH_OP( op_DupNotNotUnchecked, kOpDupNotNotUnchecked) :
+      FORTH_PUSH( (tos != 0) ? 1 : 0);
+      FORTH_NEXT();
+
+    FORTH_OP( op_SwapOverPlus, kOpSwapOverPlus) :
+      if (FORTH_DEPTH() < 2)
+      {
+        FORTH_SLOW( kOpSwap);
+      }
+    FORTH_OP( op_SwapOverPlusUnchecked, kOpSwapOverPlusUnchecked) :
+      {
+        Cell a = *sp;
+        *sp = tos;
+        tos += a;
+      }
+      FORTH_NEXT();
+
+    FORTH_OP( op_LiteralMinusLoop, kOpLiteralMinusLoop) :
+      if (FORTH_DEPTH() < 1)
+      {
+        FORTH_UNFUSE_LITERAL();
+      }
+    FORTH_OP( op_LiteralMinusLoopUnchecked, kOpLiteralMinusLoopUnchecked) :
+      // Decrement, then drop a zero or restart the line
+      tos -= insn->m_arg;
+      if (tos == 0)
+        tos = *sp--;
+      else
+      {
+        ip = base + insn->m_arg2;
+        FORTH_ENTER_LINE();
+      }
+      FORTH_NEXT();
+
+    FORTH_OP( op_LiteralPlus, kOpLiteralPlus) :
+      if (FORTH_DEPTH() < 1)
+      {
+        FORTH_UNFUSE_LITERAL();
+      }
+    FORTH_OP( op_LiteralPlusUnchecked, kOpLiteralPlusUnchecked) :
+      tos += insn->m_arg;
+      FORTH_NEXT();
+
+    FORTH_OP( op_LiteralMinus, kOpLiteralMinus) :
+      if (FORTH_DEPTH() < 1)
+      {
+        FORTH_UNFUSE_LITERAL();
+      }
+    FORTH_OP( op_LiteralMinusUnchecked, kOpLiteralMinusUnchecked) :
+      tos -= insn->m_arg;
+      FORTH_NEXT();
+
+    FORTH_OP( op_LiteralMult, kOpLiteralMult) :
+      if (FORTH_DEPTH() < 1)
+      {
+        FORTH_UNFUSE_LITERAL();
+      }
+    FORTH_OP( op_LiteralMultUnchecked, kOpLiteralMultUnchecked) :
+      tos *= insn->m_arg;
+      FORTH_NEXT();
+
+    FORTH_OP( op_LiteralDiv, kOpLiteralDiv) :
+      if (FORTH_DEPTH() < 1)
+      {
+        FORTH_UNFUSE_LITERAL();
+      }
+    FORTH_OP( op_LiteralDivUnchecked, kOpLiteralDivUnchecked) :
+      tos /= insn->m_arg;
+      FORTH_NEXT();
+
+    FORTH_OP( op_LiteralMod, kOpLiteralMod) :
+      if (FORTH_DEPTH() < 1)
+      {
+        FORTH_UNFUSE_LITERAL();
+      }
+    FORTH_OP( op_LiteralModUnchecked, kOpLiteralModUnchecked) :
+      tos %= insn->m_arg;
+      FORTH_NEXT();
+
+    FORTH_OP( op_LiteralSwap, kOpLiteralSwap) :
+      if (FORTH_DEPTH() < 1)
+      {
+        FORTH_UNFUSE_LITERAL();
+      }
+    FORTH_OP( op_LiteralSwapUnchecked, kOpLiteralSwapUnchecked) :
+      // Slip the literal in below the top
+      FORTH_PUSH( tos);
+      *sp = insn->m_arg;
+      FORTH_NEXT();
+
+    FORTH_OP( op_LiteralEmit, kOpLiteralEmit) :
+      FORTH_PUSH( insn->m_arg);
+      FORTH_SLOW( kOpEmit);
+
+    FORTH_OP( op_ModNot, kOpModNot) :
+      if (FORTH_DEPTH() < 2)
+      {
+        FORTH_SLOW( kOpMod);
+      }
+    FORTH_OP( op_ModNotUnchecked, kOpModNotUnchecked) :
+      tos = (*sp-- % tos == 0) ? 1 : 0;
+      FORTH_NEXT();
+
+    FORTH_OP( op_SwapDrop, kOpSwapDrop) :
+      if (FORTH_DEPTH() < 2)
+      {
+        FORTH_SLOW( kOpSwap);
+      }
+    FORTH_OP( op_SwapDropUnchecked, kOpSwapDropUnchecked) :
+      --sp;
+      FORTH_NEXT();
+
+#ifndef FORTH_COMPUTED_GOTO
+    default:
+      FORTH_SLOW( kOpExit);
+    }
+#endif
+
+op_intrinsic:
+    // Everything else, including error reporting, is left to the
+    // out-of-line implementation. An intrinsic of an inlined line sees
+    // the line as if it had been called, and the rest of it runs that way.
+    // The IP may be behind the line already.
+    if ( FORTH_IS_INLINED( insn))
+    {
+      *rp++ = FORTH_HEADER( insn)->m_arg2;
+      FORTH_STORE_STACK();
+      m_ip = FORTH_ORIGIN( insn) + base[FORTH_ORIGIN( insn)].m_next;
+      m_ipLine = FindLine( m_ip);
+    }
+    else
+    {
+      FORTH_STORE_STATE( ip);
+    }
+    kIntrinsics[ opCode]( *this);
+    if ( m_exited)
+    {
+      FlushOutput();
+      RunResult result = { RunResult::kExited, m_exitCode, FORTH_STEPS() };
+      return result;
+    }
+    if ( m_waiting)
+    {
+      RunResult result =
+      {
+        RunResult::kWaitingForInput, 0, FORTH_STEPS()
+      };
+      return result;
+    }
+    FORTH_LOAD_STACK();
+    ip = base + m_ip;
+    FORTH_UNCHECK();
+    FORTH_NEXT();
+
+op_memo_call:
+    // A call of a pure line by a constant opcode, the IP points behind it.
+    // Answer it from the cache if the stacks are deep enough to run it.
+    {
+      const MemoCache::Signature &signature =
+        memo->GetSignature( insn->m_arg);
+      size_t depth = FORTH_DEPTH();
+      if ( (depth >= signature.m_inputs) &&
+           (depth - signature.m_inputs + signature.m_peak <= capacity) &&
+           (static_cast<size_t>( framesEnd - rp) > signature.m_calls))
+      {
+        // The cells taken are contiguous once the top is written back
+        sp[1] = tos;
+        Cell * cells = sp + 2 - signature.m_inputs;
+        if ( memo->Lookup( insn->m_arg, cells))
+        {
+          sp += signature.m_outputs;
+          sp -= signature.m_inputs;
+          tos = sp[1];
+          FORTH_NEXT();
+        }
+
+        // Run the line and record what it leaves. A tail call returns to
+        // the end of this line, so its return can be seen.
+        *rp++ = ip - base;
+        memo->BeginCall( rp - frames, insn->m_arg, cells);
+      }
+      else if ( !tailCall)
+        *rp++ = ip - base;
+      ip = base + insn->m_arg2;
+      FORTH_ENTER_LINE();
+      FORTH_UNCHECK();
+      FORTH_NEXT();
+    }
+
+op_enter_line:
+    // Run the line natively until it needs the interpreter, once it is hot.
+    // Only the variant with t_jit gets here.
+    if ( t_jit)
+    {
+      Jit::Function native = jit->Enter( FORTH_INDEX( ip));
+      if ( native == NULL)
+      {
+        FORTH_UNCHECK();
+        FORTH_NEXT();
+      }
+      sp[1] = tos;
+      Cell * top;
+      ip = base + native( sp + 1, storage + 1, storage + 1 + capacity, &top);
+      sp = top - 1;
+      tos = sp[1];
+    }
+    FORTH_UNCHECK();
+    FORTH_NEXT();
+
+op_overflow:
+    // Let PushDataNoExec report the full stack
+    FORTH_STORE_STATE_INLINED( insn);
+    PushDataNoExec( 0);
+    FORTH_NEXT();
+
+op_return_overflow:
+    // Let PushReturn report the full stack
+    FORTH_STORE_STATE( insn);
+    PushReturn( 0);
+    FORTH_NEXT();
+
+op_host_return:
+    // The line passed to Call is done, drop the frame that led here
+    --rp;
+    FORTH_STORE_STATE( insn);
+    FlushOutput();
+    {
+      RunResult result = { RunResult::kReturned, 0, FORTH_STEPS() };
+      return result;
+    }
+
+op_step_limit:
+    // The budget is used up, continue with the next instruction next time
+    FORTH_STORE_STATE_INLINED( ip);
+    FlushOutput();
+    {
+      RunResult result = { RunResult::kStepLimit, 0, a_maxSteps };
+      return result;
+    }
+
+#undef FORTH_UNFUSE_LITERAL
+#undef FORTH_ENTER_LINE
+#undef FORTH_UNCHECK
+#undef FORTH_STORE_STATE
+#undef FORTH_INDEX
+#undef FORTH_STORE_STATE_INLINED
+#undef FORTH_ORIGIN
+#undef FORTH_HEADER
+#undef FORTH_IS_INLINED
+#undef FORTH_LOAD_STACK
+#undef FORTH_STORE_STACK
+#undef FORTH_PUSH
+#undef FORTH_DEPTH
+#undef FORTH_STEPS
+#undef FORTH_SLOW
+#undef FORTH_NEXT
+#undef FORTH_OP
+#undef FORTH_DISPATCH
   }
 
   void
@@ -303,22 +1479,23 @@ namespace forth
   Runtime::IntrSwap(
     Runtime &a_forth)
   {
-    if ( a_forth.m_dataStack.size() < 2)
+    if ( a_forth.m_dataStack.Size() < 2)
       throw StackUnderflow( "Swap");
 
     // Get the index of the value below the top of the stack
-    size_t tos1 = a_forth.m_dataStack.size() - 2;
-    std::swap( a_forth.m_dataStack[tos1], a_forth.m_dataStack[tos1 + 1]);
+    size_t tos1 = a_forth.m_dataStack.Size() - 2;
+    std::swap( a_forth.m_dataStack.At( tos1),
+      a_forth.m_dataStack.At( tos1 + 1));
   }
 
   void
   Runtime::IntrDup(
     Runtime &a_forth)
   {
-    if ( a_forth.m_dataStack.size() == 0)
+    if ( a_forth.m_dataStack.Size() == 0)
       throw StackUnderflow( "Dup");
-    size_t tos = a_forth.m_dataStack.size() - 1;
-    a_forth.PushDataNoExec( a_forth.m_dataStack[tos]);
+    size_t tos = a_forth.m_dataStack.Size() - 1;
+    a_forth.PushDataNoExec( a_forth.m_dataStack.At( tos));
   }
 
   void
@@ -332,12 +1509,12 @@ namespace forth
   Runtime::IntrLoop(
     Runtime &a_forth)
   {
-    if ( a_forth.m_dataStack.size() == 0)
+    if ( a_forth.m_dataStack.Size() == 0)
       throw StackUnderflow( "Dup");
-    size_t tos = a_forth.m_dataStack.size() - 1;
+    size_t tos = a_forth.m_dataStack.Size() - 1;
 
     // We check the value for being non-zero
-    Cell v = a_forth.m_dataStack[tos];
+    Cell v = a_forth.m_dataStack.At( tos);
     if (v == 0)
     {
       // If it is zero, drop it and continue with the next instruction
@@ -346,7 +1523,7 @@ namespace forth
     else
     {
       // Start at the beginning of the line
-      a_forth.m_ipCol = 0;
+      a_forth.m_ip = a_forth.m_view.m_lines[a_forth.m_ipLine].m_offset;
     }
   }
 
@@ -357,7 +1534,7 @@ namespace forth
     Cell v = a_forth.PopData();
 
     if (0 <= v && v < 255)
-      std::cout << char(v);
+      a_forth.m_output.Put( char(v));
   }
 
   void
@@ -366,7 +1543,27 @@ namespace forth
   {
     char c;
 
-    std::cin >> c;
+    // Show any prompt before waiting for input
+    a_forth.FlushOutput();
+    if ( a_forth.m_input == NULL)
+      std::cin >> c;
+    else
+    {
+      // Don't block on a queue. Whoever runs us tries again later.
+      switch ( a_forth.m_input->TryRead( c))
+      {
+        case InputQueue::kRead:
+          break;
+
+        case InputQueue::kEmpty:
+          a_forth.m_waiting = true;
+          return;
+
+        case InputQueue::kClosed:
+          a_forth.PushDataNoExec( -1);
+          return;
+      }
+    }
 
     // We can't use PushData here or every * will trigger something
     a_forth.PushDataNoExec( c);
@@ -376,21 +1573,21 @@ namespace forth
   Runtime::IntrExit(
     Runtime &a_forth)
   {
-    Cell v = a_forth.PopData();
-
-    exit( v);
+    // Stop the program. Whoever runs it decides what to do with the code.
+    a_forth.m_exitCode = a_forth.PopData();
+    a_forth.m_exited = true;
   }
 
   void
   Runtime::IntrOver(
     Runtime &a_forth)
   {
-    if ( a_forth.m_dataStack.size() < 2)
+    if ( a_forth.m_dataStack.Size() < 2)
       throw StackUnderflow( "Over");
 
     // Get the index of the value below the top of the stack
-    size_t tos1 = a_forth.m_dataStack.size() - 2;
-    a_forth.PushDataNoExec( a_forth.m_dataStack[tos1]);
+    size_t tos1 = a_forth.m_dataStack.Size() - 2;
+    a_forth.PushDataNoExec( a_forth.m_dataStack.At( tos1));
   }
 
   void
@@ -400,10 +1597,167 @@ namespace forth
     m_filename = a_filename;
   }
 
+  void
+  Runtime::FlushOutput()
+  {
+    // Anything the host printed through std::cout comes first
+    if ( !m_output.IsCapturing())
+      std::cout.flush();
+    m_output.Flush();
+  }
+
+  void
+  Runtime::SetOutputCapture(
+    std::string * a_capture)
+  {
+    FlushOutput();
+    m_output.SetCapture( a_capture);
+  }
+
+  void
+  Runtime::SetOutputFile(
+    int a_fd)
+  {
+    FlushOutput();
+    m_output.SetFile( a_fd);
+  }
+
+  void
+  Runtime::SetLineBuffered(
+    bool a_lineBuffered)
+  {
+    m_output.SetLineBuffered( a_lineBuffered);
+  }
+
+  std::vector<Runtime::Cell>
+  Runtime::Call(
+    size_t a_line,
+    const std::vector<Cell> &a_input,
+    uint64_t a_maxSteps)
+  {
+    m_dataStack.Clear();
+    for (size_t i = 0; i < a_input.size(); ++i)
+      PushDataNoExec( a_input[i]);
+    m_exited = false;
+    m_waiting = false;
+
+    if ( a_line < static_cast<size_t>( kOpCodeFirstUser))
+    {
+      // Intrinsics don't need the engine
+      kIntrinsics[ a_line]( *this);
+      FlushOutput();
+    }
+    else
+    {
+      if ( !m_program->IsSealed())
+        Seal();
+      if ( a_line >= m_view.m_lineCount)
+        a_line = kOpCodeFirstUser;
+
+      size_t hostDepth = m_hostDepth;
+      PushReturn( kHostFrame);
+      m_hostDepth = m_returnStack.Size();
+      ResetIp( a_line);
+      RunResult result;
+      try
+      {
+        result = a_maxSteps ? Run( a_maxSteps) : Run();
+      }
+      catch (...)
+      {
+        m_hostDepth = hostDepth;
+        throw;
+      }
+      if ( result.m_status == RunResult::kStepLimit)
+      {
+        m_hostDepth = hostDepth;
+        std::ostringstream str;
+        str << m_filename << "(" << m_ipLine << "): step limit exceeded";
+        throw StepLimitExceeded( str.str().c_str());
+      }
+      if ( result.m_status == RunResult::kWaitingForInput)
+      {
+        m_hostDepth = hostDepth;
+        std::ostringstream str;
+        str << m_filename << "(" << m_ipLine << "): no input to read";
+        throw std::runtime_error( str.str().c_str());
+      }
+
+      // An exited program leaves its frames behind
+      m_returnStack.SetSize( m_hostDepth - 1);
+      m_hostDepth = hostDepth;
+    }
+    return GetDataStack();
+  }
+
+  void
+  Runtime::SetInput(
+    InputQueue * a_input)
+  {
+    m_input = a_input;
+  }
+
+  InputQueue *
+  Runtime::GetInput() const
+  {
+    return m_input;
+  }
+
+  void
+  Runtime::SetMemoization(
+    size_t a_entries)
+  {
+    delete m_memo;
+    m_memo = (a_entries != 0) ? new MemoCache( a_entries) : NULL;
+  }
+
+  const MemoCache *
+  Runtime::GetMemoCache() const
+  {
+    return m_memo;
+  }
+
+  void
+  Runtime::SetJit(
+    uint32_t a_threshold)
+  {
+    delete m_jit;
+    m_jit = (a_threshold != 0) ? new Jit( a_threshold) : NULL;
+  }
+
+  const Jit *
+  Runtime::GetJit() const
+  {
+    return m_jit;
+  }
+
+  void
+  Runtime::SetStackGuard(
+    bool a_guard)
+  {
+    if ( a_guard)
+      pthread_once( &g_installOnce, InstallFaultHandler);
+    m_dataStack.SetGuarded( a_guard);
+    m_returnStack.SetGuarded( a_guard);
+    m_stackGuard = a_guard;
+  }
+
+  bool
+  Runtime::HasExited() const
+  {
+    return m_exited;
+  }
+
+  Runtime::Cell
+  Runtime::GetExitCode() const
+  {
+    return m_exitCode;
+  }
+
   size_t
   Runtime::CountProgramLines()
   {
-    return m_program.size();
+    return m_view.m_lineCount;
   }
 
   size_t
@@ -411,7 +1765,7 @@ namespace forth
     size_t a_row)
   {
     assert( a_row < CountProgramLines());
-    return m_program[a_row].size();
+    return m_view.m_lines[a_row].m_length;
   }
 
   bool
@@ -419,14 +1773,15 @@ namespace forth
     size_t a_row,
     size_t a_col)
   {
-    return (m_ipLine == a_row) && (m_ipCol == a_col);
+    return (m_ipLine == a_row) && (a_row < m_view.m_lineCount) &&
+           (m_ip == m_view.m_lines[a_row].m_offset + a_col);
   }
 
-  const std::vector<Runtime::Cell> &
-
+  std::vector<Runtime::Cell>
   Runtime::GetDataStack() const
   {
-    return m_dataStack;
+    return std::vector<Cell>( m_dataStack.Bottom(),
+      m_dataStack.Bottom() + m_dataStack.Size());
   }
 
 }
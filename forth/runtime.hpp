@@ -5,6 +5,15 @@
 #include <stdint.h>
 #include <cstdlib>
 #include <stdexcept>
+#include <string>
+
+#include "fixed_stack.hpp"
+#include "input_queue.hpp"
+#include "instruction.hpp"
+#include "jit.hpp"
+#include "memo_cache.hpp"
+#include "output_buffer.hpp"
+#include "program.hpp"
 
 namespace forth
 {
@@ -20,6 +29,11 @@ namespace forth
    * the top number from the stack and try to execute the respective line from
    * the program memory.
    *
+   * The program memory is a Program. Runtimes can share one, each of them
+   * only owns its stacks, the instruction pointer and the output. Thus, a
+   * runtime is the execution context of a program. Changing a shared program
+   * gives the runtime a copy of its own first.
+   *
    * The first few lines are not user-programmable. They represent the basic
    * operations (e.g. adding numbers). These intrinsics are the basic building
    * blocks of the programs.
@@ -29,7 +43,7 @@ namespace forth
     public:
 
       /// Contents of the data stack
-      typedef int32_t Cell;
+      typedef Program::Cell Cell;
 
       /** @name Constants for the instrinsics. */
       /*@{*/
@@ -89,6 +103,47 @@ namespace forth
       static const Cell kOpCodeCall;
       /*@}*/
 
+      /// Location of a line inside the code segment
+      typedef Program::Line Line;
+
+      /** Entry of the return stack. It holds the index of the instruction to
+       * continue with, the line is recovered from the line table.
+       */
+      typedef size_t Frame;
+
+      /// Outcome of running a program
+      struct RunResult
+      {
+        /// Reasons to stop running
+        enum Status
+        {
+          /// The program called the exit intrinsic
+          kExited,
+
+          /// The line passed to Call has returned
+          kReturned,
+
+          /** The step limit passed to Run has been reached. Run again to
+           * continue.
+           */
+          kStepLimit,
+
+          /** The read intrinsic found the input queue empty. Run again once
+           * there is input, the read is repeated first.
+           */
+          kWaitingForInput
+        };
+
+        /// Why the program stopped
+        Status m_status;
+
+        /// Exit code of the program
+        Cell m_code;
+
+        /// Number of steps done, only counted by Run with a step limit
+        uint64_t m_steps;
+      };
+
       /// Exception to be thrown when a taking a number from an empty stack.
       class StackUnderflow : public std::runtime_error
       {
@@ -102,8 +157,46 @@ namespace forth
 
       };
 
-      /// Construct a runtime instance
-      Runtime();
+      /// Exception to be thrown when pushing a number onto a full stack.
+      class StackOverflow : public std::runtime_error
+      {
+        public:
+
+          StackOverflow(
+            const char * a_what)
+            : std::runtime_error( a_what)
+          {
+          }
+
+      };
+
+      /// Exception to be thrown when Call runs out of steps.
+      class StepLimitExceeded : public std::runtime_error
+      {
+        public:
+
+          StepLimitExceeded(
+            const char * a_what)
+            : std::runtime_error( a_what)
+          {
+          }
+
+      };
+
+      /// Default maximal number of items on the data stack
+      static const size_t kDefaultDataStackDepth;
+
+      /// Default maximal number of frames on the return stack
+      static const size_t kDefaultReturnStackDepth;
+
+      /** Construct a runtime instance. The stacks are allocated once. The
+       * data stack holds at most a_dataStackDepth numbers, the return stack
+       * at most a_returnStackDepth frames.
+       */
+      explicit
+      Runtime(
+        size_t a_dataStackDepth = kDefaultDataStackDepth,
+        size_t a_returnStackDepth = kDefaultReturnStackDepth);
 
       /// Destruct a runtime instance
       ~Runtime();
@@ -122,10 +215,10 @@ namespace forth
       PushDataNoExec(
         Cell a_data);
 
-      /// Push a number onto the return stack
+      /// Push a frame onto the return stack
       void
       PushReturn(
-        Cell a_data);
+        Frame a_frame);
 
       /// Add a number to a given line
       void
@@ -133,20 +226,234 @@ namespace forth
         size_t a_row,
         Cell a_number);
 
-      /// Set the instruction pointer to the first number in a given line
+      /** Pack all lines of the program into one contiguous block of memory
+       * and decode it for Run.
+       *
+       * Compiling to any line but the last one moves that line to the end of
+       * the code segment. Sealing removes the holes these moves leave
+       * behind. The parser seals the program once it is done, Run seals it
+       * if required.
+       *
+       * Moving lines invalidates the addresses on the return stack.
+       */
+      void
+      Seal();
+
+      /** Load a precompiled program image, replacing the current program.
+       *
+       * The image is mapped and executed in place, nothing is parsed or
+       * decoded. Compiling to the loaded program copies it into memory of
+       * its own first. If the image has been decoded by an interpreter with
+       * a different set of operations, it is decoded again.
+       */
+      void
+      LoadImage(
+        const char * a_filename);
+
+      /** Execute the program of another runtime. The program is shared, not
+       * copied, until one of the runtimes changes it. The stacks and the file
+       * name are not shared.
+       *
+       * Seal the program before sharing it with runtimes on other threads.
+       */
+      void
+      ShareProgram(
+        const Runtime &a_other);
+
+      /// Seal the program and write it as an image
+      void
+      WriteImage(
+        const char * a_filename);
+
+      /** Seal the program and write it as C++ source for a native build,
+       * see CppWriter.
+       */
+      void
+      WriteCpp(
+        const char * a_filename);
+
+      /** Seal the program and check if it underflows the data stack for
+       * certain once started, see StackEffect::FindUnderflow. Returns a
+       * message for each problem found.
+       */
+      std::vector<std::string>
+      Lint();
+
+      /** Set the instruction pointer to the first number in a given line.
+       * This also restarts a program that has exited.
+       */
       void
       ResetIp(
         size_t a_line = kOpCodeFirstUser);
 
-      /// Perform one step of computation.
+      /** Select if Run uses superinstructions and inlines short lines.
+       * Fusion is on by default, the superinstructions used are selected at
+       * build time.
+       *
+       * Inlining has no switch of its own, it is on exactly when fusion is.
+       * Both change how Run(uint64_t) counts the steps, so a program
+       * without fusion counts them like the code segment reads. An image
+       * saved without kImageFused is loaded without inlining as well.
+       */
+      void
+      SetFusion(
+        bool a_fuse);
+
+      /** Perform one step of computation. Once the program has exited, this
+       * does nothing.
+       */
       void
       ComputeStep();
 
+      /** Run the program from the current IP until it exits.
+       *
+       * This is the fast path. It performs the same computation as repeated
+       * calls of ComputeStep, but keeps the machine state in local variables
+       * and dispatches the intrinsics directly. Use ComputeStep for single
+       * stepping.
+       *
+       * The output is flushed before returning. A program without a first
+       * line exits with code 0 right away.
+       */
+      RunResult
+      Run();
+
+      /** Run the program like Run does, but stop once a_maxSteps steps have
+       * been done. A step is one instruction of the decoded program, i.e.
+       * a superinstruction counts once and the call of an inlined line
+       * takes no step for its return. The state is kept, so running again
+       * continues where the program stopped.
+       *
+       * The result holds the number of steps done. Errors are reported by
+       * exceptions like Run does.
+       */
+      RunResult
+      Run(
+        uint64_t a_maxSteps);
+
+      /** Call a line of the program like a function and return the data
+       * stack it leaves behind.
+       *
+       * The data stack is replaced by a_input, bottom first. A frame that
+       * returns to the caller is pushed onto the return stack, then the line
+       * is run like Run does until it returns to that frame or the program
+       * exits. Lines outside the program call the first user line.
+       *
+       * If the program fails, the exception is passed on and the stacks are
+       * left as they are. If a_maxSteps is not 0, StepLimitExceeded is
+       * thrown once the line has done that many steps. Call doesn't wait for
+       * input, reading from an empty queue fails.
+       */
+      std::vector<Cell>
+      Call(
+        size_t a_line,
+        const std::vector<Cell> &a_input,
+        uint64_t a_maxSteps = 0);
+
+      /** Read from a queue instead of stdin. Pass NULL to read from stdin
+       * again. A read from an empty queue stops Run, see
+       * RunResult::kWaitingForInput. At the end of the input, read pushes -1.
+       */
+      void
+      SetInput(
+        InputQueue * a_input);
+
+      /// Get the queue set by SetInput
+      InputQueue *
+      GetInput() const;
+
+      /** Let Run answer calls of pure lines from a cache of a_entries
+       * results, see MemoCache. Pass 0 to turn it off, which is the default.
+       *
+       * Only calls by constant opcodes are memoized. A call answered from
+       * the cache counts as one step.
+       */
+      void
+      SetMemoization(
+        size_t a_entries);
+
+      /// Get the cache of SetMemoization, NULL if memoization is off
+      const MemoCache *
+      GetMemoCache() const;
+
+      /** Let Run compile a line to native code once it has been entered
+       * a_threshold times, see Jit. Pass 0 to turn it off, which is the
+       * default. Without support for the CPU, all lines are interpreted.
+       *
+       * Run with a step limit interprets all lines, so it can count steps.
+       */
+      void
+      SetJit(
+        uint32_t a_threshold);
+
+      /// Get the compiler of SetJit, NULL if it is off
+      const Jit *
+      GetJit() const;
+
+      /** Move the stacks between guard pages, see FixedStack::SetGuarded,
+       * and let Run find full stacks by the fault in the upper guard page.
+       * Run then leaves out its checks for a full stack and turns the fault
+       * into the usual StackOverflow. Off by default, the stacks are plain
+       * memory then. Call it between runs, the stacks keep their items.
+       *
+       * Run still checks for too few items. The top of the data stack is
+       * kept in a register, so an operation on an empty stack may not touch
+       * memory at all. A fault in the lower guard page is only reached by
+       * code that skips a check, e.g. the unchecked copy of a line
+       * StackEffect got wrong. It is reported as a StackUnderflow.
+       *
+       * The top of the data stack only faults once it is written to memory,
+       * so Run may hold one item more than the capacity for a while. The
+       * stacks are cleared after a fault, as Run kept their state in
+       * registers. The location in the message is where Run last stored its
+       * state.
+       *
+       * The first call installs a handler of SIGSEGV for the process.
+       * Faults anywhere else are passed on to the handler it replaced.
+       */
+      void
+      SetStackGuard(
+        bool a_guard);
+
+      /// Check if the program has called the exit intrinsic
+      bool
+      HasExited() const;
+
+      /// Get the code the program has exited with
+      Cell
+      GetExitCode() const;
+
       /// Set the name of the source file for error messages.
       void
       SetFileName(
         const char * a_filename);
 
+      /** Write the characters the program printed so far. Output is
+       * buffered and flushed when the buffer is full, before reading input,
+       * at exit, and when the runtime is destructed.
+       */
+      void
+      FlushOutput();
+
+      /// Flush the output and print to another file descriptor from now on
+      void
+      SetOutputFile(
+        int a_fd);
+
+      /** Flush the output and collect it in a string from now on. Pass NULL
+       * to print to the output file again.
+       */
+      void
+      SetOutputCapture(
+        std::string * a_capture);
+
+      /** Select if each newline flushes the output. This is the default if
+       * the output is a terminal.
+       */
+      void
+      SetLineBuffered(
+        bool a_lineBuffered);
+
       /// Get the number of lines in the program
       size_t
       CountProgramLines();
@@ -162,33 +469,128 @@ namespace forth
         size_t a_row,
         size_t a_col);
 
-      /// Access the data stack read-only
-      const std::vector<Cell> &
-
+      /// Get a copy of the data stack, bottom first
+      std::vector<Cell>
       GetDataStack() const;
 
     protected:
 
       /// Return stack
-      std::vector<size_t> m_returnStack;
+      FixedStack<Frame> m_returnStack;
 
       /// Data stack
-      std::vector<Cell> m_dataStack;
+      FixedStack<Cell> m_dataStack;
 
       /// File name for error messages
       std::string m_filename;
 
-      /// Program memory
-      std::vector< std::vector< Cell> > m_program;
+      /// Program memory, possibly shared with other runtimes
+      Program * m_program;
+
+      /// Program as seen by execution
+      typedef Program::View View;
+
+      /// Copy of the view of the program, refreshed when it changes
+      View m_view;
+
+      /// Characters printed by the program
+      OutputBuffer m_output;
+
+      /// Flag if the program has called the exit intrinsic
+      bool m_exited;
+
+      /// Code passed to the exit intrinsic
+      Cell m_exitCode;
+
+      /** Get the program to change it. A shared program is copied first.
+       * Pass the result of GetIpColumn to UpdateView afterwards.
+       */
+      Program &
+      EditProgram();
+
+      /// Frame pushed by Call to return to the caller
+      static const Frame kHostFrame;
+
+      /** Depth of the return stack just above the frame pushed by Call, 0 if
+       * no call is running. Returning at this depth leaves Run.
+       */
+      size_t m_hostDepth;
+
+      /// Queue to read from, NULL for stdin
+      InputQueue * m_input;
+
+      /// Flag if the read intrinsic found the input queue empty
+      bool m_waiting;
+
+      /// Results of pure lines, NULL if memoization is off
+      MemoCache * m_memo;
+
+      /// Compiler of hot lines, NULL if it is off
+      Jit * m_jit;
+
+      /// Flag if the stacks are guarded, see SetStackGuard
+      bool m_stackGuard;
+
+      /// Column returned by GetIpColumn if the IP is outside the program
+      static const size_t kNoColumn;
+
+      /// Get the column of the IP in its line
+      size_t
+      GetIpColumn() const;
+
+      /** Refresh the view after the program has changed. The IP is moved to
+       * the given column of its line, which may have moved. It is left
+       * alone for kNoColumn.
+       */
+      void
+      UpdateView(
+        size_t a_ipColumn);
+
+      /** Run the variant of Execute selected by the settings, with a step
+       * limit if a_limited is set
+       */
+      template <bool t_guard>
+      RunResult
+      RunEngine(
+        bool a_limited,
+        uint64_t a_maxSteps);
+
+      /// Run the engine with faults in the guard pages turned into errors
+      RunResult
+      RunGuarded(
+        bool a_limited,
+        uint64_t a_maxSteps);
+
+      /// Report a fault at an address in the guard pages of the stacks
+      void
+      ReportStackFault(
+        const void * a_address);
+
+      /** Engine of Run. Counts the steps and stops after a_maxSteps if
+       * t_limited is set. Uses the memo cache if t_memo is set, and native
+       * code if t_jit is set. Leaves full stacks to the guard pages if
+       * t_guard is set. The other variants don't pay for it.
+       */
+      template <bool t_limited, bool t_memo, bool t_jit, bool t_guard>
+      RunResult
+      Execute(
+        uint64_t a_maxSteps);
 
       /// Take one number from the data stack
       Cell
       PopData();
 
-      /// Take one number from the return stack
-      size_t
+      /// Take one frame from the return stack
+      Frame
       PopReturn();
 
+      /** Find the line an index into the code segment belongs to. The spare
+       * slot counts as part of its line.
+       */
+      size_t
+      FindLine(
+        size_t a_index) const;
+
       /// Execute the opcode
       void
       DoOpcode(
@@ -281,11 +683,16 @@ namespace forth
       IntrOver(
         Runtime &a_forth);
 
-      /// Instruction pointer, the line we're currently executing
+      /// The line we're currently executing
       size_t m_ipLine;
 
-      /// Instruction pointer, the index into the current line
-      size_t m_ipCol;
+      /** The line started on an empty return stack. Tail calls leave no
+       * frame, so a return from the bottom ends this line as written.
+       */
+      size_t m_bottomLine;
+
+      /// Instruction pointer, the index into the code segment
+      size_t m_ip;
   };
 
 }
@@ -0,0 +1,243 @@
+#include <stdexcept>
+
+#include "scheduler.hpp"
+
+namespace forth
+{
+  const uint64_t Scheduler::kDefaultQuantum = 10000;
+
+  Scheduler::Scheduler(
+    size_t a_workers,
+    uint64_t a_quantum)
+    : m_quantum( a_quantum)
+    , m_pending( 0)
+    , m_queued( 0)
+    , m_sleepers( 0)
+    , m_nextWorker( 0)
+    , m_stop( false)
+  {
+    pthread_mutex_init( &m_mutex, NULL);
+    pthread_cond_init( &m_work, NULL);
+    pthread_cond_init( &m_done, NULL);
+
+    // Create all queues before any worker looks for tasks to steal
+    for (size_t i = 0; i < a_workers || i == 0; ++i)
+    {
+      Worker * worker = new Worker;
+      worker->m_scheduler = this;
+      worker->m_index = i;
+      pthread_mutex_init( &worker->m_mutex, NULL);
+      m_workers.push_back( worker);
+    }
+    for (size_t i = 0; i < m_workers.size(); ++i)
+      pthread_create( &m_workers[i]->m_thread, NULL, WorkerMain,
+        m_workers[i]);
+  }
+
+  Scheduler::~Scheduler()
+  {
+    pthread_mutex_lock( &m_mutex);
+    m_stop = true;
+    pthread_cond_broadcast( &m_work);
+    pthread_mutex_unlock( &m_mutex);
+
+    for (size_t i = 0; i < m_workers.size(); ++i)
+    {
+      pthread_join( m_workers[i]->m_thread, NULL);
+      pthread_mutex_destroy( &m_workers[i]->m_mutex);
+      delete m_workers[i];
+    }
+    for (size_t i = 0; i < m_tasks.size(); ++i)
+      delete m_tasks[i];
+
+    pthread_cond_destroy( &m_done);
+    pthread_cond_destroy( &m_work);
+    pthread_mutex_destroy( &m_mutex);
+  }
+
+  size_t
+  Scheduler::Spawn(
+    Runtime * a_runtime)
+  {
+    Task * task = new Task;
+    task->m_scheduler = this;
+    task->m_runtime = a_runtime;
+    task->m_failed = false;
+
+    pthread_mutex_lock( &m_mutex);
+    size_t index = m_tasks.size();
+    m_tasks.push_back( task);
+    ++m_pending;
+    pthread_mutex_unlock( &m_mutex);
+
+    Enqueue( task, __sync_fetch_and_add( &m_nextWorker, 1));
+    return index;
+  }
+
+  void
+  Scheduler::Wait()
+  {
+    pthread_mutex_lock( &m_mutex);
+    while ( m_pending != 0)
+      pthread_cond_wait( &m_done, &m_mutex);
+    pthread_mutex_unlock( &m_mutex);
+  }
+
+  bool
+  Scheduler::HasFailed(
+    size_t a_task) const
+  {
+    return m_tasks[a_task]->m_failed;
+  }
+
+  std::string
+  Scheduler::GetError(
+    size_t a_task) const
+  {
+    return m_tasks[a_task]->m_error;
+  }
+
+  void
+  Scheduler::Enqueue(
+    Task * a_task,
+    size_t a_worker)
+  {
+    Worker &worker = *m_workers[a_worker % m_workers.size()];
+    pthread_mutex_lock( &worker.m_mutex);
+    worker.m_queue.push_back( a_task);
+    pthread_mutex_unlock( &worker.m_mutex);
+
+    // A worker checks m_queued after announcing that it goes to sleep. So
+    // either it sees this task, or we see it and wake it.
+    __sync_add_and_fetch( &m_queued, 1);
+    if ( __sync_add_and_fetch( &m_sleepers, 0) != 0)
+    {
+      pthread_mutex_lock( &m_mutex);
+      pthread_cond_signal( &m_work);
+      pthread_mutex_unlock( &m_mutex);
+    }
+  }
+
+  Scheduler::Task *
+  Scheduler::Dequeue(
+    size_t a_worker)
+  {
+    Task * task = NULL;
+
+    // Take the oldest own task, so each one gets its turn
+    Worker &self = *m_workers[a_worker];
+    pthread_mutex_lock( &self.m_mutex);
+    if ( !self.m_queue.empty())
+    {
+      task = self.m_queue.front();
+      self.m_queue.pop_front();
+    }
+    pthread_mutex_unlock( &self.m_mutex);
+
+    // Otherwise, steal the newest task of another worker
+    for (size_t i = 1; task == NULL && i < m_workers.size(); ++i)
+    {
+      Worker &victim = *m_workers[(a_worker + i) % m_workers.size()];
+      pthread_mutex_lock( &victim.m_mutex);
+      if ( !victim.m_queue.empty())
+      {
+        task = victim.m_queue.back();
+        victim.m_queue.pop_back();
+      }
+      pthread_mutex_unlock( &victim.m_mutex);
+    }
+
+    if ( task != NULL)
+      __sync_sub_and_fetch( &m_queued, 1);
+    return task;
+  }
+
+  void
+  Scheduler::RunTask(
+    Task * a_task,
+    size_t a_worker)
+  {
+    Runtime &runtime = *a_task->m_runtime;
+    Runtime::RunResult result;
+    try
+    {
+      result = runtime.Run( m_quantum);
+    }
+    catch (const std::exception &ex)
+    {
+      a_task->m_failed = true;
+      a_task->m_error = ex.what();
+      Finish();
+      return;
+    }
+
+    switch ( result.m_status)
+    {
+      case Runtime::RunResult::kStepLimit:
+        Enqueue( a_task, a_worker);
+        break;
+
+      case Runtime::RunResult::kWaitingForInput:
+        // The queue wakes us, unless there is input already
+        if ( !runtime.GetInput()->Park( WakeTask, a_task))
+          Enqueue( a_task, a_worker);
+        break;
+
+      case Runtime::RunResult::kExited:
+      case Runtime::RunResult::kReturned:
+        Finish();
+        break;
+    }
+  }
+
+  void
+  Scheduler::Finish()
+  {
+    pthread_mutex_lock( &m_mutex);
+    if ( --m_pending == 0)
+      pthread_cond_broadcast( &m_done);
+    pthread_mutex_unlock( &m_mutex);
+  }
+
+  void *
+  Scheduler::WorkerMain(
+    void * a_worker)
+  {
+    Worker &worker = *static_cast<Worker *>( a_worker);
+    Scheduler &scheduler = *worker.m_scheduler;
+
+    for (;; )
+    {
+      Task * task = scheduler.Dequeue( worker.m_index);
+      if ( task != NULL)
+      {
+        scheduler.RunTask( task, worker.m_index);
+        continue;
+      }
+
+      // Sleep until there is something to do
+      pthread_mutex_lock( &scheduler.m_mutex);
+      __sync_add_and_fetch( &scheduler.m_sleepers, 1);
+      while ( !scheduler.m_stop &&
+              __sync_add_and_fetch( &scheduler.m_queued, 0) == 0)
+        pthread_cond_wait( &scheduler.m_work, &scheduler.m_mutex);
+      __sync_sub_and_fetch( &scheduler.m_sleepers, 1);
+      bool stop = scheduler.m_stop;
+      pthread_mutex_unlock( &scheduler.m_mutex);
+
+      if ( stop)
+        break;
+    }
+    return NULL;
+  }
+
+  void
+  Scheduler::WakeTask(
+    void * a_task)
+  {
+    Task * task = static_cast<Task *>( a_task);
+    Scheduler &scheduler = *task->m_scheduler;
+    scheduler.Enqueue( task, __sync_fetch_and_add( &scheduler.m_nextWorker, 1));
+  }
+
+}
@@ -0,0 +1,182 @@
+#ifndef FORTH_SCHEDULER_H
+#define FORTH_SCHEDULER_H
+
+#include <deque>
+#include <string>
+#include <vector>
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include "runtime.hpp"
+
+namespace forth
+{
+  /** Run many runtimes on a fixed pool of worker threads.
+   *
+   * Each runtime runs for a quantum of steps, then it is put back into a
+   * run queue, so all of them make progress. Each worker has a queue of its
+   * own. A worker without anything to do steals from the others.
+   *
+   * A runtime that reads from an empty InputQueue is parked at that queue.
+   * It doesn't occupy a worker until characters are pushed or the queue is
+   * closed.
+   *
+   * The runtimes are not owned by the scheduler. Seal their programs before
+   * spawning them, and don't touch them until Wait has returned.
+   */
+  class Scheduler
+  {
+    public:
+
+      /// Default number of steps a runtime runs before the next one's turn
+      static const uint64_t kDefaultQuantum;
+
+      /** Start a_workers worker threads. Each runtime runs for a_quantum
+       * steps at a time.
+       */
+      explicit
+      Scheduler(
+        size_t a_workers,
+        uint64_t a_quantum = kDefaultQuantum);
+
+      /** Stop the worker threads. Runtimes that haven't finished are left
+       * where they are.
+       */
+      ~Scheduler();
+
+      /** Run a runtime from its IP until it exits or fails. Returns the
+       * index of the task to ask for its outcome.
+       */
+      size_t
+      Spawn(
+        Runtime * a_runtime);
+
+      /// Wait until all spawned runtimes have exited or failed
+      void
+      Wait();
+
+      /// Check if a task has been stopped by an exception
+      bool
+      HasFailed(
+        size_t a_task) const;
+
+      /// Get the message of the exception that stopped a task
+      std::string
+      GetError(
+        size_t a_task) const;
+
+    private:
+
+      /// Runtime and its outcome
+      struct Task
+      {
+        /// Scheduler running the task
+        Scheduler * m_scheduler;
+
+        /// Runtime to run
+        Runtime * m_runtime;
+
+        /// Flag if an exception stopped the runtime
+        bool m_failed;
+
+        /// Message of that exception
+        std::string m_error;
+      };
+
+      /// Run queue of a worker thread
+      struct Worker
+      {
+        /// Scheduler of the worker
+        Scheduler * m_scheduler;
+
+        /// Index of the worker
+        size_t m_index;
+
+        /// Thread executing the worker
+        pthread_t m_thread;
+
+        /// Protects m_queue
+        pthread_mutex_t m_mutex;
+
+        /// Tasks ready to run, the owner takes the front, thieves the back
+        std::deque<Task *> m_queue;
+      };
+
+      /// Steps per turn
+      uint64_t m_quantum;
+
+      /// Worker threads
+      std::vector<Worker *> m_workers;
+
+      /// All tasks ever spawned, guarded by m_mutex
+      std::vector<Task *> m_tasks;
+
+      /// Number of tasks not done yet, guarded by m_mutex
+      size_t m_pending;
+
+      /// Number of tasks in the run queues
+      size_t m_queued;
+
+      /// Number of workers sleeping or about to sleep
+      size_t m_sleepers;
+
+      /// Worker to queue the next task from outside at
+      size_t m_nextWorker;
+
+      /// Flag to stop the workers, guarded by m_mutex
+      bool m_stop;
+
+      /// Protects the members above and the conditions below
+      pthread_mutex_t m_mutex;
+
+      /// Signalled when tasks are queued
+      pthread_cond_t m_work;
+
+      /// Signalled when the last task is done
+      pthread_cond_t m_done;
+
+      /// Put a task into the queue of a worker
+      void
+      Enqueue(
+        Task * a_task,
+        size_t a_worker);
+
+      /// Take a task from the own queue or steal one, NULL if there is none
+      Task *
+      Dequeue(
+        size_t a_worker);
+
+      /// Run a task for one quantum and decide where it goes next
+      void
+      RunTask(
+        Task * a_task,
+        size_t a_worker);
+
+      /// Count a task as done, the task keeps its own outcome
+      void
+      Finish();
+
+      /// Loop of a worker thread
+      static void *
+      WorkerMain(
+        void * a_worker);
+
+      /// Wake function for a task parked at an input queue
+      static void
+      WakeTask(
+        void * a_task);
+
+      /// No copies
+      Scheduler(
+        const Scheduler &);
+
+      /// No assignment
+      Scheduler &
+      operator=(
+        const Scheduler &);
+  };
+
+}
+
+#endif
@@ -0,0 +1,333 @@
+#include <algorithm>
+#include <utility>
+
+#include "stack_effect.hpp"
+
+namespace forth
+{
+  namespace
+  {
+    /// Depth an intrinsic needs and how it changes the depth
+    struct IntrinsicEffect
+    {
+      long m_need;
+      long m_effect;
+    };
+
+    /// Effects of the intrinsics, by opcode
+    const IntrinsicEffect kIntrinsicEffects[] =
+    {
+      { 2, -1 },  // plus
+      { 2, -1 },  // minus
+      { 2, -1 },  // mult
+      { 2, -1 },  // div
+      { 2, -1 },  // mod
+      { 2, -1 },  // and
+      { 2, -1 },  // or
+      { 1, 0 },   // not
+      { 2, 0 },   // swap
+      { 1, 1 },   // dup
+      { 1, -1 },  // drop
+      { 1, -1 },  // loop, if it drops the zero
+      { 1, -1 },  // emit
+      { 0, 1 },   // read
+      { 1, -1 },  // exit
+      { 2, 1 },   // over
+    };
+
+    /** Most instructions FindUnderflow follows. Recursion without a loop or
+     * a computed call doesn't end.
+     */
+    const size_t kMaxFollowed = 1 << 16;
+  }
+
+  const uint32_t StackEffect::kUnknown = 0xffffffff;
+
+  void
+  StackEffect::Analyze(
+    const Runtime::Cell * a_code,
+    size_t a_codeSize,
+    const Runtime::Line * a_lines,
+    size_t a_lineCount,
+    std::vector<Summary> &a_summaries,
+    std::vector<uint32_t> &a_needs)
+  {
+    Summary unproven = { false, 0, 0 };
+    a_summaries.assign( a_lineCount, unproven);
+    a_needs.assign( a_codeSize, kUnknown);
+
+    // Intrinsics are executed in place, they are never called as lines
+    std::vector<State> states( a_lineCount, kUnvisited);
+    for (size_t row = Runtime::kOpCodeFirstUser; row < a_lineCount; ++row)
+    {
+      if (states[row] == kUnvisited)
+        AnalyzeLine( a_code, a_lines, a_lineCount, row, a_summaries, a_needs,
+          states);
+    }
+  }
+
+  bool
+  StackEffect::FindUnderflow(
+    const Runtime::Cell * a_code,
+    const Runtime::Line * a_lines,
+    size_t a_lineCount,
+    size_t a_line,
+    size_t a_depth,
+    size_t &a_underflowLine)
+  {
+    // Lines to return to, with the instruction to go on with
+    std::vector<std::pair<size_t, size_t> > frames;
+    std::vector<Step> steps;
+    size_t row = a_line;
+    size_t next = 0;
+    long depth = static_cast<long>( a_depth);
+    DecodeLine( a_code, a_lines[row], a_lineCount, steps);
+
+    for (size_t count = 0; count < kMaxFollowed; ++count)
+    {
+      if (next == steps.size())
+      {
+        // The line entered returns, nothing is known about its caller
+        if (frames.empty())
+          return false;
+        row = frames.back().first;
+        next = frames.back().second;
+        frames.pop_back();
+        DecodeLine( a_code, a_lines[row], a_lineCount, steps);
+        continue;
+      }
+
+      const Step &step = steps[next++];
+      if (depth < step.m_need)
+      {
+        a_underflowLine = row;
+        return true;
+      }
+
+      switch (step.m_kind)
+      {
+        case kStepLoop:
+        case kStepComputed:
+        case kStepExit:
+          // What follows depends on the numbers on the stack
+          return false;
+
+        case kStepCall:
+          // A call in the last position doesn't return to the line
+          if (next < steps.size())
+            frames.push_back( std::make_pair( row, next));
+          row = step.m_target;
+          next = 0;
+          DecodeLine( a_code, a_lines[row], a_lineCount, steps);
+          break;
+
+        case kStepPlain:
+          depth += step.m_effect;
+          break;
+      }
+    }
+    return false;
+  }
+
+  void
+  StackEffect::DecodeLine(
+    const Runtime::Cell * a_code,
+    const Runtime::Line &a_line,
+    size_t a_lineCount,
+    std::vector<Step> &a_steps)
+  {
+    a_steps.clear();
+    size_t end = a_line.End();
+    size_t i = a_line.m_offset;
+    while (i < end)
+    {
+      // A literal unless it is followed by a call
+      Step step;
+      step.m_slot = i;
+      step.m_kind = kStepPlain;
+      step.m_need = 0;
+      step.m_effect = 1;
+      step.m_target = 0;
+      Runtime::Cell v = a_code[i];
+
+      if (v == Runtime::kOpCodeCall)
+      {
+        // The target is taken from the stack
+        step.m_kind = kStepComputed;
+        step.m_need = 1;
+        step.m_effect = -1;
+        ++i;
+      }
+      else if ( (i + 1 < end) && (a_code[i + 1] == Runtime::kOpCodeCall))
+      {
+        i += 2;
+        if (v < 0)
+        {
+          // Negative opcodes are ignored
+          step.m_effect = 0;
+        }
+        else if (v < Runtime::kOpCodeFirstUser)
+        {
+          // The opcodes behind over exit as well
+          Runtime::Cell opCode;
+          if (v > Runtime::kOpCodeOver)
+            opCode = Runtime::kOpCodeExit;
+          else
+            opCode = v;
+          step.m_need = kIntrinsicEffects[opCode].m_need;
+          step.m_effect = kIntrinsicEffects[opCode].m_effect;
+          if (opCode == Runtime::kOpCodeLoop)
+            step.m_kind = kStepLoop;
+          else if (opCode == Runtime::kOpCodeExit)
+            step.m_kind = kStepExit;
+        }
+        else
+        {
+          // Calls outside the program go back to the first line. The
+          // effect is the one of the line called.
+          step.m_kind = kStepCall;
+          step.m_effect = 0;
+          step.m_target = v;
+          if (step.m_target >= a_lineCount)
+            step.m_target = Runtime::kOpCodeFirstUser;
+        }
+      }
+      else
+        ++i;
+
+      a_steps.push_back( step);
+    }
+  }
+
+  void
+  StackEffect::AnalyzeLine(
+    const Runtime::Cell * a_code,
+    const Runtime::Line * a_lines,
+    size_t a_lineCount,
+    size_t a_line,
+    std::vector<Summary> &a_summaries,
+    std::vector<uint32_t> &a_needs,
+    std::vector<State> &a_states)
+  {
+    // Lines being visited, the innermost callee last. Calls may nest as
+    // deep as the program has lines, so they aren't followed by recursion.
+    std::vector<Visit> visits;
+    BeginVisit( a_code, a_lines, a_lineCount, a_line, a_states, visits);
+
+    while (!visits.empty())
+    {
+      Visit &visit = visits.back();
+
+      // Every line called has to be proven. One that is still being visited
+      // calls this line in turn.
+      if (visit.m_callees && (visit.m_next < visit.m_steps.size()))
+      {
+        Step &step = visit.m_steps[visit.m_next];
+        if (step.m_kind == kStepComputed)
+          visit.m_callees = false;
+        else if (step.m_kind == kStepCall)
+        {
+          // Come back to the call once the callee is done
+          if (a_states[step.m_target] == kUnvisited)
+          {
+            BeginVisit( a_code, a_lines, a_lineCount, step.m_target,
+              a_states, visits);
+            continue;
+          }
+
+          const Summary &callee = a_summaries[step.m_target];
+          if ( (a_states[step.m_target] != kDone) || !callee.m_proven)
+            visit.m_callees = false;
+          else
+          {
+            step.m_need = callee.m_need;
+            step.m_effect = callee.m_least;
+          }
+        }
+        ++visit.m_next;
+        continue;
+      }
+
+      if (visit.m_callees)
+        ProveLine( a_lines[visit.m_line], visit.m_steps,
+          a_summaries[visit.m_line], a_needs);
+      a_states[visit.m_line] = kDone;
+      visits.pop_back();
+    }
+  }
+
+  void
+  StackEffect::BeginVisit(
+    const Runtime::Cell * a_code,
+    const Runtime::Line * a_lines,
+    size_t a_lineCount,
+    size_t a_line,
+    std::vector<State> &a_states,
+    std::vector<Visit> &a_visits)
+  {
+    a_states[a_line] = kVisiting;
+    a_visits.push_back( Visit());
+    Visit &visit = a_visits.back();
+    visit.m_line = a_line;
+    visit.m_next = 0;
+    visit.m_callees = true;
+    DecodeLine( a_code, a_lines[a_line], a_lineCount, visit.m_steps);
+  }
+
+  bool
+  StackEffect::ProveLine(
+    const Runtime::Line &a_line,
+    std::vector<Step> &a_steps,
+    Summary &a_summary,
+    std::vector<uint32_t> &a_needs)
+  {
+    // Follow the depth relative to the entry, as far as it is known. A loop
+    // that restarts the line below the entry could take more each pass.
+    long depth = 0;
+    for (size_t i = 0; i < a_steps.size(); ++i)
+    {
+      if ( (a_steps[i].m_kind == kStepLoop) && (depth < 0))
+        return false;
+      depth += a_steps[i].m_effect;
+    }
+
+    // Going on behind a loop means it has dropped its zero, so the depth at
+    // the end is the least change of the line
+    long least = depth;
+
+    // The needs from the back. A loop that restarts the line needs what the
+    // start of the line needs. That is known after the first pass. As no
+    // loop restarts below the entry, the second pass doesn't change it.
+    std::vector<long> needs( a_steps.size());
+    long start = 0;
+    for (int pass = 0; pass < 2; ++pass)
+    {
+      long after = 0;
+      for (size_t i = a_steps.size(); i-- > 0; )
+      {
+        const Step &step = a_steps[i];
+        long need = std::max( step.m_need, after - step.m_effect);
+        if (step.m_kind == kStepLoop)
+          need = std::max( need, start);
+        needs[i] = need;
+        after = need;
+      }
+      start = after;
+    }
+
+    for (size_t i = 0; i < needs.size(); ++i)
+    {
+      if (needs[i] >= static_cast<long>( kUnknown))
+        return false;
+    }
+
+    a_summary.m_proven = true;
+    a_summary.m_need = static_cast<uint32_t>( start);
+    a_summary.m_least = static_cast<int32_t>( least);
+    for (size_t i = 0; i < a_steps.size(); ++i)
+      a_needs[a_steps[i].m_slot] = static_cast<uint32_t>( needs[i]);
+    a_needs[a_line.End()] = 0;
+    return true;
+  }
+
+}
@@ -0,0 +1,176 @@
+#ifndef FORTH_STACK_EFFECT_H
+#define FORTH_STACK_EFFECT_H
+
+#include <vector>
+#include <stdint.h>
+
+#include "runtime.hpp"
+
+namespace forth
+{
+  /** Static analysis of the depth of the data stack.
+   *
+   * The analysis follows each line the way the decoder does, through the
+   * intrinsics, constant calls and loops. A line is proven if the depth of
+   * the data stack at its entry decides whether any of its instructions can
+   * underflow. It is not if it makes a computed call, calls a line that
+   * isn't proven or calls itself, directly or indirectly. A loop that may
+   * leave the stack lower than it was at the start of the line isn't
+   * proven either, as each pass could take more.
+   *
+   * The functions are implemented as static members of the StackEffect
+   * struct, following the Decoder.
+   */
+  struct StackEffect
+  {
+    /// Effect of a line on the data stack
+    struct Summary
+    {
+      /// Flag if the line is proven, the counts below are valid only then
+      bool m_proven;
+
+      /// Depth the line needs at its entry so it can't underflow
+      uint32_t m_need;
+
+      /// Least change of the depth from the entry to the return
+      int32_t m_least;
+    };
+
+    /// Need of an instruction in a line that isn't proven
+    static const uint32_t kUnknown;
+
+    /** Analyze all lines of a program. a_summaries receives the summary of
+     * each line. a_needs receives for each slot of the code segment the
+     * depth an instruction starting there needs so the rest of its line
+     * can't underflow, or kUnknown.
+     */
+    static void
+    Analyze(
+      const Runtime::Cell * a_code,
+      size_t a_codeSize,
+      const Runtime::Line * a_lines,
+      size_t a_lineCount,
+      std::vector<Summary> &a_summaries,
+      std::vector<uint32_t> &a_needs);
+
+    /** Follow the program from a line entered with the given depth and
+     * check if it underflows the data stack for certain. Only the part
+     * that doesn't depend on the numbers on the stack is followed, i.e. up
+     * to the first loop, computed call or exit. Returns true and stores the
+     * line that underflows if it does.
+     */
+    static bool
+    FindUnderflow(
+      const Runtime::Cell * a_code,
+      const Runtime::Line * a_lines,
+      size_t a_lineCount,
+      size_t a_line,
+      size_t a_depth,
+      size_t &a_underflowLine);
+
+    protected:
+
+      /// Kinds of instructions the analysis tells apart
+      enum StepKind
+      {
+        /// Takes and leaves a fixed number of cells
+        kStepPlain,
+
+        /// Loop intrinsic
+        kStepLoop,
+
+        /// Call of a line by a constant opcode
+        kStepCall,
+
+        /// Call of a computed opcode
+        kStepComputed,
+
+        /// Exit intrinsic
+        kStepExit
+      };
+
+      /// One instruction of a line
+      struct Step
+      {
+        /// Slot the instruction starts at
+        size_t m_slot;
+
+        /// What the instruction does
+        StepKind m_kind;
+
+        /// Depth the instruction needs
+        long m_need;
+
+        /// Change of the depth
+        long m_effect;
+
+        /// Line called by kStepCall
+        size_t m_target;
+      };
+
+      /// State of a line during the analysis
+      enum State
+      {
+        kUnvisited,
+        kVisiting,
+        kDone
+      };
+
+      /// Split a line into the instructions the decoder makes of it
+      static void
+      DecodeLine(
+        const Runtime::Cell * a_code,
+        const Runtime::Line &a_line,
+        size_t a_lineCount,
+        std::vector<Step> &a_steps);
+
+      /// Line whose callees are being analyzed
+      struct Visit
+      {
+        /// Row of the line
+        size_t m_line;
+
+        /// Instructions of the line
+        std::vector<Step> m_steps;
+
+        /// Instruction to look at next
+        size_t m_next;
+
+        /// Flag if all callees looked at so far are proven
+        bool m_callees;
+      };
+
+      /// Analyze a line and the lines it calls
+      static void
+      AnalyzeLine(
+        const Runtime::Cell * a_code,
+        const Runtime::Line * a_lines,
+        size_t a_lineCount,
+        size_t a_line,
+        std::vector<Summary> &a_summaries,
+        std::vector<uint32_t> &a_needs,
+        std::vector<State> &a_states);
+
+      /// Mark a line as visited and put it on top of the visits
+      static void
+      BeginVisit(
+        const Runtime::Cell * a_code,
+        const Runtime::Line * a_lines,
+        size_t a_lineCount,
+        size_t a_line,
+        std::vector<State> &a_states,
+        std::vector<Visit> &a_visits);
+
+      /// Try to prove a line once its callees have been analyzed
+      static bool
+      ProveLine(
+        const Runtime::Line &a_line,
+        std::vector<Step> &a_steps,
+        Summary &a_summary,
+        std::vector<uint32_t> &a_needs);
+
+  };
+
+}
+
+#endif
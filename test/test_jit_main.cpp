@@ -0,0 +1,187 @@
+#define BOOST_TEST_MODULE TestJit
+#include <boost/test/unit_test.hpp>
+#include <forth/runtime.hpp>
+#include <forth/parser.hpp>
+
+#include <sstream>
+#include <string>
+#include <vector>
+
+/// Outcome of running a program, printed to compare it
+static std::string
+TestRun(
+  const std::string &a_lines,
+  uint32_t a_threshold,
+  size_t a_dataStackDepth = forth::Runtime::kDefaultDataStackDepth,
+  size_t * a_compiledLines = NULL)
+{
+  // Source lines are counted from 1
+  std::string source( forth::Runtime::kOpCodeFirstUser - 1, '\n');
+  source += a_lines;
+
+  forth::Runtime forth( a_dataStackDepth);
+  forth::Parser::ParseFromMemory( "file", source.data(), source.size(),
+    forth);
+  std::string output;
+  forth.SetOutputCapture( &output);
+  forth.SetJit( a_threshold);
+
+  std::ostringstream str;
+  try
+  {
+    forth::Runtime::Cell code = forth.Run().m_code;
+    str << "exit " << code;
+  }
+  catch (const forth::Runtime::StackUnderflow &)
+  {
+    str << "underflow";
+  }
+  catch (const forth::Runtime::StackOverflow &)
+  {
+    str << "overflow";
+  }
+  forth.FlushOutput();
+
+  std::vector<forth::Runtime::Cell> stack = forth.GetDataStack();
+  str << " stack";
+  for (size_t i = 0; i < stack.size(); ++i)
+    str << " " << stack[i];
+  str << " output '" << output << "'";
+
+  if ( a_compiledLines != NULL)
+    *a_compiledLines = (forth.GetJit() != NULL) ?
+                       forth.GetJit()->CountCompiledLines() : 0;
+  return str.str();
+}
+
+/// Run a program with and without native code and compare the outcome
+static void
+TestCompare(
+  const std::string &a_lines,
+  size_t a_dataStackDepth = forth::Runtime::kDefaultDataStackDepth)
+{
+  std::string interpreted = TestRun( a_lines, 0, a_dataStackDepth);
+  for (uint32_t threshold = 1; threshold <= 3; ++threshold)
+  {
+    BOOST_TEST_MESSAGE( "Program " << a_lines);
+    BOOST_CHECK_EQUAL( TestRun( a_lines, threshold, a_dataStackDepth),
+      interpreted);
+  }
+}
+
+BOOST_AUTO_TEST_CASE(Intrinsics)
+{
+  // 21: call 22 three times, then exit with the top
+  // 22: the sequence under test, entered with 13 5 on the stack
+  const char * kSequences[] =
+  {
+    "0 42", "1 42", "2 42", "3 42", "4 42", "5 42", "6 42", "7 42",
+    "8 42", "9 42", "10 42", "15 42", "0 5 42 7 42 6 42",
+    "8 42 15 42 0 42", "9 42 7 42 7 42", "-3 42 2 0 42",
+    "1 2 3 4 5 6 7 0 42 0 42 0 42 0 42 0 42 0 42",
+    "-7 3 42 -7 4 42",
+  };
+
+  for (size_t i = 0; i < sizeof( kSequences) / sizeof( kSequences[0]); ++i)
+  {
+    std::string lines = "13 5 22 42 22 42 22 42 14 42\n";
+    lines += kSequences[i];
+    lines += "\n";
+    TestCompare( lines);
+  }
+}
+
+BOOST_AUTO_TEST_CASE(Loops)
+{
+  // 21: count down from 1000 in line 22 and exit with the sum
+  // 22: swap over plus swap 1 minus loop
+  TestCompare( "0 1000 22 42 14 42\n8 42 15 42 0 42 8 42 1 1 42 11 42\n");
+
+  // 21: nested loops, the inner one is hot first
+  // 22: 10 23 call 1 minus loop
+  // 23: 1 minus loop
+  TestCompare( "50 22 42 0 14 42\n10 23 42 1 1 42 11 42\n"
+               "1 1 42 11 42\n");
+
+  // Only line 23 is compiled, line 22 would leave at its call right away
+  size_t compiled = 0;
+  TestRun( "50 22 42 0 14 42\n10 23 42 1 1 42 11 42\n"
+           "1 1 42 11 42\n", 5, forth::Runtime::kDefaultDataStackDepth,
+    &compiled);
+  BOOST_CHECK_EQUAL( compiled, forth::Jit::IsSupported() ? 1 : 0);
+}
+
+BOOST_AUTO_TEST_CASE(Leaving)
+{
+  // Printing is left to the interpreter
+  // 21: 10 22 call 0 exit
+  // 22: dup 48 plus emit 1 minus loop
+  TestCompare( "10 22 42 0 14 42\n9 42 48 0 42 12 42 1 1 42 11 42\n");
+
+  // So are computed calls
+  // 21: 5 22 call 0 exit
+  // 22: 23 dup call 1 minus loop
+  // 23: 7 plus drop
+  TestCompare( "5 22 42 0 14 42\n23 9 42 42 1 1 42 11 42\n"
+               "7 0 42 10 42\n");
+
+  // Exit in the middle of a hot line
+  // 21: 1 22 call 22 call 22 call 0 exit
+  // 22: 1 plus dup 3 div exit
+  TestCompare( "1 22 42 22 42 22 42 0 14 42\n1 0 42 9 42 3 3 42 14 42\n");
+}
+
+BOOST_AUTO_TEST_CASE(Errors)
+{
+  // Underflow in the middle of a compiled line, after it has been hot
+  TestCompare( "3 22 42 22 42 22 42 22 42 0 14 42\n10 42 10 42 5\n");
+
+  // Overflow in a run of literals and by dup
+  TestCompare( "22 42 22 42 22 42 0 14 42\n1 2 3 4 10 42 10 42 10 42 "
+               "10 42\n", 8);
+  TestCompare( "22 42 22 42 0 14 42\n1 2 3 9 42 9 42\n", 8);
+  TestCompare( "1 22 42 0 14 42\n9 42 11 42\n", 64);
+}
+
+/// Random programs of lines calling the ones after them
+BOOST_AUTO_TEST_CASE(RandomPrograms)
+{
+  const char * kWords[] =
+  {
+    "0 42", "1 42", "2 42", "7 3 42", "7 4 42", "5 42", "6 42", "7 42",
+    "8 42", "9 42", "10 42", "15 42", "-1 42", "1", "-2", "3", "100",
+  };
+  const size_t kWordCount = sizeof( kWords) / sizeof( kWords[0]);
+  const size_t kLines = 5;
+
+  uint32_t seed = 42;
+  for (size_t program = 0; program < 300; ++program)
+  {
+    std::ostringstream lines;
+    lines << "1 2 3 4 5 6 7 8 ";
+    for (size_t line = 0; line < kLines; ++line)
+    {
+      size_t words = 1 + (seed >> 16) % 12;
+      for (size_t i = 0; i < words; ++i)
+      {
+        seed = seed * 1103515245 + 12345;
+        size_t word = (seed >> 16) % (kWordCount + 2);
+        if ( word < kWordCount)
+          lines << kWords[word] << " ";
+        else if ( line + 1 < kLines)
+          lines << (forth::Runtime::kOpCodeFirstUser + line + 1 +
+                    (seed >> 8) % (kLines - line - 1)) << " 42 ";
+      }
+
+      // The first line calls its program several times. Each line ends
+      // with a number, so none of them is empty. Calls of empty lines at
+      // the end would go to the first one.
+      if ( line == 0)
+        lines << "22 42 22 42 22 42 22 42 0 14 42";
+      else
+        lines << "1";
+      lines << "\n";
+    }
+    TestCompare( lines.str(), 16);
+  }
+}
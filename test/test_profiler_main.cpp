@@ -0,0 +1,62 @@
+#define BOOST_TEST_MODULE TestProfiler
+#include <boost/test/unit_test.hpp>
+#include <forth/runtime.hpp>
+#include <forth/parser.hpp>
+#include <forth/profiler.hpp>
+
+#include <sstream>
+#include <string>
+
+BOOST_AUTO_TEST_CASE(Counting)
+{
+  // Source lines are counted from 1
+  std::string source( forth::Runtime::kOpCodeFirstUser - 1, '\n');
+
+  // 21: 22 call 22 call 0 exit
+  source += "22 42 22 42 0 14 42\n";
+
+  // 22: 1 23 call drop
+  source += "1 23 42 10 42\n";
+
+  // 23: 2 plus
+  source += "2 0 42\n";
+
+  forth::ProfilingRuntime forth;
+  forth::Parser::ParseFromMemory( "file", source.data(), source.size(),
+    forth);
+
+  forth::Profiler profiler;
+  BOOST_CHECK_EQUAL( forth.Profile( profiler), 0);
+  BOOST_CHECK( forth.HasExited());
+
+  const size_t kLine = forth::Runtime::kOpCodeFirstUser;
+  BOOST_CHECK_EQUAL( profiler.CountSteps(), 23);
+  BOOST_CHECK_EQUAL( profiler.CountSteps( kLine), 7);
+  BOOST_CHECK_EQUAL( profiler.CountSteps( kLine + 1), 10);
+  BOOST_CHECK_EQUAL( profiler.CountSteps( kLine + 2), 6);
+
+  BOOST_CHECK_EQUAL( profiler.CountEntries( kLine), 1);
+  BOOST_CHECK_EQUAL( profiler.CountEntries( kLine + 1), 2);
+  BOOST_CHECK_EQUAL( profiler.CountEntries( kLine + 2), 2);
+  BOOST_CHECK_EQUAL( profiler.CountEntries( kLine + 3), 0);
+
+  BOOST_CHECK_EQUAL( profiler.CountIntrinsicCalls(
+      forth::Runtime::kOpCodePlus), 2);
+  BOOST_CHECK_EQUAL( profiler.CountIntrinsicCalls(
+      forth::Runtime::kOpCodeDrop), 2);
+  BOOST_CHECK_EQUAL( profiler.CountIntrinsicCalls(
+      forth::Runtime::kOpCodeExit), 1);
+  BOOST_CHECK_EQUAL( profiler.CountIntrinsicCalls(
+      forth::Runtime::kOpCodeMult), 0);
+
+  BOOST_CHECK_EQUAL( profiler.CountCalls( kLine, kLine + 1), 2);
+  BOOST_CHECK_EQUAL( profiler.CountCalls( kLine + 1, kLine + 2), 2);
+  BOOST_CHECK_EQUAL( profiler.CountCalls( kLine, kLine + 2), 0);
+
+  std::ostringstream stacks;
+  profiler.WriteFoldedStacks( stacks);
+  BOOST_CHECK_EQUAL( stacks.str(),
+    "line 21 7\n"
+    "line 21;line 22 10\n"
+    "line 21;line 22;line 23 6\n");
+}
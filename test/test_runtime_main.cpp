@@ -1,7 +1,15 @@
 #define BOOST_TEST_MODULE TestRuntime
 #include <boost/test/unit_test.hpp>
 #include <forth/runtime.hpp>
+#include <forth/decoder.hpp>
 #include <forth/parser.hpp>
+#include <forth/fusion_recorder.hpp>
+#include <forth/stack_effect.hpp>
+
+#include <fstream>
+#include <iterator>
+#include <sstream>
+#include <unistd.h>
 
 /** Interface to expose protected attributes and methods.
  */
@@ -9,27 +17,31 @@ class TestRuntime : public forth::Runtime
 {
   public:
 
-    TestRuntime() : forth::Runtime()
+    explicit
+    TestRuntime(
+      size_t a_dataStackDepth = kDefaultDataStackDepth,
+      size_t a_returnStackDepth = kDefaultReturnStackDepth)
+      : forth::Runtime( a_dataStackDepth, a_returnStackDepth)
     {
     }
 
     size_t
     TestDataStackSize() const
     {
-      return m_dataStack.size();
+      return m_dataStack.Size();
     }
 
     Cell
     TestDataStackAt(
       size_t a_ind) const
     {
-      return m_dataStack[a_ind];
+      return m_dataStack.At( a_ind);
     }
 
     size_t
     TestReturnStackSize() const
     {
-      return m_returnStack.size();
+      return m_returnStack.Size();
     }
 
     Cell
@@ -38,11 +50,63 @@ class TestRuntime : public forth::Runtime
       return PopData();
     }
 
-    const std::vector< std::vector< Cell > > &
+    Cell
+    TestGetCell(
+      size_t a_row,
+      size_t a_col) const
+    {
+      return m_view.m_code[m_view.m_lines[a_row].m_offset + a_col];
+    }
+
+    size_t
+    TestGetCodeSize() const
+    {
+      return m_view.m_codeSize;
+    }
 
-    TestGetProgram() const
+    const forth::Program::View &
+    TestGetView() const
     {
-      return m_program;
+      return m_view;
+    }
+
+    forth::Operation
+    TestGetOperation(
+      size_t a_row,
+      size_t a_col) const
+    {
+      return static_cast<forth::Operation>(
+        m_view.m_decoded[m_view.m_lines[a_row].m_offset + a_col].m_op);
+    }
+
+    /// Replace the operation of a decoded instruction
+    void
+    TestSetOperation(
+      size_t a_row,
+      size_t a_col,
+      forth::Operation a_op)
+    {
+      forth::Instruction * decoded =
+        const_cast<forth::Instruction *>( m_view.m_decoded);
+      decoded[m_view.m_lines[a_row].m_offset + a_col].m_op = a_op;
+    }
+
+    const forth::FixedStack<Cell> &
+    TestGetDataStack() const
+    {
+      return m_dataStack;
+    }
+
+    bool
+    TestIsImageLoaded() const
+    {
+      return m_program->IsMapped();
+    }
+
+    bool
+    TestIsProgramShared() const
+    {
+      return m_program->IsShared();
     }
 
     size_t
@@ -54,7 +118,7 @@ class TestRuntime : public forth::Runtime
     size_t
     TestGetIpCol() const
     {
-      return m_ipCol;
+      return m_ip - m_view.m_lines[m_ipLine].m_offset;
     }
 
     /** Test function to check if the opcodes and the intrinsics match. This
@@ -192,19 +256,112 @@ BOOST_AUTO_TEST_CASE(Compiler)
     TestRuntime::kOpCodeFirstUser,
     TestRuntime::kOpCodePlus);
 
-  const std::vector< std::vector< TestRuntime::Cell > > &prg =
-    forth.TestGetProgram();
-
-  BOOST_REQUIRE_EQUAL( prg.size(), TestRuntime::kOpCodeFirstUser + 1);
-  BOOST_CHECK_EQUAL( prg[TestRuntime::kOpCodeFirstUser].size(), 4);
-  BOOST_CHECK_EQUAL( prg[TestRuntime::kOpCodeFirstUser][0], 2);
-  BOOST_CHECK_EQUAL( prg[TestRuntime::kOpCodeFirstUser][1], 3);
-  BOOST_CHECK_EQUAL( prg[TestRuntime::kOpCodeFirstUser][2],
+  BOOST_REQUIRE_EQUAL( forth.CountProgramLines(),
+    TestRuntime::kOpCodeFirstUser + 1);
+  BOOST_CHECK_EQUAL(
+    forth.CountInstructionsInLine( TestRuntime::kOpCodeFirstUser),
+    4);
+  BOOST_CHECK_EQUAL( forth.TestGetCell( TestRuntime::kOpCodeFirstUser, 0), 2);
+  BOOST_CHECK_EQUAL( forth.TestGetCell( TestRuntime::kOpCodeFirstUser, 1), 3);
+  BOOST_CHECK_EQUAL( forth.TestGetCell( TestRuntime::kOpCodeFirstUser, 2),
     TestRuntime::kOpCodePlus);
-  BOOST_CHECK_EQUAL( prg[TestRuntime::kOpCodeFirstUser][3],
+  BOOST_CHECK_EQUAL( forth.TestGetCell( TestRuntime::kOpCodeFirstUser, 3),
     TestRuntime::kOpCodeCall);
 }
 
+/// Compile lines out of order and check that sealing packs them.
+BOOST_AUTO_TEST_CASE(Sealing)
+{
+  TestRuntime forth;
+
+  forth.Compile( TestRuntime::kOpCodeFirstUser, 1);
+  forth.Compile( TestRuntime::kOpCodeFirstUser + 1, 2);
+  forth.Compile( TestRuntime::kOpCodeFirstUser, 3);
+
+  // The first line has been moved behind the second one. Each line has a
+  // spare slot.
+  BOOST_CHECK_EQUAL( forth.TestGetCodeSize(),
+    4 + forth.CountProgramLines() + 1);
+  BOOST_CHECK_EQUAL( forth.TestGetCell( TestRuntime::kOpCodeFirstUser, 0), 1);
+  BOOST_CHECK_EQUAL( forth.TestGetCell( TestRuntime::kOpCodeFirstUser, 1), 3);
+
+  forth.Seal();
+
+  BOOST_CHECK_EQUAL( forth.TestGetCodeSize(),
+    3 + forth.CountProgramLines());
+  BOOST_REQUIRE_EQUAL( forth.CountProgramLines(),
+    TestRuntime::kOpCodeFirstUser + 2);
+  BOOST_REQUIRE_EQUAL(
+    forth.CountInstructionsInLine( TestRuntime::kOpCodeFirstUser), 2);
+  BOOST_CHECK_EQUAL( forth.TestGetCell( TestRuntime::kOpCodeFirstUser, 0), 1);
+  BOOST_CHECK_EQUAL( forth.TestGetCell( TestRuntime::kOpCodeFirstUser, 1), 3);
+  BOOST_REQUIRE_EQUAL(
+    forth.CountInstructionsInLine( TestRuntime::kOpCodeFirstUser + 1), 1);
+  BOOST_CHECK_EQUAL(
+    forth.TestGetCell( TestRuntime::kOpCodeFirstUser + 1, 0), 2);
+}
+
+/// Check that constant calls are decoded into single instructions.
+BOOST_AUTO_TEST_CASE(Decoding)
+{
+  TestRuntime forth;
+  const size_t kLine = TestRuntime::kOpCodeFirstUser;
+
+  // 21: 5 plus 22 call call call -1 call 7
+  forth.Compile( kLine, 5);
+  TestCompileCall( forth, kLine, TestRuntime::kOpCodePlus);
+  TestCompileCall( forth, kLine, kLine + 1);
+  forth.Compile( kLine, TestRuntime::kOpCodeCall);
+  forth.Compile( kLine, TestRuntime::kOpCodeCall);
+  TestCompileCall( forth, kLine, -1);
+  forth.Compile( kLine, 7);
+
+  // 22:
+  forth.Compile( kLine + 1, 1);
+
+  forth.SetFusion( false);
+  forth.Seal();
+
+  BOOST_CHECK_EQUAL( forth.TestGetOperation( kLine, 0), forth::kOpLiteral);
+  BOOST_CHECK_EQUAL( forth.TestGetOperation( kLine, 1), forth::kOpPlus);
+  BOOST_CHECK_EQUAL( forth.TestGetOperation( kLine, 2), forth::kOpCall);
+  BOOST_CHECK_EQUAL( forth.TestGetOperation( kLine, 3), forth::kOpCallLine);
+  BOOST_CHECK_EQUAL( forth.TestGetOperation( kLine, 4), forth::kOpCall);
+  BOOST_CHECK_EQUAL( forth.TestGetOperation( kLine, 5), forth::kOpCall);
+  BOOST_CHECK_EQUAL( forth.TestGetOperation( kLine, 6), forth::kOpCall);
+  BOOST_CHECK_EQUAL( forth.TestGetOperation( kLine, 7), forth::kOpNop);
+  BOOST_CHECK_EQUAL( forth.TestGetOperation( kLine, 8), forth::kOpCall);
+  BOOST_CHECK_EQUAL( forth.TestGetOperation( kLine, 9), forth::kOpLiteral);
+  BOOST_CHECK_EQUAL( forth.TestGetOperation( kLine, 10), forth::kOpReturn);
+}
+
+/// Check that calls at the end of a line are decoded into jumps.
+BOOST_AUTO_TEST_CASE(DecodingTailCalls)
+{
+  TestRuntime forth;
+  const size_t kLine = TestRuntime::kOpCodeFirstUser;
+
+  // 21: 22 call 22 call
+  TestCompileCall( forth, kLine, kLine + 1);
+  TestCompileCall( forth, kLine, kLine + 1);
+
+  // 22: 7 call call
+  TestCompileCall( forth, kLine + 1, 7);
+  forth.Compile( kLine + 1, TestRuntime::kOpCodeCall);
+
+  forth.SetFusion( false);
+  forth.Seal();
+
+  BOOST_CHECK_EQUAL( forth.TestGetOperation( kLine, 0), forth::kOpCallLine);
+  BOOST_CHECK_EQUAL( forth.TestGetOperation( kLine, 2), forth::kOpJumpLine);
+  BOOST_CHECK_EQUAL( forth.TestGetOperation( kLine, 3), forth::kOpTailCall);
+  BOOST_CHECK_EQUAL( forth.TestGetOperation( kLine, 4), forth::kOpReturn);
+  BOOST_CHECK_EQUAL( forth.TestGetOperation( kLine + 1, 0), forth::kOpNot);
+  BOOST_CHECK_EQUAL( forth.TestGetOperation( kLine + 1, 1), forth::kOpCall);
+  BOOST_CHECK_EQUAL( forth.TestGetOperation( kLine + 1, 2),
+    forth::kOpTailCall);
+}
+
 /// Compile a simple sequence and run it step by step.
 BOOST_AUTO_TEST_CASE(Running)
 {
@@ -248,11 +405,1059 @@ BOOST_AUTO_TEST_CASE(Calling)
   forth.ResetIp();
   forth.ComputeStep();
   forth.ComputeStep();
+
+  // A call takes a single frame
+  BOOST_CHECK_EQUAL( forth.TestReturnStackSize(), 1);
+  BOOST_CHECK( forth.IsIpAt( TestRuntime::kOpCodeFirstUser + 1, 0));
+
   forth.ComputeStep();
   forth.ComputeStep();
   forth.ComputeStep();
   forth.ComputeStep();
   BOOST_CHECK_EQUAL( forth.TestDataStackSize(), 1);
+
+  // Returning finds the calling line again
+  forth.ComputeStep();
+  BOOST_CHECK_EQUAL( forth.TestReturnStackSize(), 0);
+  BOOST_CHECK( forth.IsIpAt( TestRuntime::kOpCodeFirstUser, 2));
+}
+
+BOOST_AUTO_TEST_CASE(CallingFromHost)
+{
+  TestRuntime forth;
+  const size_t kLine = TestRuntime::kOpCodeFirstUser;
+
+  // 21: 0
+  // 22: over mult
+  // 23: 22 call plus
+  // 24: 22 call
+  // 25: 7 exit
+  forth.Compile( kLine, 0);
+  TestCompileCall( forth, kLine + 1, TestRuntime::kOpCodeOver);
+  TestCompileCall( forth, kLine + 1, TestRuntime::kOpCodeMult);
+  TestCompileCall( forth, kLine + 2, kLine + 1);
+  TestCompileCall( forth, kLine + 2, TestRuntime::kOpCodePlus);
+  TestCompileCall( forth, kLine + 3, kLine + 1);
+  forth.Compile( kLine + 4, 7);
+  TestCompileCall( forth, kLine + 4, TestRuntime::kOpCodeExit);
+
+  std::vector<TestRuntime::Cell> input;
+  input.push_back( 3);
+  input.push_back( 5);
+  std::vector<TestRuntime::Cell> output = forth.Call( kLine + 1, input);
+  BOOST_REQUIRE_EQUAL( output.size(), 2);
+  BOOST_CHECK_EQUAL( output[0], 3);
+  BOOST_CHECK_EQUAL( output[1], 15);
+  BOOST_CHECK_EQUAL( forth.TestReturnStackSize(), 0);
+
+  // Nested calls and tail calls return to the host as well
+  output = forth.Call( kLine + 2, input);
+  BOOST_REQUIRE_EQUAL( output.size(), 1);
+  BOOST_CHECK_EQUAL( output[0], 18);
+  output = forth.Call( kLine + 3, input);
+  BOOST_REQUIRE_EQUAL( output.size(), 2);
+  BOOST_CHECK_EQUAL( output[1], 15);
+  BOOST_CHECK_EQUAL( forth.TestReturnStackSize(), 0);
+
+  // Intrinsics can be called directly
+  output = forth.Call( TestRuntime::kOpCodePlus, input);
+  BOOST_REQUIRE_EQUAL( output.size(), 1);
+  BOOST_CHECK_EQUAL( output[0], 8);
+
+  // Exiting ends the call
+  output = forth.Call( kLine + 4, input);
+  BOOST_CHECK_EQUAL( output.size(), 2);
+  BOOST_CHECK( forth.HasExited());
+  BOOST_CHECK_EQUAL( forth.GetExitCode(), 7);
+  BOOST_CHECK_EQUAL( forth.TestReturnStackSize(), 0);
+
+  // The next call starts over
+  output = forth.Call( kLine + 1, input);
+  BOOST_CHECK( !forth.HasExited());
+  BOOST_CHECK_EQUAL( output.size(), 2);
+
+  BOOST_CHECK_THROW( forth.Call( kLine + 1, std::vector<TestRuntime::Cell>()),
+    TestRuntime::StackUnderflow);
+}
+
+BOOST_AUTO_TEST_CASE(StepLimit)
+{
+  TestRuntime forth;
+  const size_t kLine = TestRuntime::kOpCodeFirstUser;
+
+  // 21: 3 4 plus 0 exit
+  // 22: drop 1 loop
+  forth.Compile( kLine, 3);
+  forth.Compile( kLine, 4);
+  TestCompileCall( forth, kLine, TestRuntime::kOpCodePlus);
+  forth.Compile( kLine, 0);
+  TestCompileCall( forth, kLine, TestRuntime::kOpCodeExit);
+  TestCompileCall( forth, kLine + 1, TestRuntime::kOpCodeDrop);
+  forth.Compile( kLine + 1, 1);
+  TestCompileCall( forth, kLine + 1, TestRuntime::kOpCodeLoop);
+
+  // Without fusion, line 21 takes five steps
+  forth.SetFusion( false);
+  forth.ResetIp();
+  TestRuntime::RunResult result = forth.Run( 4);
+  BOOST_CHECK_EQUAL( result.m_status, TestRuntime::RunResult::kStepLimit);
+  BOOST_CHECK_EQUAL( result.m_steps, 4);
+  BOOST_CHECK( forth.IsIpAt( kLine, 5));
+  BOOST_CHECK_EQUAL( forth.TestDataStackSize(), 2);
+
+  // Running again continues
+  result = forth.Run( 100);
+  BOOST_CHECK_EQUAL( result.m_status, TestRuntime::RunResult::kExited);
+  BOOST_CHECK_EQUAL( result.m_steps, 1);
+  BOOST_REQUIRE_EQUAL( forth.TestDataStackSize(), 1);
+  BOOST_CHECK_EQUAL( forth.TestDataStackAt( 0), 7);
+
+  // An endless loop stops at the limit, Call reports it
+  std::vector<TestRuntime::Cell> input( 1, 1);
+  BOOST_CHECK_THROW( forth.Call( kLine + 1, input, 1000),
+    TestRuntime::StepLimitExceeded);
+  result = forth.Run( 1000);
+  BOOST_CHECK_EQUAL( result.m_status, TestRuntime::RunResult::kStepLimit);
+  BOOST_CHECK_EQUAL( result.m_steps, 1000);
+  BOOST_CHECK_EQUAL( forth.TestDataStackSize(), 1);
+}
+
+/// Recurse by tail calls in constant return stack space.
+BOOST_AUTO_TEST_CASE(TailRecursion)
+{
+  TestRuntime forth( TestRuntime::kDefaultDataStackDepth, 8);
+  const size_t kLine = TestRuntime::kOpCodeFirstUser;
+
+  // 21: 1000 22 call
+  forth.Compile( kLine, 1000);
+  TestCompileCall( forth, kLine, kLine + 1);
+
+  // 22: 1 minus dup not not 23 mult 1 minus call
+  //
+  // Count down and call line 22 again until zero, then call line -1, which
+  // does nothing.
+  forth.Compile( kLine + 1, 1);
+  TestCompileCall( forth, kLine + 1, TestRuntime::kOpCodeMinus);
+  TestCompileCall( forth, kLine + 1, TestRuntime::kOpCodeDup);
+  TestCompileCall( forth, kLine + 1, TestRuntime::kOpCodeNot);
+  TestCompileCall( forth, kLine + 1, TestRuntime::kOpCodeNot);
+  forth.Compile( kLine + 1, kLine + 2);
+  TestCompileCall( forth, kLine + 1, TestRuntime::kOpCodeMult);
+  forth.Compile( kLine + 1, 1);
+  TestCompileCall( forth, kLine + 1, TestRuntime::kOpCodeMinus);
+  forth.Compile( kLine + 1, TestRuntime::kOpCodeCall);
+
+  // Both lines end in tail calls, so line 22 returns to nowhere. The error
+  // names the end of line 21, as it would without the tail calls.
+  forth.SetFileName( "file");
+  forth.ResetIp();
+  try
+  {
+    forth.Run();
+    BOOST_ERROR( "No error");
+  }
+  catch (const TestRuntime::StackUnderflow &ex)
+  {
+    BOOST_CHECK_EQUAL( std::string( ex.what()),
+      "file(21): return stack underflow");
+  }
+  BOOST_REQUIRE_EQUAL( forth.TestDataStackSize(), 1);
+  BOOST_CHECK_EQUAL( forth.TestDataStackAt( 0), 0);
+  BOOST_CHECK( forth.IsIpAt( kLine, 3));
+}
+
+/// Recurse until the return stack is full.
+BOOST_AUTO_TEST_CASE(RecurseUntilOverflow)
+{
+  TestRuntime forth( TestRuntime::kDefaultDataStackDepth, 8);
+
+  // 21: 21 call 0
+  //
+  // The number after the call keeps it from being a tail call.
+  TestCompileCall( forth,
+    TestRuntime::kOpCodeFirstUser,
+    TestRuntime::kOpCodeFirstUser);
+  forth.Compile( TestRuntime::kOpCodeFirstUser, 0);
+
+  forth.ResetIp();
+  BOOST_CHECK_THROW( forth.Run(), TestRuntime::StackOverflow);
+  BOOST_CHECK_EQUAL( forth.TestReturnStackSize(), 8);
+  BOOST_CHECK_EQUAL( forth.TestGetIpLine(), TestRuntime::kOpCodeFirstUser);
+}
+
+/// Run a program at full speed until it runs out of data.
+BOOST_AUTO_TEST_CASE(RunUntilUnderflow)
+{
+  TestRuntime forth;
+
+  // 21: 5 7 22 call plus
+  forth.Compile( TestRuntime::kOpCodeFirstUser, 5);
+  forth.Compile( TestRuntime::kOpCodeFirstUser, 7);
+  TestCompileCall( forth,
+    TestRuntime::kOpCodeFirstUser,
+    TestRuntime::kOpCodeFirstUser + 1);
+  TestCompileCall( forth,
+    TestRuntime::kOpCodeFirstUser,
+    TestRuntime::kOpCodePlus);
+
+  // 22: over mult
+  TestCompileCall( forth,
+    TestRuntime::kOpCodeFirstUser + 1,
+    TestRuntime::kOpCodeOver);
+  TestCompileCall( forth,
+    TestRuntime::kOpCodeFirstUser + 1,
+    TestRuntime::kOpCodeMult);
+
+  // Line 21 leaves 40 on the stack, returns to nowhere and underflows
+  forth.ResetIp();
+  BOOST_CHECK_THROW( forth.Run(), TestRuntime::StackUnderflow);
+  BOOST_REQUIRE_EQUAL( forth.TestDataStackSize(), 1);
+  BOOST_CHECK_EQUAL( forth.TestDataStackAt( 0), 40);
+  BOOST_CHECK_EQUAL( forth.TestGetIpLine(), TestRuntime::kOpCodeFirstUser);
+}
+
+BOOST_AUTO_TEST_CASE(RunUntilOverflow)
+{
+  TestRuntime forth( 4);
+
+  // Pushing beyond the capacity fails and leaves the stack untouched
+  for (TestRuntime::Cell i = 1; i <= 4; ++i)
+    forth.PushDataNoExec( i);
+  BOOST_CHECK_THROW( forth.PushDataNoExec( 5), TestRuntime::StackOverflow);
+  BOOST_REQUIRE_EQUAL( forth.TestDataStackSize(), 4);
+  BOOST_CHECK_EQUAL( forth.TestDataStackAt( 3), 4);
+
+  // 21: 1 dup loop
+  TestRuntime loop( 4);
+  loop.Compile( TestRuntime::kOpCodeFirstUser, 1);
+  TestCompileCall( loop,
+    TestRuntime::kOpCodeFirstUser,
+    TestRuntime::kOpCodeDup);
+  TestCompileCall( loop,
+    TestRuntime::kOpCodeFirstUser,
+    TestRuntime::kOpCodeLoop);
+
+  // Each round leaves a 1 on the stack until it is full
+  loop.ResetIp();
+  BOOST_CHECK_THROW( loop.Run(), TestRuntime::StackOverflow);
+  BOOST_REQUIRE_EQUAL( loop.TestDataStackSize(), 4);
+  for (size_t i = 0; i < 4; ++i)
+    BOOST_CHECK_EQUAL( loop.TestDataStackAt( i), 1);
+}
+
+/// Write a program as an image, load and run it.
+BOOST_AUTO_TEST_CASE(Image)
+{
+  const char * kImage = "test_runtime_image.42c";
+  const size_t kLine = TestRuntime::kOpCodeFirstUser;
+
+  // 21: 5 7 22 call plus
+  // 22: over mult
+  {
+    TestRuntime forth;
+    forth.Compile( kLine, 5);
+    forth.Compile( kLine, 7);
+    TestCompileCall( forth, kLine, kLine + 1);
+    TestCompileCall( forth, kLine, TestRuntime::kOpCodePlus);
+    TestCompileCall( forth, kLine + 1, TestRuntime::kOpCodeOver);
+    TestCompileCall( forth, kLine + 1, TestRuntime::kOpCodeMult);
+    forth.WriteImage( kImage);
+  }
+  BOOST_CHECK( forth::ImageFile::IsImage( kImage));
+
+  TestRuntime forth;
+  forth.LoadImage( kImage);
+  BOOST_CHECK( forth.TestIsImageLoaded());
+  BOOST_REQUIRE_EQUAL( forth.CountProgramLines(), kLine + 2);
+  BOOST_REQUIRE_EQUAL( forth.CountInstructionsInLine( kLine), 6);
+  BOOST_CHECK_EQUAL( forth.TestGetCell( kLine, 1), 7);
+  BOOST_CHECK_EQUAL( forth.TestGetOperation( kLine + 1, 0),
+    forth::kOpOver);
+
+  // Line 21 leaves 40 on the stack, returns to nowhere and underflows
+  BOOST_CHECK_THROW( forth.Run(), TestRuntime::StackUnderflow);
+  BOOST_REQUIRE_EQUAL( forth.TestDataStackSize(), 1);
+  BOOST_CHECK_EQUAL( forth.TestDataStackAt( 0), 40);
+
+  // Changing the program makes a copy of the image
+  forth.TestPopData();
+  forth.Compile( kLine + 1, 2);
+  forth.Compile( kLine + 1, TestRuntime::kOpCodeMult);
+  forth.Compile( kLine + 1, TestRuntime::kOpCodeCall);
+  BOOST_CHECK( !forth.TestIsImageLoaded());
+  forth.ResetIp();
+  BOOST_CHECK_THROW( forth.Run(), TestRuntime::StackUnderflow);
+  BOOST_REQUIRE_EQUAL( forth.TestDataStackSize(), 1);
+  BOOST_CHECK_EQUAL( forth.TestDataStackAt( 0), 75);
+
+  // Source files are not images
+  std::ofstream source( kImage);
+  source << "5 7 0 42" << std::endl;
+  source.close();
+  BOOST_CHECK( !forth::ImageFile::IsImage( kImage));
+  BOOST_CHECK_THROW( forth.LoadImage( kImage), forth::ImageError);
+  unlink( kImage);
+}
+
+/// Find a section in the bytes of an image
+static char *
+TestFindSection(
+  std::string &a_bytes,
+  uint32_t a_type,
+  size_t &a_size)
+{
+  const forth::ImageHeader * header =
+    reinterpret_cast<const forth::ImageHeader *>( a_bytes.data());
+  const forth::ImageSection * sections =
+    reinterpret_cast<const forth::ImageSection *>( header + 1);
+  for (uint32_t i = 0; i < header->m_sectionCount; ++i)
+  {
+    if (sections[i].m_type == a_type)
+    {
+      a_size = sections[i].m_size;
+      return &a_bytes[sections[i].m_offset];
+    }
+  }
+  return NULL;
+}
+
+/// Set the fingerprint of the image in the bytes and fix its checksum
+static void
+TestSealImage(
+  std::string &a_bytes,
+  uint64_t a_fingerprint)
+{
+  forth::ImageHeader * header =
+    reinterpret_cast<forth::ImageHeader *>( &a_bytes[0]);
+  header->m_fingerprint = a_fingerprint;
+  header->m_checksum = forth::ImageFile::Checksum( a_bytes.data(),
+    a_bytes.size());
+}
+
+/// Replace the contents of a file
+static void
+TestWriteFile(
+  const char * a_filename,
+  const std::string &a_bytes)
+{
+  std::ofstream file( a_filename,
+    std::ios_base::out | std::ios_base::binary | std::ios_base::trunc);
+  file << a_bytes;
+}
+
+/// Load images whose decoded program or line table has been tampered with
+BOOST_AUTO_TEST_CASE(CorruptImage)
+{
+  const char * kImage = "test_runtime_corrupt.42c";
+  const size_t kLine = TestRuntime::kOpCodeFirstUser;
+
+  // 21: 5 7 22 call plus
+  // 22: over mult
+  {
+    TestRuntime forth;
+    forth.Compile( kLine, 5);
+    forth.Compile( kLine, 7);
+    TestCompileCall( forth, kLine, kLine + 1);
+    TestCompileCall( forth, kLine, TestRuntime::kOpCodePlus);
+    TestCompileCall( forth, kLine + 1, TestRuntime::kOpCodeOver);
+    TestCompileCall( forth, kLine + 1, TestRuntime::kOpCodeMult);
+    forth.WriteImage( kImage);
+  }
+  std::string bytes;
+  {
+    std::ifstream file( kImage, std::ios_base::binary);
+    bytes.assign( std::istreambuf_iterator<char>( file),
+      std::istreambuf_iterator<char>());
+  }
+
+  // Any change to the contents fails the checksum
+  std::string changed = bytes;
+  size_t size = 0;
+  char * decoded = TestFindSection( changed, forth::kImageSectionDecoded,
+    size);
+  BOOST_REQUIRE( decoded != NULL);
+  reinterpret_cast<forth::Instruction *>( decoded)[kLine].m_op = 0xffff;
+  TestWriteFile( kImage, changed);
+  TestRuntime corrupt;
+  BOOST_CHECK_THROW( corrupt.LoadImage( kImage), forth::ImageError);
+  BOOST_CHECK( !corrupt.TestIsImageLoaded());
+
+  // The image of another decoder is decoded again from the code
+  changed = bytes;
+  decoded = TestFindSection( changed, forth::kImageSectionDecoded, size);
+  for (size_t i = 0; i < size / sizeof( forth::Instruction); ++i)
+    reinterpret_cast<forth::Instruction *>( decoded)[i].m_op = 0xffff;
+  TestSealImage( changed, forth::Decoder::Fingerprint() + 1);
+  TestWriteFile( kImage, changed);
+  TestRuntime forth;
+  forth.LoadImage( kImage);
+  BOOST_CHECK( forth.TestIsImageLoaded());
+  BOOST_CHECK_EQUAL( forth.TestGetOperation( kLine + 1, 0),
+    forth::kOpOver);
+  BOOST_CHECK_THROW( forth.Run(), TestRuntime::StackUnderflow);
+  BOOST_REQUIRE_EQUAL( forth.TestDataStackSize(), 1);
+  BOOST_CHECK_EQUAL( forth.TestDataStackAt( 0), 40);
+
+  // Lines out of order are rejected
+  changed = bytes;
+  char * lines = TestFindSection( changed, forth::kImageSectionLines, size);
+  BOOST_REQUIRE( lines != NULL);
+  std::swap( reinterpret_cast<forth::Program::Line *>( lines)[kLine],
+    reinterpret_cast<forth::Program::Line *>( lines)[kLine + 1]);
+  TestSealImage( changed, forth::Decoder::Fingerprint());
+  TestWriteFile( kImage, changed);
+  TestRuntime unsorted;
+  BOOST_CHECK_THROW( unsorted.LoadImage( kImage), forth::ImageError);
+  unlink( kImage);
+}
+
+BOOST_AUTO_TEST_CASE(SharedProgram)
+{
+  const size_t kLine = TestRuntime::kOpCodeFirstUser;
+
+  // 21: 5 7 22 call plus
+  // 22: over mult
+  TestRuntime master;
+  master.Compile( kLine, 5);
+  master.Compile( kLine, 7);
+  TestCompileCall( master, kLine, kLine + 1);
+  TestCompileCall( master, kLine, TestRuntime::kOpCodePlus);
+  TestCompileCall( master, kLine + 1, TestRuntime::kOpCodeOver);
+  TestCompileCall( master, kLine + 1, TestRuntime::kOpCodeMult);
+  master.Seal();
+
+  TestRuntime forth;
+  forth.ShareProgram( master);
+  BOOST_CHECK( master.TestIsProgramShared());
+  BOOST_CHECK( forth.TestIsProgramShared());
+  BOOST_REQUIRE_EQUAL( forth.CountProgramLines(), kLine + 2);
+
+  // Each runtime has stacks of its own
+  BOOST_CHECK_THROW( forth.Run(), TestRuntime::StackUnderflow);
+  BOOST_REQUIRE_EQUAL( forth.TestDataStackSize(), 1);
+  BOOST_CHECK_EQUAL( forth.TestDataStackAt( 0), 40);
+  BOOST_CHECK_EQUAL( master.TestDataStackSize(), 0);
+
+  // Changing the program copies it, the other runtime keeps the original
+  forth.TestPopData();
+  forth.Compile( kLine + 1, 2);
+  forth.Compile( kLine + 1, TestRuntime::kOpCodeMult);
+  forth.Compile( kLine + 1, TestRuntime::kOpCodeCall);
+  BOOST_CHECK( !master.TestIsProgramShared());
+  BOOST_CHECK( !forth.TestIsProgramShared());
+  BOOST_CHECK_EQUAL( master.CountInstructionsInLine( kLine + 1), 4);
+  BOOST_CHECK_EQUAL( forth.CountInstructionsInLine( kLine + 1), 7);
+
+  forth.ResetIp();
+  BOOST_CHECK_THROW( forth.Run(), TestRuntime::StackUnderflow);
+  BOOST_CHECK_EQUAL( forth.TestDataStackAt( 0), 75);
+
+  master.ResetIp();
+  BOOST_CHECK_THROW( master.Run(), TestRuntime::StackUnderflow);
+  BOOST_CHECK_EQUAL( master.TestDataStackAt( 0), 40);
+}
+
+/** Source of a program counting the numbers up to 1000 whose last digit is
+ * divisible by 3 or 5. Line 23 is pure and called with ten different cells.
+ */
+static std::string
+TestMemoSource()
+{
+  // Source lines are counted from 1
+  std::string source( TestRuntime::kOpCodeFirstUser - 1, '\n');
+
+  // 21: 0 1000 22 call exit
+  source += "0 1000 22 42 14 42\n";
+
+  // 22: swap over 10 mod 23 call plus swap 1 minus loop
+  source += "8 42 15 42 10 4 42 23 42 0 42 8 42 1 1 42 11 42\n";
+
+  // 23: dup 3 24 call swap 5 24 call or
+  source += "9 42 3 24 42 8 42 5 24 42 6 42\n";
+
+  // 24: mod not
+  source += "4 42 7 42\n";
+
+  // 25: 1 emit
+  source += "1 12 42\n";
+
+  // 26: 23 call 25 call
+  source += "23 42 25 42\n";
+
+  // 27: dup call
+  source += "9 42 42\n";
+
+  // 28: 23 call 28 call
+  source += "23 42 28 42\n";
+  return source;
+}
+
+BOOST_AUTO_TEST_CASE(PureLines)
+{
+  TestRuntime forth;
+  std::string source = TestMemoSource();
+  forth::Parser::ParseFromMemory( "file", source.data(), source.size(),
+    forth);
+
+  std::vector<forth::MemoCache::Signature> signatures;
+  forth::MemoCache::Analyze( forth.TestGetView(), signatures);
+  BOOST_REQUIRE_EQUAL( signatures.size(), forth.CountProgramLines());
+
+  const size_t kLine = TestRuntime::kOpCodeFirstUser;
+  BOOST_CHECK( !signatures[TestRuntime::kOpCodePlus].m_pure);
+  BOOST_CHECK( !signatures[kLine].m_pure);
+  BOOST_CHECK( !signatures[kLine + 1].m_pure);
+  BOOST_CHECK( !signatures[kLine + 4].m_pure);
+  BOOST_CHECK( !signatures[kLine + 5].m_pure);
+  BOOST_CHECK( !signatures[kLine + 6].m_pure);
+  BOOST_CHECK( !signatures[kLine + 7].m_pure);
+
+  BOOST_REQUIRE( signatures[kLine + 2].m_pure);
+  BOOST_CHECK_EQUAL( signatures[kLine + 2].m_inputs, 1);
+  BOOST_CHECK_EQUAL( signatures[kLine + 2].m_outputs, 1);
+  BOOST_CHECK_EQUAL( signatures[kLine + 2].m_peak, 3);
+  BOOST_CHECK_EQUAL( signatures[kLine + 2].m_calls, 1);
+
+  BOOST_REQUIRE( signatures[kLine + 3].m_pure);
+  BOOST_CHECK_EQUAL( signatures[kLine + 3].m_inputs, 2);
+  BOOST_CHECK_EQUAL( signatures[kLine + 3].m_outputs, 1);
+  BOOST_CHECK_EQUAL( signatures[kLine + 3].m_peak, 1);
+  BOOST_CHECK_EQUAL( signatures[kLine + 3].m_calls, 0);
+}
+
+/// Check the stack effects proven for the lines
+BOOST_AUTO_TEST_CASE(StackEffects)
+{
+  TestRuntime forth;
+  std::string source = TestMemoSource();
+
+  // 29: drop drop dup loop, each pass takes one more
+  source += "10 42 10 42 9 42 11 42\n";
+  forth::Parser::ParseFromMemory( "file", source.data(), source.size(),
+    forth);
+  forth.Seal();
+
+  const forth::Program::View &view = forth.TestGetView();
+  std::vector<forth::StackEffect::Summary> summaries;
+  std::vector<uint32_t> needs;
+  forth::StackEffect::Analyze( view.m_code, view.m_codeSize, view.m_lines,
+    view.m_lineCount, summaries, needs);
+  BOOST_REQUIRE_EQUAL( summaries.size(), forth.CountProgramLines());
+  BOOST_REQUIRE_EQUAL( needs.size(), view.m_codeSize);
+
+  const size_t kLine = TestRuntime::kOpCodeFirstUser;
+  BOOST_REQUIRE( summaries[kLine].m_proven);
+  BOOST_CHECK_EQUAL( summaries[kLine].m_need, 0);
+  BOOST_CHECK_EQUAL( summaries[kLine].m_least, 0);
+
+  // The loop ends with the zero dropped
+  BOOST_REQUIRE( summaries[kLine + 1].m_proven);
+  BOOST_CHECK_EQUAL( summaries[kLine + 1].m_need, 2);
+  BOOST_CHECK_EQUAL( summaries[kLine + 1].m_least, -1);
+
+  BOOST_REQUIRE( summaries[kLine + 2].m_proven);
+  BOOST_CHECK_EQUAL( summaries[kLine + 2].m_need, 1);
+  BOOST_CHECK_EQUAL( summaries[kLine + 2].m_least, 0);
+
+  BOOST_REQUIRE( summaries[kLine + 3].m_proven);
+  BOOST_CHECK_EQUAL( summaries[kLine + 3].m_need, 2);
+  BOOST_CHECK_EQUAL( summaries[kLine + 3].m_least, -1);
+
+  BOOST_REQUIRE( summaries[kLine + 5].m_proven);
+  BOOST_CHECK_EQUAL( summaries[kLine + 5].m_need, 1);
+  BOOST_CHECK_EQUAL( summaries[kLine + 5].m_least, 0);
+
+  // A computed call, recursion and a shrinking loop aren't proven
+  BOOST_CHECK( !summaries[kLine + 6].m_proven);
+  BOOST_CHECK( !summaries[kLine + 7].m_proven);
+  BOOST_CHECK( !summaries[kLine + 8].m_proven);
+
+  // 24: mod not, the not needs one cell, the end none
+  const forth::Program::Line &line = view.m_lines[kLine + 3];
+  BOOST_CHECK_EQUAL( needs[line.m_offset], 2);
+  BOOST_CHECK_EQUAL( needs[line.m_offset + 2], 1);
+  BOOST_CHECK_EQUAL( needs[line.End()], 0);
+  BOOST_CHECK_EQUAL( needs[view.m_lines[kLine + 6].m_offset],
+    forth::StackEffect::kUnknown);
+
+  // The decoder enters the unchecked copy with enough cells
+  BOOST_CHECK_EQUAL( view.m_decoded[line.m_offset].m_unchecked, 3);
+  BOOST_CHECK_EQUAL( view.m_decoded[line.m_offset + view.m_codeSize].m_op,
+    forth::kOpModNotUnchecked);
+  BOOST_CHECK_EQUAL(
+    view.m_decoded[view.m_lines[kLine + 6].m_offset].m_unchecked, 0);
+}
+
+/// Check that lines run unchecked fail like checked ones
+BOOST_AUTO_TEST_CASE(UncheckedLines)
+{
+  const size_t kLine = TestRuntime::kOpCodeFirstUser;
+
+  // 21: 5 22 call
+  // 22: dup plus plus, which needs two cells
+  TestRuntime forth;
+  forth.Compile( kLine, 5);
+  TestCompileCall( forth, kLine, kLine + 1);
+  TestCompileCall( forth, kLine + 1, TestRuntime::kOpCodeDup);
+  TestCompileCall( forth, kLine + 1, TestRuntime::kOpCodePlus);
+  TestCompileCall( forth, kLine + 1, TestRuntime::kOpCodePlus);
+
+  // Entered with one cell, the line runs checked up to the second plus,
+  // which takes the 10 before it underflows
+  forth.ResetIp();
+  BOOST_CHECK_THROW( forth.Run(), TestRuntime::StackUnderflow);
+  BOOST_CHECK_EQUAL( forth.TestDataStackSize(), 0);
+  BOOST_CHECK_EQUAL( forth.TestGetIpLine(), kLine + 1);
+
+  // With two cells it runs unchecked. The tail call left no frame, so line
+  // 22 returns to nowhere, which is reported at the end of line 21.
+  TestRuntime deep;
+  deep.ShareProgram( forth);
+  deep.PushDataNoExec( 1);
+  BOOST_CHECK_THROW( deep.Run(), TestRuntime::StackUnderflow);
+  BOOST_REQUIRE_EQUAL( deep.TestDataStackSize(), 1);
+  BOOST_CHECK_EQUAL( deep.TestDataStackAt( 0), 11);
+  BOOST_CHECK( deep.IsIpAt( kLine, 3));
+
+  // Stopping in the unchecked copy resumes where it stopped
+  TestRuntime stepped;
+  stepped.ShareProgram( forth);
+  stepped.PushDataNoExec( 1);
+  stepped.Run( 3);
+  BOOST_CHECK_EQUAL( stepped.TestGetIpLine(), kLine + 1);
+  BOOST_CHECK_EQUAL( stepped.TestGetIpCol(), 2);
+  BOOST_CHECK_THROW( stepped.Run(), TestRuntime::StackUnderflow);
+  BOOST_REQUIRE_EQUAL( stepped.TestDataStackSize(), 1);
+  BOOST_CHECK_EQUAL( stepped.TestDataStackAt( 0), 11);
+}
+
+/// Run from a line and check the message of the stack error it ends with
+template <typename T>
+static void
+TestRunError(
+  TestRuntime &a_forth,
+  size_t a_line,
+  const std::string &a_message)
+{
+  a_forth.ResetIp( a_line);
+  try
+  {
+    a_forth.Run();
+    BOOST_ERROR( "No error");
+  }
+  catch (const T &ex)
+  {
+    BOOST_CHECK_EQUAL( std::string( ex.what()), a_message);
+  }
+  BOOST_CHECK_EQUAL( a_forth.TestDataStackSize(), 0);
+  BOOST_CHECK_EQUAL( a_forth.TestReturnStackSize(), 0);
+}
+
+/// Check that full stacks are found by the guard pages
+BOOST_AUTO_TEST_CASE(StackGuard)
+{
+  const size_t kLine = TestRuntime::kOpCodeFirstUser;
+
+  // 21: drop drop
+  TestRuntime forth( 16, 16);
+  TestCompileCall( forth, kLine, TestRuntime::kOpCodeDrop);
+  TestCompileCall( forth, kLine, TestRuntime::kOpCodeDrop);
+
+  // 22: 22 call drop
+  TestCompileCall( forth, kLine + 1, kLine + 1);
+  TestCompileCall( forth, kLine + 1, TestRuntime::kOpCodeDrop);
+
+  // 23: 1 23 call
+  forth.Compile( kLine + 2, 1);
+  TestCompileCall( forth, kLine + 2, kLine + 2);
+
+  // 24: dup 0 exit
+  TestCompileCall( forth, kLine + 3, TestRuntime::kOpCodeDup);
+  forth.Compile( kLine + 3, 0);
+  TestCompileCall( forth, kLine + 3, TestRuntime::kOpCodeExit);
+  forth.Seal();
+  forth.SetFileName( "file");
+
+  // Plain memory unless asked for
+  const forth::FixedStack<TestRuntime::Cell> &stack =
+    forth.TestGetDataStack();
+  BOOST_CHECK( !stack.IsGuarded());
+  BOOST_CHECK_EQUAL( stack.Capacity(), 16);
+
+  // The items fill whole pages and touch both guard pages
+  forth.PushDataNoExec( 7);
+  forth.SetStackGuard( true);
+  BOOST_CHECK( stack.IsGuarded());
+  BOOST_CHECK_EQUAL( (stack.Capacity() + stack.kSpare) *
+    sizeof( TestRuntime::Cell) % sysconf( _SC_PAGESIZE), 0);
+  const TestRuntime::Cell * storage = stack.Bottom() - stack.kSpare;
+  const TestRuntime::Cell * end = stack.Bottom() + stack.Capacity();
+  BOOST_CHECK( stack.IsBelow( storage - 1));
+  BOOST_CHECK( !stack.IsBelow( storage));
+  BOOST_CHECK( stack.IsAbove( end));
+  BOOST_CHECK( !stack.IsAbove( end - 1));
+  BOOST_REQUIRE_EQUAL( forth.TestDataStackSize(), 1);
+  BOOST_CHECK_EQUAL( forth.TestDataStackAt( 0), 7);
+  forth.TestPopData();
+
+  // Run leaves full stacks to the guard pages
+  TestRunError<TestRuntime::StackOverflow>( forth, kLine + 1,
+    "file(22): return stack overflow");
+  TestRunError<TestRuntime::StackOverflow>( forth, kLine + 2,
+    "file(23): data stack overflow");
+
+  // Too few items are still checked. Skip the checks as if the drops had
+  // been proven, the second one reads from the lower guard page.
+  TestRunError<TestRuntime::StackUnderflow>( forth, kLine,
+    "file(21): data stack underflow");
+  forth.TestSetOperation( kLine, 0, forth::kOpDropUnchecked);
+  forth.TestSetOperation( kLine, 2, forth::kOpDropUnchecked);
+  TestRunError<TestRuntime::StackUnderflow>( forth, kLine,
+    "file(21): data stack underflow");
+
+  // The runtime goes on after the fault
+  forth.ResetIp( kLine + 3);
+  forth.PushDataNoExec( 5);
+  BOOST_CHECK_EQUAL( forth.Run().m_code, 0);
+  BOOST_REQUIRE_EQUAL( forth.TestDataStackSize(), 2);
+  BOOST_CHECK_EQUAL( forth.TestDataStackAt( 1), 5);
+
+  // Back to plain memory of the size asked for
+  forth.SetStackGuard( false);
+  BOOST_CHECK( !stack.IsGuarded());
+  BOOST_CHECK_EQUAL( stack.Capacity(), 16);
+  BOOST_REQUIRE_EQUAL( forth.TestDataStackSize(), 2);
+  BOOST_CHECK_EQUAL( forth.TestDataStackAt( 1), 5);
+}
+
+/// Check the report of certain underflows
+BOOST_AUTO_TEST_CASE(Lint)
+{
+  TestRuntime forth;
+  std::string source = TestMemoSource();
+  forth::Parser::ParseFromMemory( "file", source.data(), source.size(),
+    forth);
+  BOOST_CHECK( forth.Lint().empty());
+
+  // 21: 1 22 call 23 call
+  // 22: dup plus plus
+  // 23: 1 emit
+  std::string bad( TestRuntime::kOpCodeFirstUser - 1, '\n');
+  bad += "1 22 42 23 42\n9 42 0 42 0 42\n1 12 42\n";
+  TestRuntime broken;
+  forth::Parser::ParseFromMemory( "file", bad.data(), bad.size(), broken);
+  broken.SetFileName( "file");
+  std::vector<std::string> messages = broken.Lint();
+  BOOST_REQUIRE_EQUAL( messages.size(), 1);
+  BOOST_CHECK_EQUAL( messages[0], "file(22): data stack underflow");
+}
+
+BOOST_AUTO_TEST_CASE(Memoization)
+{
+  std::string source = TestMemoSource();
+  TestRuntime plain;
+  forth::Parser::ParseFromMemory( "file", source.data(), source.size(),
+    plain);
+  BOOST_CHECK_EQUAL( plain.Run().m_code, 500);
+  BOOST_CHECK( plain.GetMemoCache() == NULL);
+
+  const size_t kLine = TestRuntime::kOpCodeFirstUser;
+  TestRuntime forth;
+  forth.ShareProgram( plain);
+  forth.SetMemoization( 64);
+  BOOST_CHECK_EQUAL( forth.Run().m_code, 500);
+  BOOST_REQUIRE( forth.GetMemoCache() != NULL);
+  BOOST_CHECK_EQUAL( forth.GetMemoCache()->CountHits() +
+    forth.GetMemoCache()->CountMisses(), 1000 + 20);
+  BOOST_CHECK_GE( forth.GetMemoCache()->CountHits(), 990);
+  BOOST_CHECK_EQUAL( forth.TestReturnStackSize(), 0);
+
+  // Calls stopped by the step limit are recorded once they return
+  forth.SetMemoization( 64);
+  forth.ResetIp();
+  TestRuntime::RunResult result;
+  do
+    result = forth.Run( 7);
+  while ( result.m_status == TestRuntime::RunResult::kStepLimit);
+  BOOST_CHECK_EQUAL( result.m_code, 500);
+  BOOST_CHECK_GE( forth.GetMemoCache()->CountHits(), 990);
+
+  // A shallow stack runs the line, which reports the underflow
+  forth.ResetIp( kLine + 5);
+  BOOST_CHECK_THROW( forth.Run(), TestRuntime::StackUnderflow);
+}
+
+/// Check that the analyses follow calls nested deeper than the native stack
+BOOST_AUTO_TEST_CASE(DeepCalls)
+{
+  // 21: 43 call exit
+  // 43: 44 call 1 plus
+  // ...
+  // last: 0
+  //
+  // The chain starts behind line 42, as 42 is the opcode of call.
+  const size_t kLines = 200000;
+  const size_t kFirst = TestRuntime::kOpCodeCall + 1;
+  std::ostringstream source;
+  source << std::string( TestRuntime::kOpCodeFirstUser - 1, '\n');
+  source << kFirst << " 42 14 42\n";
+  source << std::string( kFirst - TestRuntime::kOpCodeFirstUser - 1, '\n');
+  for (size_t row = kFirst; row < kFirst + kLines - 1; ++row)
+    source << (row + 1) << " 42 1 0 42\n";
+  source << "0\n";
+  std::string text = source.str();
+
+  TestRuntime plain;
+  forth::Parser::ParseFromMemory( "file", text.data(), text.size(), plain);
+  BOOST_CHECK_EQUAL( plain.Run().m_code, kLines - 1);
+
+  TestRuntime memoized;
+  memoized.ShareProgram( plain);
+  memoized.SetMemoization( 16);
+  BOOST_CHECK_EQUAL( memoized.Run().m_code, kLines - 1);
+}
+
+/** Compile a test program. Line 21 pushes the input and calls line 22, which
+ * consists of the given numbers.
+ */
+static void
+TestCompileSequence(
+  TestRuntime &a_forth,
+  const std::vector<TestRuntime::Cell> &a_input,
+  const std::vector<TestRuntime::Cell> &a_sequence)
+{
+  for (size_t i = 0; i < a_input.size(); ++i)
+    a_forth.Compile( TestRuntime::kOpCodeFirstUser, a_input[i]);
+  TestCompileCall( a_forth,
+    TestRuntime::kOpCodeFirstUser,
+    TestRuntime::kOpCodeFirstUser + 1);
+
+  for (size_t i = 0; i < a_sequence.size(); ++i)
+    a_forth.Compile( TestRuntime::kOpCodeFirstUser + 1, a_sequence[i]);
+}
+
+/** Run a sequence with superinstructions and step by step. Both runs end when
+ * line 21 returns. Compare the data stacks.
+ */
+static void
+TestFusedSequence(
+  const char * a_input,
+  const char * a_sequence)
+{
+  std::vector<TestRuntime::Cell> input;
+  std::vector<TestRuntime::Cell> sequence;
+  TestRuntime::Cell nr;
+
+  std::istringstream inputParser( a_input);
+  while (inputParser >> nr)
+    input.push_back( nr);
+  std::istringstream sequenceParser( a_sequence);
+  while (sequenceParser >> nr)
+    sequence.push_back( nr);
+
+  TestRuntime fused;
+  TestCompileSequence( fused, input, sequence);
+  fused.ResetIp();
+  BOOST_CHECK_THROW( fused.Run(), TestRuntime::StackUnderflow);
+
+  TestRuntime stepped;
+  TestCompileSequence( stepped, input, sequence);
+  stepped.ResetIp();
+  BOOST_CHECK_THROW( for (;; ) stepped.ComputeStep(),
+    TestRuntime::StackUnderflow);
+
+  BOOST_TEST_MESSAGE( "Sequence " << a_sequence << " on " << a_input);
+  BOOST_CHECK( fused.GetDataStack() == stepped.GetDataStack());
+}
+
+/// Check that the superinstructions compute the same as their parts.
+BOOST_AUTO_TEST_CASE(Superinstructions)
+{
+  // dup not not
+  TestFusedSequence( "5", "9 42 7 42 7 42");
+  TestFusedSequence( "0", "9 42 7 42 7 42");
+  TestFusedSequence( "", "9 42 7 42 7 42");
+
+  // swap over plus
+  TestFusedSequence( "3 4", "8 42 15 42 0 42");
+  TestFusedSequence( "3", "8 42 15 42 0 42");
+
+  // Count down to zero
+  TestFusedSequence( "5", "1 1 42 11 42");
+  TestFusedSequence( "1 6", "2 1 42 11 42");
+  TestFusedSequence( "", "1 1 42 11 42");
+
+  // Literal arithmetic
+  TestFusedSequence( "100", "7 0 42");
+  TestFusedSequence( "100", "7 1 42");
+  TestFusedSequence( "100", "7 2 42");
+  TestFusedSequence( "100", "7 3 42");
+  TestFusedSequence( "100", "7 4 42");
+  TestFusedSequence( "1", "7 8 42");
+  TestFusedSequence( "", "7 0 42");
+  TestFusedSequence( "", "7 8 42");
+
+  // mod not
+  TestFusedSequence( "12 4", "4 42 7 42");
+  TestFusedSequence( "12 5", "4 42 7 42");
+  TestFusedSequence( "12", "4 42 7 42");
+
+  // swap drop
+  TestFusedSequence( "1 2", "8 42 10 42");
+  TestFusedSequence( "1", "8 42 10 42");
+
+  // Push blocks
+  TestFusedSequence( "1 2 3 4", "5 6 7 8 9 0 42");
+  TestFusedSequence( "", "5 6 7 8 9 10 11 12");
+}
+
+/// Check that runs of literals are pushed as blocks.
+BOOST_AUTO_TEST_CASE(PushBlocks)
+{
+  const size_t kLine = TestRuntime::kOpCodeFirstUser;
+
+  // 21: 1 2 3 4 5 6 plus
+  TestRuntime forth( 5);
+  for (TestRuntime::Cell i = 1; i <= 6; ++i)
+    forth.Compile( kLine, i);
+  TestCompileCall( forth, kLine, TestRuntime::kOpCodePlus);
+  forth.Seal();
+
+  // The last literal is fused with the plus, the run before it is a block
+  BOOST_CHECK_EQUAL( forth.TestGetOperation( kLine, 0),
+    forth::kOpPushBlock);
+  BOOST_CHECK_EQUAL( forth.TestGetOperation( kLine, 1),
+    forth::kOpPushBlock);
+  BOOST_CHECK_EQUAL( forth.TestGetOperation( kLine, 2), forth::kOpLiteral);
+  BOOST_CHECK_EQUAL( forth.TestGetOperation( kLine, 5),
+    forth::kOpLiteralPlus);
+
+  // The block doesn't fit, the literals are pushed until the stack is full
+  forth.ResetIp();
+  forth.PushDataNoExec( 0);
+  forth.PushDataNoExec( 0);
+  BOOST_CHECK_THROW( forth.Run(), TestRuntime::StackOverflow);
+  BOOST_REQUIRE_EQUAL( forth.TestDataStackSize(), 5);
+  BOOST_CHECK_EQUAL( forth.TestDataStackAt( 4), 3);
+
+  // Otherwise, all of them are pushed at once
+  TestRuntime wide;
+  wide.ShareProgram( forth);
+  TestRuntime::RunResult result = wide.Run( 1);
+  BOOST_CHECK_EQUAL( result.m_status, TestRuntime::RunResult::kStepLimit);
+  BOOST_CHECK_EQUAL( wide.TestDataStackSize(), 5);
+  BOOST_CHECK_THROW( wide.Run(), TestRuntime::StackUnderflow);
+  BOOST_REQUIRE_EQUAL( wide.TestDataStackSize(), 5);
+  BOOST_CHECK_EQUAL( wide.TestDataStackAt( 4), 11);
+}
+
+/// Check that calls of short straight lines run an inlined copy
+BOOST_AUTO_TEST_CASE(InlinedLines)
+{
+  const size_t kLine = TestRuntime::kOpCodeFirstUser;
+
+  // 21: 22 call 22 call 1 plus 0 exit
+  // 22: dup plus
+  // 23: 24 call 0 exit
+  // 24: 1 minus dup loop
+  // 25: 26 call 0 exit
+  // 26: plus
+  TestRuntime forth;
+  TestCompileCall( forth, kLine, kLine + 1);
+  TestCompileCall( forth, kLine, kLine + 1);
+  forth.Compile( kLine, 1);
+  TestCompileCall( forth, kLine, TestRuntime::kOpCodePlus);
+  forth.Compile( kLine, 0);
+  TestCompileCall( forth, kLine, TestRuntime::kOpCodeExit);
+  TestCompileCall( forth, kLine + 1, TestRuntime::kOpCodeDup);
+  TestCompileCall( forth, kLine + 1, TestRuntime::kOpCodePlus);
+  TestCompileCall( forth, kLine + 2, kLine + 3);
+  forth.Compile( kLine + 2, 0);
+  TestCompileCall( forth, kLine + 2, TestRuntime::kOpCodeExit);
+  forth.Compile( kLine + 3, 1);
+  TestCompileCall( forth, kLine + 3, TestRuntime::kOpCodeMinus);
+  TestCompileCall( forth, kLine + 3, TestRuntime::kOpCodeDup);
+  TestCompileCall( forth, kLine + 3, TestRuntime::kOpCodeLoop);
+  TestCompileCall( forth, kLine + 4, kLine + 5);
+  forth.Compile( kLine + 4, 0);
+  TestCompileCall( forth, kLine + 4, TestRuntime::kOpCodeExit);
+  TestCompileCall( forth, kLine + 5, TestRuntime::kOpCodePlus);
+  forth.Seal();
+
+  // A line with a loop is still called
+  BOOST_CHECK_EQUAL( forth.TestGetOperation( kLine, 0),
+    forth::kOpInlineLine);
+  BOOST_CHECK_EQUAL( forth.TestGetOperation( kLine, 2),
+    forth::kOpInlineLine);
+  BOOST_CHECK_EQUAL( forth.TestGetOperation( kLine + 2, 0),
+    forth::kOpCallLine);
+  const forth::Program::View &view = forth.TestGetView();
+  BOOST_CHECK_GT( view.m_decodedSize, 2 * view.m_codeSize);
+
+  // Stopping inside a copy leaves the IP in the line, with its frame
+  forth.ResetIp();
+  forth.PushDataNoExec( 3);
+  TestRuntime::RunResult result = forth.Run( 2);
+  BOOST_CHECK_EQUAL( result.m_status, TestRuntime::RunResult::kStepLimit);
+  BOOST_CHECK( forth.IsIpAt( kLine + 1, 2));
+  BOOST_CHECK_EQUAL( forth.TestReturnStackSize(), 1);
+  BOOST_CHECK_EQUAL( forth.TestDataStackSize(), 2);
+  result = forth.Run();
+  BOOST_CHECK_EQUAL( result.m_status, TestRuntime::RunResult::kExited);
+  BOOST_REQUIRE_EQUAL( forth.TestDataStackSize(), 1);
+  BOOST_CHECK_EQUAL( forth.TestDataStackAt( 0), 13);
+
+  // Errors are reported in the line inlined, at its first instruction
+  TestRuntime empty;
+  empty.ShareProgram( forth);
+  empty.ResetIp();
+  BOOST_CHECK_THROW( empty.Run(), TestRuntime::StackUnderflow);
+  BOOST_CHECK_EQUAL( empty.TestGetIpLine(), kLine + 1);
+  BOOST_CHECK_EQUAL( empty.TestReturnStackSize(), 1);
+
+  // ... and at its last one, which would go on in the caller
+  TestRuntime last;
+  last.ShareProgram( forth);
+  last.ResetIp( kLine + 4);
+  last.PushDataNoExec( 1);
+  BOOST_CHECK_THROW( last.Run(), TestRuntime::StackUnderflow);
+  BOOST_CHECK( last.IsIpAt( kLine + 5, 2));
+  BOOST_CHECK_EQUAL( last.TestReturnStackSize(), 1);
+  BOOST_CHECK_EQUAL( last.TestDataStackSize(), 0);
+
+  // A full stack is reported at the instruction that pushes
+  TestRuntime full( 1);
+  full.ShareProgram( forth);
+  full.ResetIp();
+  full.PushDataNoExec( 3);
+  BOOST_CHECK_THROW( full.Run(), TestRuntime::StackOverflow);
+  BOOST_CHECK( full.IsIpAt( kLine + 1, 0));
+  BOOST_CHECK_EQUAL( full.TestReturnStackSize(), 1);
+
+  // Without fusion, nothing is inlined either
+  forth.SetFusion( false);
+  forth.Seal();
+  BOOST_CHECK_EQUAL( forth.TestGetOperation( kLine, 0),
+    forth::kOpCallLine);
+  BOOST_CHECK_EQUAL( view.m_decodedSize, 2 * view.m_codeSize);
+}
+
+/// Check that the fusion recorder names every superinstruction right
+BOOST_AUTO_TEST_CASE(FusionRecorderNames)
+{
+  forth::FusionRecorder recorder;
+  std::vector<forth::Operation> sequence;
+  sequence.push_back( forth::kOpSwap);
+  sequence.push_back( forth::kOpDrop);
+  recorder.CountSequence( sequence);
+  sequence[1] = forth::kOpPushBlock;
+  recorder.CountSequence( sequence);
+
+  std::ostringstream table;
+  recorder.WriteTable( table);
+  BOOST_CHECK( table.str().find( "FORTH_FUSE( SwapDrop)") !=
+    std::string::npos);
+  BOOST_CHECK( table.str().find( "swap push_block") != std::string::npos);
 }
 
 /// Test the swap intrinsic
@@ -352,6 +1557,92 @@ BOOST_AUTO_TEST_CASE(Looping)
   BOOST_CHECK_EQUAL( forth.TestPopData(), 5 + 7 * 4);
 }
 
+/// Test that exit stops the program and reports the code
+BOOST_AUTO_TEST_CASE(Exit)
+{
+  TestRuntime forth;
+
+  // 21: 5 7 exit 9
+  forth.Compile( TestRuntime::kOpCodeFirstUser, 5);
+  forth.Compile( TestRuntime::kOpCodeFirstUser, 7);
+  TestCompileCall( forth,
+    TestRuntime::kOpCodeFirstUser,
+    TestRuntime::kOpCodeExit);
+  forth.Compile( TestRuntime::kOpCodeFirstUser, 9);
+
+  forth.ResetIp();
+  TestRuntime::RunResult result = forth.Run();
+  BOOST_CHECK_EQUAL( result.m_status, TestRuntime::RunResult::kExited);
+  BOOST_CHECK_EQUAL( result.m_code, 7);
+  BOOST_CHECK( forth.HasExited());
+  BOOST_REQUIRE_EQUAL( forth.TestDataStackSize(), 1);
+  BOOST_CHECK_EQUAL( forth.TestDataStackAt( 0), 5);
+
+  // Running again does nothing
+  result = forth.Run();
+  BOOST_CHECK_EQUAL( result.m_code, 7);
+  BOOST_CHECK_EQUAL( forth.TestDataStackSize(), 1);
+
+  // Stepping stops at the exit as well
+  forth.ResetIp();
+  BOOST_CHECK( !forth.HasExited());
+  for (int i = 0; i < 10; ++i)
+    forth.ComputeStep();
+  BOOST_CHECK( forth.HasExited());
+  BOOST_CHECK_EQUAL( forth.GetExitCode(), 7);
+  BOOST_CHECK_EQUAL( forth.TestDataStackSize(), 2);
+  BOOST_CHECK( forth.IsIpAt( TestRuntime::kOpCodeFirstUser, 4));
+}
+
+/// Read what has been written to a pipe so far
+static std::string
+TestReadPipe(
+  int a_fd)
+{
+  char buffer[256];
+  ssize_t len = read( a_fd, buffer, sizeof( buffer));
+  return std::string( buffer, (len > 0) ? len : 0);
+}
+
+/// Test the buffered output of the emit instruction
+BOOST_AUTO_TEST_CASE(Emit)
+{
+  int fds[2];
+  BOOST_REQUIRE_EQUAL( pipe( fds), 0);
+
+  TestRuntime forth;
+  forth.SetOutputFile( fds[1]);
+
+  // 21: 72 emit 105 emit 10 emit
+  forth.Compile( TestRuntime::kOpCodeFirstUser, 72);
+  TestCompileCall( forth,
+    TestRuntime::kOpCodeFirstUser,
+    TestRuntime::kOpCodeEmit);
+  forth.Compile( TestRuntime::kOpCodeFirstUser, 105);
+  TestCompileCall( forth,
+    TestRuntime::kOpCodeFirstUser,
+    TestRuntime::kOpCodeEmit);
+  forth.Compile( TestRuntime::kOpCodeFirstUser, 10);
+  TestCompileCall( forth,
+    TestRuntime::kOpCodeFirstUser,
+    TestRuntime::kOpCodeEmit);
+
+  // The output arrives when it is flushed
+  forth.ResetIp();
+  BOOST_CHECK_THROW( forth.Run(), TestRuntime::StackUnderflow);
+  forth.FlushOutput();
+  BOOST_CHECK_EQUAL( TestReadPipe( fds[0]), "Hi\n");
+
+  // In line buffered mode, the newline flushes
+  forth.SetLineBuffered( true);
+  forth.ResetIp();
+  BOOST_CHECK_THROW( forth.Run(), TestRuntime::StackUnderflow);
+  BOOST_CHECK_EQUAL( TestReadPipe( fds[0]), "Hi\n");
+
+  close( fds[0]);
+  close( fds[1]);
+}
+
 /// Test the over instruction
 BOOST_AUTO_TEST_CASE(Over)
 {
@@ -419,18 +1710,23 @@ BOOST_AUTO_TEST_CASE(ParseOk)
   TestRuntime forth;
   TestParser::TestParseFromStream( "file", file, forth);
 
-  const std::vector< std::vector< TestRuntime::Cell > > &prg =
-    forth.TestGetProgram();
-
-  BOOST_REQUIRE_EQUAL( prg.size(), TestRuntime::kOpCodeFirstUser + 3);
-  BOOST_REQUIRE_EQUAL( prg[TestRuntime::kOpCodeFirstUser].size(), 19);
-
-  BOOST_CHECK_EQUAL( prg[TestRuntime::kOpCodeFirstUser][0], 5);
-  BOOST_CHECK_EQUAL( prg[TestRuntime::kOpCodeFirstUser][1], 9);
-  BOOST_CHECK_EQUAL( prg[TestRuntime::kOpCodeFirstUser][18], 42);
-
-  BOOST_REQUIRE_EQUAL( prg[TestRuntime::kOpCodeFirstUser + 1].size(), 3);
-  BOOST_REQUIRE_EQUAL( prg[TestRuntime::kOpCodeFirstUser + 2].size(), 3);
+  BOOST_REQUIRE_EQUAL( forth.CountProgramLines(),
+    TestRuntime::kOpCodeFirstUser + 3);
+  BOOST_REQUIRE_EQUAL(
+    forth.CountInstructionsInLine( TestRuntime::kOpCodeFirstUser),
+    19);
+
+  BOOST_CHECK_EQUAL( forth.TestGetCell( TestRuntime::kOpCodeFirstUser, 0), 5);
+  BOOST_CHECK_EQUAL( forth.TestGetCell( TestRuntime::kOpCodeFirstUser, 1), 9);
+  BOOST_CHECK_EQUAL( forth.TestGetCell( TestRuntime::kOpCodeFirstUser, 18),
+    42);
+
+  BOOST_REQUIRE_EQUAL(
+    forth.CountInstructionsInLine( TestRuntime::kOpCodeFirstUser + 1),
+    3);
+  BOOST_REQUIRE_EQUAL(
+    forth.CountInstructionsInLine( TestRuntime::kOpCodeFirstUser + 2),
+    3);
 
   forth.ResetIp();
 
@@ -500,18 +1796,23 @@ BOOST_AUTO_TEST_CASE(ParseSpaceAndComments)
 
   BOOST_REQUIRE_EQUAL( hasCaughtAnException, false);
 
-  const std::vector< std::vector< TestRuntime::Cell > > &prg =
-    forth.TestGetProgram();
+  BOOST_REQUIRE_EQUAL( forth.CountProgramLines(),
+    TestRuntime::kOpCodeFirstUser + 5);
+  BOOST_REQUIRE_EQUAL(
+    forth.CountInstructionsInLine( TestRuntime::kOpCodeFirstUser),
+    19);
 
-  BOOST_REQUIRE_EQUAL( prg.size(), TestRuntime::kOpCodeFirstUser + 5);
-  BOOST_REQUIRE_EQUAL( prg[TestRuntime::kOpCodeFirstUser].size(), 19);
+  BOOST_CHECK_EQUAL( forth.TestGetCell( TestRuntime::kOpCodeFirstUser, 0), 5);
+  BOOST_CHECK_EQUAL( forth.TestGetCell( TestRuntime::kOpCodeFirstUser, 1), 9);
+  BOOST_CHECK_EQUAL( forth.TestGetCell( TestRuntime::kOpCodeFirstUser, 18),
+    42);
 
-  BOOST_CHECK_EQUAL( prg[TestRuntime::kOpCodeFirstUser][0], 5);
-  BOOST_CHECK_EQUAL( prg[TestRuntime::kOpCodeFirstUser][1], 9);
-  BOOST_CHECK_EQUAL( prg[TestRuntime::kOpCodeFirstUser][18], 42);
-
-  BOOST_REQUIRE_EQUAL( prg[TestRuntime::kOpCodeFirstUser + 3].size(), 3);
-  BOOST_REQUIRE_EQUAL( prg[TestRuntime::kOpCodeFirstUser + 4].size(), 3);
+  BOOST_REQUIRE_EQUAL(
+    forth.CountInstructionsInLine( TestRuntime::kOpCodeFirstUser + 3),
+    3);
+  BOOST_REQUIRE_EQUAL(
+    forth.CountInstructionsInLine( TestRuntime::kOpCodeFirstUser + 4),
+    3);
 
   forth.ResetIp();
 
@@ -564,10 +1865,54 @@ BOOST_AUTO_TEST_CASE(ParseFail)
   }
 
   BOOST_REQUIRE_EQUAL( hasCaughtAnException, false);
-  const std::vector< std::vector< TestRuntime::Cell > > &prg =
-    forth.TestGetProgram();
+  BOOST_REQUIRE_EQUAL( forth.CountProgramLines(),
+    TestRuntime::kOpCodeFirstUser + 1);
+  BOOST_CHECK_EQUAL(
+    forth.CountInstructionsInLine( TestRuntime::kOpCodeFirstUser),
+    1);
+  BOOST_CHECK_EQUAL( forth.TestGetCell( TestRuntime::kOpCodeFirstUser, 0), 5);
+}
+
+/// Test the corner cases of reading numbers
+BOOST_AUTO_TEST_CASE(ParseNumbers)
+{
+  std::stringstream file;
+
+  // Add the header
+  for (unsigned i = 1; i < TestRuntime::kOpCodeFirstUser; ++i)
+    file << std::endl;
+
+  // 21: Signs, and a number glued to a word
+  file << " 1 +2\t-3 4x 5" << std::endl;
+
+  // 22: The largest numbers, then one that doesn't fit
+  file << "2147483647 -2147483648 2147483648 7" << std::endl;
+
+  // 23: A line without a newline is incomplete
+  file << "9";
+
+  TestRuntime forth;
+  TestParser::TestParseFromStream( "file", file, forth);
+
+  BOOST_REQUIRE_EQUAL( forth.CountProgramLines(),
+    TestRuntime::kOpCodeFirstUser + 2);
 
-  BOOST_REQUIRE_EQUAL( prg.size(), TestRuntime::kOpCodeFirstUser + 1);
-  BOOST_CHECK_EQUAL( prg[TestRuntime::kOpCodeFirstUser].size(), 1);
-  BOOST_CHECK_EQUAL( prg[TestRuntime::kOpCodeFirstUser][0], 5);
+  BOOST_REQUIRE_EQUAL(
+    forth.CountInstructionsInLine( TestRuntime::kOpCodeFirstUser),
+    4);
+  BOOST_CHECK_EQUAL( forth.TestGetCell( TestRuntime::kOpCodeFirstUser, 0), 1);
+  BOOST_CHECK_EQUAL( forth.TestGetCell( TestRuntime::kOpCodeFirstUser, 1), 2);
+  BOOST_CHECK_EQUAL( forth.TestGetCell( TestRuntime::kOpCodeFirstUser, 2),
+    -3);
+  BOOST_CHECK_EQUAL( forth.TestGetCell( TestRuntime::kOpCodeFirstUser, 3), 4);
+
+  BOOST_REQUIRE_EQUAL(
+    forth.CountInstructionsInLine( TestRuntime::kOpCodeFirstUser + 1),
+    2);
+  BOOST_CHECK_EQUAL(
+    forth.TestGetCell( TestRuntime::kOpCodeFirstUser + 1, 0),
+    2147483647);
+  BOOST_CHECK_EQUAL(
+    forth.TestGetCell( TestRuntime::kOpCodeFirstUser + 1, 1),
+    -2147483647 - 1);
 }
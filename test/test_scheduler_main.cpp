@@ -0,0 +1,129 @@
+#define BOOST_TEST_MODULE TestScheduler
+#include <boost/test/unit_test.hpp>
+#include <forth/runtime.hpp>
+#include <forth/parser.hpp>
+#include <forth/scheduler.hpp>
+
+#include <sstream>
+#include <string>
+#include <vector>
+
+/// Parse a program whose first line is given, followed by helper lines
+static void
+Parse(
+  forth::Runtime &a_forth,
+  const std::string &a_lines)
+{
+  // Source lines are counted from 1
+  std::string source( forth::Runtime::kOpCodeFirstUser - 1, '\n');
+  source += a_lines;
+  forth::Parser::ParseFromMemory( "file", source.data(), source.size(),
+    a_forth);
+}
+
+BOOST_AUTO_TEST_CASE(ManyRuntimes)
+{
+  const size_t kRuntimes = 64;
+  std::vector<forth::Runtime *> runtimes;
+
+  forth::Scheduler scheduler( 4, 1000);
+  for (size_t i = 0; i < kRuntimes; ++i)
+  {
+    // 21: count down from 10000 and exit with 100 plus the index, a
+    // literal 42 would be a call
+    // 22: 1 minus loop
+    std::ostringstream lines;
+    lines << (10000 + i) << " 22 42 " << (100 + i) << " 14 42\n"
+          << "1 1 42 11 42\n";
+
+    forth::Runtime * forth = new forth::Runtime;
+    Parse( *forth, lines.str());
+    runtimes.push_back( forth);
+    BOOST_CHECK_EQUAL( scheduler.Spawn( forth), i);
+  }
+  scheduler.Wait();
+
+  for (size_t i = 0; i < kRuntimes; ++i)
+  {
+    BOOST_CHECK( !scheduler.HasFailed( i));
+    BOOST_CHECK( runtimes[i]->HasExited());
+    BOOST_CHECK_EQUAL( runtimes[i]->GetExitCode(), forth::Runtime::Cell( 100 + i));
+    delete runtimes[i];
+  }
+}
+
+BOOST_AUTO_TEST_CASE(Failure)
+{
+  // 21: drop from the empty stack
+  forth::Runtime forth;
+  Parse( forth, "10 42\n");
+
+  forth::Scheduler scheduler( 2);
+  size_t task = scheduler.Spawn( &forth);
+  scheduler.Wait();
+
+  BOOST_CHECK( scheduler.HasFailed( task));
+  BOOST_CHECK( !scheduler.GetError( task).empty());
+  BOOST_CHECK( !forth.HasExited());
+}
+
+BOOST_AUTO_TEST_CASE(ParkedOnInput)
+{
+  // 21: echo, then exit with 7
+  // 22: read dup emit 1 plus loop
+  forth::Runtime echo;
+  Parse( echo, "22 42 7 14 42\n13 42 9 42 12 42 1 0 42 11 42\n");
+  std::string output;
+  echo.SetOutputCapture( &output);
+  forth::InputQueue input;
+  echo.SetInput( &input);
+
+  // Many runtimes keep the workers busy while the echo waits
+  std::vector<forth::Runtime *> busy;
+  forth::Scheduler scheduler( 2, 100);
+  size_t task = scheduler.Spawn( &echo);
+  for (size_t i = 0; i < 8; ++i)
+  {
+    forth::Runtime * forth = new forth::Runtime;
+    Parse( *forth, "5000 22 42 0 14 42\n1 1 42 11 42\n");
+    busy.push_back( forth);
+    scheduler.Spawn( forth);
+  }
+
+  input.Push( "Hel");
+  input.Push( "lo");
+  input.Close();
+  scheduler.Wait();
+
+  BOOST_CHECK( !scheduler.HasFailed( task));
+  BOOST_CHECK( echo.HasExited());
+  BOOST_CHECK_EQUAL( echo.GetExitCode(), 7);
+  echo.FlushOutput();
+  BOOST_CHECK_EQUAL( output, "Hello");
+
+  for (size_t i = 0; i < busy.size(); ++i)
+  {
+    BOOST_CHECK( busy[i]->HasExited());
+    delete busy[i];
+  }
+}
+
+BOOST_AUTO_TEST_CASE(WaitingRun)
+{
+  // 21: read 1 plus exit
+  forth::Runtime forth;
+  Parse( forth, "13 42 1 0 42 14 42\n");
+  forth::InputQueue input;
+  forth.SetInput( &input);
+
+  BOOST_CHECK_EQUAL( forth.Run( 1000).m_status,
+    forth::Runtime::RunResult::kWaitingForInput);
+  BOOST_CHECK_EQUAL( forth.Run( 1000).m_status,
+    forth::Runtime::RunResult::kWaitingForInput);
+  BOOST_CHECK( !forth.HasExited());
+
+  input.Push( "A");
+  BOOST_CHECK_EQUAL( forth.Run( 1000).m_status,
+    forth::Runtime::RunResult::kExited);
+  BOOST_CHECK_EQUAL( forth.GetExitCode(), 'A' + 1);
+}